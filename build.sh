@@ -7,7 +7,7 @@ if [ ! -d $BUILD_DIR ]; then
     mkdir $BUILD_DIR
 fi
 
-if argument is passed, set build type
+# if argument is passed, set build type
 if [ $# -eq 1 ]; then
     if [ $1 -eq 1 ]; then
         BUILD_TYPE=1
@@ -18,7 +18,7 @@ if [ $# -eq 1 ]; then
 fi
 
 CC=gcc
-LDFLAGS="-lm"
+LDFLAGS="-lm -lrt"
 
 CFLAGS="-Wall -Wextra -Werror -pedantic -std=c99"
 # disable some warnings
@@ -32,4 +32,8 @@ fi
 
 cd $BUILD_DIR
 $CC $CFLAGS ../src/rtn_main.c -I../src $LDFLAGS -o rtn
+$CC $CFLAGS ../src/rtn_conv.c -I../src $LDFLAGS -o rtn-conv
+$CC $CFLAGS ../src/rtn_top.c -I../src $LDFLAGS -o rtn-top
+$CC $CFLAGS ../src/rtn_decomp.c -I../src $LDFLAGS -o rtn-decomp
+$CC $CFLAGS ../src/rtn_bench.c -I../src $LDFLAGS -o rtn-bench
 cd ..
@@ -12,6 +12,7 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +23,7 @@
 
 #include <linux/errqueue.h>
 #include <linux/ethtool.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/net_tstamp.h>
@@ -37,6 +39,7 @@
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -71,6 +74,8 @@ typedef intptr_t    isize;
 // ## Constants
 // ### Time 
 #define NSEC_PER_SEC    1000000000
+#define NSEC_PER_MSEC   1000000
+#define NSEC_PER_USEC   1000
 
 // ## String 
 #define cstr_eq(s1, s2)  (strcmp(s1, s2) == 0)
@@ -91,12 +96,181 @@ typedef intptr_t    isize;
 typedef enum {
     CLOCK_TYPE_REALTIME,
     CLOCK_TYPE_MONOTONIC,
+    CLOCK_TYPE_TSC,         // CLOCK_REALTIME through the calibrated TSC (see below)
 } clock_type;
 
 static inline i64 os_time_get_rt_ns    (void)     { struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts); return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec; }
 static inline i64 os_time_get_ns       (void)     { struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts); return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec; }
+static inline i64 os_time_get_tai_ns   (void)     { struct timespec ts; clock_gettime(CLOCK_TAI, &ts); return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec; }
 static inline i64 os_time_normalize_ts (i64 time) { return time / NSEC_PER_SEC * NSEC_PER_SEC; }
 
+// ### TSC Clock
+// Reading the TSC costs a few ns and never falls back to a system call, as
+// clock_gettime does when the kernel clocksource is not the TSC (some VMs and
+// containers). Only an invariant TSC (constant rate, runs in the deep C-states)
+// is used. The hot paths record raw cycles, converted to CLOCK_REALTIME ns
+// when the records are exported:
+//
+//     rt_ns = base_ns + (tsc - base_tsc) * mult >> 32
+//
+// `os_tsc_recalibrate` is called about every second by a SCHED_OTHER thread,
+// it follows the NTP/PTP adjustments of CLOCK_REALTIME. The readers take the
+// parameters under a sequence counter, they never block.
+__extension__ typedef __int128 i128;
+
+#define OS_TSC_CALIB_SAMPLES    16
+#define OS_TSC_CALIB_WAIT       (10 * NSEC_PER_MSEC)
+
+typedef struct os_tsc os_tsc;
+struct os_tsc
+{
+    u32     seq;            // odd while the parameters are updated
+    bool    enabled;
+    u64     base_tsc;
+    i64     base_ns;        // CLOCK_REALTIME at base_tsc
+    u64     mult;           // ns per cycle, 32.32 fixed point
+    i64     tai_offset;     // CLOCK_TAI - CLOCK_REALTIME
+};
+
+static inline os_tsc *os_tsc_get(void) { static os_tsc s_tsc; return &s_tsc; }
+
+static inline u64
+os_tsc_read(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline bool
+os_tsc_is_invariant(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    u32 eax, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000), "c"(0));
+    if (eax < 0x80000007)   return false;
+
+    __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000007), "c"(0));
+    return (edx & (1u << 8)) != 0;
+#else
+    return false;
+#endif
+}
+
+// A (tsc, CLOCK_REALTIME) pair, the clock read with the shortest TSC bracket
+// of a few tries (the ones interrupted or preempted are discarded).
+static inline void
+os_tsc_sample(u64 *out_tsc, i64 *out_ns)
+{
+    u64 best = UINT64_MAX;
+    *out_tsc = os_tsc_read();
+    *out_ns  = os_time_get_rt_ns();
+    for (int i = 0; i < OS_TSC_CALIB_SAMPLES; i++) {
+        u64 t0 = os_tsc_read();
+        i64 ns = os_time_get_rt_ns();
+        u64 t1 = os_tsc_read();
+        if (t1 - t0 < best) {
+            best     = t1 - t0;
+            *out_tsc = t0 + (t1 - t0) / 2;
+            *out_ns  = ns;
+        }
+    }
+}
+
+static inline void
+os_tsc_publish(os_tsc *tsc, u64 base_tsc, i64 base_ns, u64 mult)
+{
+    __atomic_store_n(&tsc->seq, tsc->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&tsc->base_tsc, base_tsc, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc->base_ns, base_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc->mult, mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc->tai_offset, os_time_get_tai_ns() - os_time_get_rt_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc->seq, tsc->seq + 1, __ATOMIC_RELEASE);
+}
+
+// The first calibration measures the rate over OS_TSC_CALIB_WAIT, returns -1
+// when the TSC is not invariant (the clock_gettime clocks must be used).
+static inline int
+os_tsc_calibrate(void)
+{
+    os_tsc *tsc = os_tsc_get();
+    if (!os_tsc_is_invariant())     return -1;
+
+    u64 t0, t1;
+    i64 ns0, ns1;
+    os_tsc_sample(&t0, &ns0);
+    struct timespec wait = { .tv_sec = 0, .tv_nsec = OS_TSC_CALIB_WAIT };
+    nanosleep(&wait, NULL);
+    os_tsc_sample(&t1, &ns1);
+
+    if (t1 <= t0 || ns1 <= ns0)     return -1;
+
+    os_tsc_publish(tsc, t1, ns1, (u64)(((i128)(ns1 - ns0) << 32) / (t1 - t0)));
+    tsc->enabled = true;
+    return 0;
+}
+
+// Move the base to now, the rate is measured since the previous base. The
+// step at the switch is the drift of the previous model over one interval.
+static inline void
+os_tsc_recalibrate(void)
+{
+    os_tsc *tsc = os_tsc_get();
+    if (!tsc->enabled)  return;
+
+    u64 t;
+    i64 ns;
+    os_tsc_sample(&t, &ns);
+    if (t <= tsc->base_tsc || ns <= tsc->base_ns)   return;
+
+    os_tsc_publish(tsc, t, ns, (u64)(((i128)(ns - tsc->base_ns) << 32) / (t - tsc->base_tsc)));
+}
+
+static inline void
+os_tsc_load(u64 *base_tsc, i64 *base_ns, u64 *mult)
+{
+    os_tsc *tsc = os_tsc_get();
+    u32 seq;
+    do {
+        seq       = __atomic_load_n(&tsc->seq, __ATOMIC_ACQUIRE);
+        *base_tsc = __atomic_load_n(&tsc->base_tsc, __ATOMIC_RELAXED);
+        *base_ns  = __atomic_load_n(&tsc->base_ns, __ATOMIC_RELAXED);
+        *mult     = __atomic_load_n(&tsc->mult, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&tsc->seq, __ATOMIC_RELAXED));
+}
+
+static inline i64
+os_tsc_to_rt_ns(u64 cycles)
+{
+    u64 base_tsc, mult;
+    i64 base_ns;
+    os_tsc_load(&base_tsc, &base_ns, &mult);
+
+    return base_ns + (i64)(((i128)(i64)(cycles - base_tsc) * mult) >> 32);
+}
+
+static inline i64 os_tsc_to_tai_ns(u64 cycles) { return os_tsc_to_rt_ns(cycles) + __atomic_load_n(&os_tsc_get()->tai_offset, __ATOMIC_RELAXED); }
+
+// The inverse, for the deadlines of the cycle timer.
+static inline u64
+os_tsc_from_rt_ns(i64 ns)
+{
+    u64 base_tsc, mult;
+    i64 base_ns;
+    os_tsc_load(&base_tsc, &base_ns, &mult);
+
+    return base_tsc + (u64)(i64)(((i128)(ns - base_ns) << 32) / (i128)mult);
+}
+
+// Application timestamps: raw cycles with the TSC clock, CLOCK_REALTIME ns
+// otherwise. `os_time_stamp_to_ns` converts them at export.
+static inline i64 os_time_stamp        (bool tsc)          { return tsc ? (i64)os_tsc_read() : os_time_get_rt_ns(); }
+static inline i64 os_time_stamp_to_ns  (bool tsc, i64 ts)  { return tsc && ts ? os_tsc_to_rt_ns((u64)ts) : ts; }
+
 // ## Thread
 
 static inline pthread_t os_thread_self(void)                                   { return pthread_self(); }
@@ -177,4 +351,93 @@ os_thread_set_affinity(pthread_t thread, int *cpus, usize num_cpus)
 static inline int os_vm_lock    (void *addr, size_t len) { return mlock(addr, len); }
 static inline int os_vm_lockall (void)                   { return mlockall(MCL_CURRENT | MCL_FUTURE); } 
 
+// ### Prefaulting
+// The first touch of a page faults, in the middle of the measurement if the
+// RT loop is the first to touch it. The buffers of the RT loops are allocated
+// with `os_vm_alloc` (zeroed, prefaulted and locked) and the RT threads touch
+// their stack before the loop. With `os_vm_set_hugepages` the buffers are
+// backed by huge pages: MAP_HUGETLB from the reserved pool (vm.nr_hugepages),
+// otherwise transparent huge pages (MADV_HUGEPAGE), fewer TLB misses.
+#define OS_HUGEPAGE_SIZE        (2 * 1024 * 1024)
+#define OS_STACK_PREFAULT       (512 * 1024)
+
+static inline bool *os_vm_hugepages     (void)          { static bool s_hugepages; return &s_hugepages; }
+static inline void  os_vm_set_hugepages (bool value)    { *os_vm_hugepages() = value; }
+
+// Write every page, the values are kept.
+static inline void
+os_vm_prefault(void *addr, usize len)
+{
+    volatile u8 *p = addr;
+    usize page     = sysconf(_SC_PAGESIZE);
+    for (usize i = 0; i < len; i += page)   p[i] = p[i];
+}
+
+static inline usize
+os_vm_alloc_size(usize len)
+{
+    usize align = *os_vm_hugepages() ? OS_HUGEPAGE_SIZE : (usize)sysconf(_SC_PAGESIZE);
+    return (len + align - 1) & ~(align - 1);
+}
+
+static void *
+os_vm_alloc(usize len)
+{
+    usize size = os_vm_alloc_size(len);
+    void *addr = MAP_FAILED;
+    if (*os_vm_hugepages())     addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (addr == MAP_FAILED) {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)     return NULL;
+
+        if (*os_vm_hugepages())     madvise(addr, size, MADV_HUGEPAGE);
+    }
+
+    // not fatal: the pages are populated, and locked by mlockall when it
+    // succeeded
+    os_vm_prefault(addr, size);
+    os_vm_lock(addr, size);
+    return addr;
+}
+
+static inline void os_vm_free (void *addr, usize len) { if (addr)  munmap(addr, os_vm_alloc_size(len)); }
+
+// Map the stack the calling thread will use, must not be inlined so the
+// array is below the frame of the caller.
+static __attribute__((noinline)) void
+os_stack_prefault(void)
+{
+    volatile u8 stack[OS_STACK_PREFAULT];
+    usize page = sysconf(_SC_PAGESIZE);
+    for (usize i = 0; i < sizeof(stack); i += page)     stack[i] = 0;
+}
+
+// ### Page Faults
+// Counted by the kernel per thread (RUSAGE_THREAD) or for the process
+// (RUSAGE_SELF): minor faults map a page in memory, major faults wait for I/O.
+typedef struct os_faults os_faults;
+struct os_faults
+{
+    i64 minor;
+    i64 major;
+};
+
+static inline os_faults
+os_faults_get(int who)
+{
+    struct rusage ru;
+    if (getrusage(who, &ru) < 0)    return (os_faults) {0};
+    return (os_faults) { .minor = ru.ru_minflt, .major = ru.ru_majflt };
+}
+
+static inline os_faults
+os_faults_since(os_faults start, int who)
+{
+    os_faults now = os_faults_get(who);
+    return (os_faults) { .minor = now.minor - start.minor, .major = now.major - start.major };
+}
+
+static inline void os_faults_print (os_faults f, const char *name, FILE *file) { fprintf(file, "%s page faults: minor=%ld, major=%ld\n", name, f.minor, f.major); }
+
 #endif // RTN_BASE_H
\ No newline at end of file
@@ -0,0 +1,157 @@
+////////////////////////////////////////////////////////////////////////////////
+// # RTN Packet Benchmark
+//
+// Per-cycle cost of building the packet in the tx and ping loops, the way it
+// was done before the packet pool (zero the whole malloc'd buffer, then write
+// the header) against the pool of rtn_packet.h (preformatted, prefaulted
+// packet, only the changing header fields are patched).
+//
+// Between two cycles the loop sleeps for the cycle time and can touch a
+// buffer (-w) to evict the caches, as the rest of a real cycle does. The time
+// of the packet preparation is recorded in a histogram (clock_gettime
+// included, the same in both modes).
+
+////////////////////////////////////////////////////////////////////////////////
+// # Includes
+#include "rtn_base.h"
+#include "rtn_hist.h"
+#include "rtn_packet.h"
+
+static char *usage_str =
+    "Usage: %s [-s sizes] [-n cycles] [-C cycle_time] [-w kbytes]\n"
+    "  -s, --size       packet sizes, comma separated (default: 64,256,1472,9000)\n"
+    "  -n, --cycles     cycles per size and mode (default: 100000)\n"
+    "  -C, --cycle      sleep between two cycles, in ns, 0 to run back to back (default: 10000)\n"
+    "  -w, --wss        bytes touched between two cycles, in KB (default: 0)\n";
+
+static struct option long_opts[] = {
+    { "size",   required_argument, NULL, 's' },
+    { "cycles", required_argument, NULL, 'n' },
+    { "cycle",  required_argument, NULL, 'C' },
+    { "wss",    required_argument, NULL, 'w' },
+    { "help",   no_argument,       NULL, 'h' },
+    { 0 },
+};
+
+typedef enum
+{
+    BENCH_MEMSET,       // malloc'd buffer, zeroed every cycle
+    BENCH_TEMPLATE,     // packet pool, header patched
+} bench_mode;
+
+typedef struct bench_config bench_config;
+struct bench_config
+{
+    u64     num_cycles;
+    i64     cycle_time;
+    u8     *wss;        // evicts the caches between two cycles
+    usize   wss_len;
+};
+
+static void
+bench_run(const bench_config *cfg, bench_mode mode, usize size, rtn_hist *hist)
+{
+    rtn_pkt_pool *pool = NULL;
+    u8 *packet         = NULL;
+    if (mode == BENCH_MEMSET) {
+        packet = malloc(size);
+    } else {
+        pool   = rtn_pkt_pool_new(1, size, &(payload_t) { .type = PAYLOAD_TYPE_DATA });
+        packet = pool ? rtn_pkt_pool_get(pool, 0) : NULL;
+    }
+
+    if (packet == NULL) {
+        fprintf(stderr, "Failed to allocate a %ld bytes packet\n", size);
+        exit(1);
+    }
+
+    payload_t *payload = (payload_t *)packet;
+    struct timespec gap = { .tv_sec = cfg->cycle_time / NSEC_PER_SEC, .tv_nsec = cfg->cycle_time % NSEC_PER_SEC };
+    for (u64 i = 0; i < cfg->num_cycles; i++) {
+        if (cfg->cycle_time > 0)    nanosleep(&gap, NULL);
+        for (usize j = 0; j < cfg->wss_len; j += 64)    cfg->wss[j] += 1;
+
+        i64 start = os_time_get_ns();
+        if (mode == BENCH_MEMSET) {
+            memset(packet, 0, size);
+            payload->type = PAYLOAD_TYPE_DATA;
+        }
+        payload->timestamp = start;
+        payload->seqno     = i;
+
+        // the packet is handed to the socket in the real loop
+        __asm__ __volatile__("" : : "r"(packet) : "memory");
+        rtn_hist_record(hist, os_time_get_ns() - start);
+    }
+
+    if (mode == BENCH_MEMSET)   free(packet);
+    else                        rtn_pkt_pool_destroy(pool);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Main
+int
+main(int argc, char *argv[])
+{
+    char default_sizes[] = "64,256,1472,9000";      // strtok writes to it
+    char *sizes      = default_sizes;
+    i64   wss_kb     = 0;
+    bench_config cfg = { .num_cycles = 100000, .cycle_time = 10000 };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:n:C:w:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 's': sizes          = optarg;        break;
+            case 'n': cfg.num_cycles = atoll(optarg); break;
+            case 'C': cfg.cycle_time = atoll(optarg); break;
+            case 'w': wss_kb         = atoll(optarg); break;
+            case 'h':
+            default:
+                fprintf(stderr, usage_str, argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind != argc || cfg.num_cycles == 0 || cfg.cycle_time < 0 || wss_kb < 0) {
+        fprintf(stderr, usage_str, argv[0]);
+        exit(1);
+    }
+
+    cfg.wss_len = wss_kb * 1024;
+    cfg.wss     = cfg.wss_len ? calloc(1, cfg.wss_len) : NULL;
+    if (cfg.wss_len && cfg.wss == NULL) {
+        fprintf(stderr, "Failed to allocate a %ldKB working set\n", wss_kb);
+        exit(1);
+    }
+
+    printf("cycles=%ld cycle_time=%ld wss=%ldKB (prepare time per cycle in ns)\n", cfg.num_cycles, cfg.cycle_time, wss_kb);
+
+    rtn_hist *hists = malloc(2 * sizeof(rtn_hist));
+    if (hists == NULL) {
+        fprintf(stderr, "Failed to allocate the histograms\n");
+        exit(1);
+    }
+
+    for (char *token = strtok(sizes, ","); token != NULL; token = strtok(NULL, ",")) {
+        usize size = atoll(token);
+        if (size < sizeof(payload_t)) {
+            fprintf(stderr, "Invalid packet size: %s (at least %ld bytes)\n", token, sizeof(payload_t));
+            exit(1);
+        }
+
+        char name[64];
+        static const char *mode_str[] = { [BENCH_MEMSET] = "memset", [BENCH_TEMPLATE] = "template" };
+        for (int mode = BENCH_MEMSET; mode <= BENCH_TEMPLATE; mode++) {
+            rtn_hist_init(&hists[mode]);
+            bench_run(&cfg, mode, size, &hists[mode]);
+
+            snprintf(name, sizeof(name), "s=%-5ld %-8s", size, mode_str[mode]);
+            rtn_hist_print(&hists[mode], name, stdout);
+        }
+    }
+
+    free(hists);
+    free(cfg.wss);
+
+    return 0;
+}
@@ -0,0 +1,560 @@
+#ifndef RTN_CONTROL_H
+#define RTN_CONTROL_H
+
+#include "rtn_base.h"
+#include "rtn_options.h"
+#include "rtn_packet.h"
+#include "rtn_stats.h"
+
+#include <netinet/tcp.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// # Control Channel
+//
+// With --control the sender (tx) connects over TCP to the receiver (rx), which
+// listens on the control port, and the two run the test together:
+//
+//     tx                              rx
+//     HELLO  (parameters, t1)  --->   takes the cycle, size, count, burst and
+//                                     clock of the sender, opens its socket
+//            <---  READY  (t2, t3)    the receiver is listening
+//     START  (start time)      --->   first cycle, aligned to the second
+//     ...         UDP packets         ...
+//     DONE   (packets sent)    --->   the receiver stops once idle
+//            <---  RECORDS ...        its timestamps, by packet id
+//            <---  RESULTS            packets received
+//
+// Both sides keep the timestamps of every packet in memory (`stats_record`,
+// filled by the stats thread), the sender joins the records of the receiver
+// with its own and saves them in a single results file.
+//
+// The clocks of the two hosts are compared with the four timestamps of the
+// HELLO/READY exchange, as NTP does: the one-way latencies are only as good
+// as their synchronization (PTP). The hardware timestamps are comparable when
+// both sides convert them to CLOCK_REALTIME (--phc).
+//
+// The messages are fixed structs in host byte order behind a header, a
+// receiver of the other byte order fails on the magic.
+
+#define RTN_CTRL_MAGIC          0x52544e43      // "RTNC"
+#define RTN_CTRL_VERSION        1
+#define RTN_CTRL_LEAD           (2 * NSEC_PER_SEC)      // start: at least this far ahead
+#define RTN_CTRL_CONNECT_WAIT   ((i64)10 * NSEC_PER_SEC)     // tx: retry until the receiver listens
+#define RTN_CTRL_CONNECT_RETRY  (100 * NSEC_PER_MSEC)
+#define RTN_CTRL_MAX_PACKETS    (1 << 24)       // records in memory, 64 bytes each
+#define RTN_CTRL_MAX_OFFSET     (1 * NSEC_PER_MSEC)     // clocks further apart are reported
+#define RTN_CTRL_CHUNK          1024            // records per RECORDS message
+
+typedef enum
+{
+    RTN_CTRL_HELLO = 1,
+    RTN_CTRL_READY,
+    RTN_CTRL_START,
+    RTN_CTRL_DONE,
+    RTN_CTRL_RECORDS,
+    RTN_CTRL_RESULTS,
+    RTN_CTRL_ERROR,
+} rtn_ctrl_type;
+
+typedef struct rtn_ctrl_hdr rtn_ctrl_hdr;
+struct rtn_ctrl_hdr
+{
+    u32     magic;
+    u16     version;
+    u16     type;           // rtn_ctrl_type
+    u32     length;         // bytes following the header
+    u32     reserved;
+};
+
+// HELLO: the test as the sender runs it
+typedef struct rtn_ctrl_params rtn_ctrl_params;
+struct rtn_ctrl_params
+{
+    u64     num_packets;
+    u64     cycle_time;
+    u32     packet_size;
+    u32     burst_size;
+    u32     clock_type;     // CLOCK_TYPE_* of the application timestamps
+    u32     phc;            // the hardware timestamps are converted to CLOCK_REALTIME
+    i64     sent;           // t1, CLOCK_REALTIME of the sender
+};
+
+// READY: the receiver socket is open
+typedef struct rtn_ctrl_ready_msg rtn_ctrl_ready_msg;
+struct rtn_ctrl_ready_msg
+{
+    i64     received;       // t2, when the HELLO arrived (CLOCK_REALTIME of the receiver)
+    i64     sent;           // t3
+    u32     phc;
+    u32     reserved;
+};
+
+typedef struct rtn_ctrl_start_msg rtn_ctrl_start_msg;
+struct rtn_ctrl_start_msg
+{
+    i64     start_time;     // first cycle, CLOCK_REALTIME of the sender
+};
+
+typedef struct rtn_ctrl_done_msg rtn_ctrl_done_msg;
+struct rtn_ctrl_done_msg
+{
+    u64     num_sent;
+};
+
+typedef struct rtn_ctrl_results rtn_ctrl_results;
+struct rtn_ctrl_results
+{
+    u64     num_received;   // packets of the receive loop, duplicates included
+    u64     num_records;    // sent in the RECORDS messages
+    u64     num_dropped;    // records lost in the stats ring of the receiver
+};
+
+typedef struct rtn_ctrl rtn_ctrl;
+struct rtn_ctrl
+{
+    int             fd;
+    bool            sender;
+    rtn_ctrl_params params;
+    i64             hello_time;     // rx: t2
+
+    // timestamps of the packets by id, `params.num_packets`
+    stats_record   *records;
+
+    // rx: the sender is done (or went away), set by the watch thread
+    pthread_t       thread;
+    bool            done;
+    bool            gone;           // no DONE, the results are not sent
+    u64             num_sent;
+
+    // tx: results of the receiver
+    rtn_ctrl_results results;
+};
+
+static const char *
+rtn_ctrl_peer_name(const rtn_ctrl *ctrl) { return ctrl->sender ? "receiver" : "sender"; }
+
+static int
+rtn_ctrl_write(int fd, const void *data, usize len)
+{
+    const u8 *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)    continue;
+        if (n <= 0)     return -1;
+
+        p   += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Returns -1 on error, or with errno 0 when the peer closed the connection.
+static int
+rtn_ctrl_read(int fd, void *data, usize len)
+{
+    u8 *p = data;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)    continue;
+        if (n == 0)     errno = 0;
+        if (n <= 0)     return -1;
+
+        p   += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static void
+rtn_ctrl_send(rtn_ctrl *ctrl, rtn_ctrl_type type, const void *data, u32 len)
+{
+    rtn_ctrl_hdr hdr = { .magic = RTN_CTRL_MAGIC, .version = RTN_CTRL_VERSION, .type = type, .length = len };
+    if (rtn_ctrl_write(ctrl->fd, &hdr, sizeof(hdr)) < 0 || (len > 0 && rtn_ctrl_write(ctrl->fd, data, len) < 0)) {
+        error("Control: failed to send to the %s: %s\n", rtn_ctrl_peer_name(ctrl), strerror(errno));
+        exit(1);
+    }
+}
+
+// Tell the peer why the test is aborted, then exit.
+static void
+rtn_ctrl_fail(rtn_ctrl *ctrl, const char *fmt, ...)
+{
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    error("Control: %s\n", msg);
+    rtn_ctrl_send(ctrl, RTN_CTRL_ERROR, msg, strlen(msg) + 1);
+    exit(1);
+}
+
+// Receive the next message in `data` (at most `size` bytes), returns its type
+// and its length in `len`, or -1 when the connection is gone. An ERROR of the
+// peer exits.
+static int
+rtn_ctrl_recv(rtn_ctrl *ctrl, void *data, u32 size, u32 *len)
+{
+    rtn_ctrl_hdr hdr;
+    if (rtn_ctrl_read(ctrl->fd, &hdr, sizeof(hdr)) < 0)     return -1;
+
+    if (hdr.magic != RTN_CTRL_MAGIC || hdr.version != RTN_CTRL_VERSION) {
+        error("Control: invalid message from the %s (magic 0x%08x, version %d)\n", rtn_ctrl_peer_name(ctrl), hdr.magic, hdr.version);
+        exit(1);
+    }
+
+    if (hdr.type == RTN_CTRL_ERROR) {
+        char msg[256] = {0};
+        u32 n = hdr.length < sizeof(msg) - 1 ? hdr.length : sizeof(msg) - 1;
+        if (rtn_ctrl_read(ctrl->fd, msg, n) < 0)    return -1;
+
+        error("Control: the %s aborted the test: %s\n", rtn_ctrl_peer_name(ctrl), msg);
+        exit(1);
+    }
+
+    if (hdr.length > size) {
+        error("Control: message %d from the %s is too long (%d bytes)\n", hdr.type, rtn_ctrl_peer_name(ctrl), hdr.length);
+        exit(1);
+    }
+
+    if (hdr.length > 0 && rtn_ctrl_read(ctrl->fd, data, hdr.length) < 0)   return -1;
+
+    *len = hdr.length;
+    return hdr.type;
+}
+
+// The next message must be `type`, of exactly `size` bytes.
+static void
+rtn_ctrl_expect(rtn_ctrl *ctrl, rtn_ctrl_type type, void *data, u32 size)
+{
+    u32 len  = 0;
+    int recv = rtn_ctrl_recv(ctrl, data, size, &len);
+    if (recv < 0) {
+        error("Control: connection to the %s lost: %s\n", rtn_ctrl_peer_name(ctrl), errno ? strerror(errno) : "closed");
+        exit(1);
+    }
+
+    if (recv != (int)type || len != size) {
+        error("Control: unexpected message %d (%d bytes) from the %s, expected %d\n", recv, len, rtn_ctrl_peer_name(ctrl), type);
+        exit(1);
+    }
+}
+
+static rtn_ctrl *
+rtn_ctrl_new(int fd, bool sender)
+{
+    // the messages are small and latency bound
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    rtn_ctrl *ctrl = calloc(1, sizeof(rtn_ctrl));
+    if (ctrl == NULL) {
+        error("Control: failed to allocate the channel\n");
+        exit(1);
+    }
+
+    ctrl->fd       = fd;
+    ctrl->sender   = sender;
+    return ctrl;
+}
+
+// rx: wait for the sender, a single connection.
+static rtn_ctrl *
+rtn_ctrl_accept(int port)
+{
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    // IPv4 and IPv6 senders, the port is reused by the next test right away
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port), .sin6_addr = in6addr_any };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("control: bind");
+        exit(1);
+    }
+
+    info("Control: waiting for the sender on port %d\n", port);
+
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    int conn;
+    while ((conn = accept(fd, (struct sockaddr *)&peer, &peer_len)) < 0 && errno == EINTR) {}
+    if (conn < 0) {
+        perror("control: accept");
+        exit(1);
+    }
+    close(fd);
+
+    char host[INET6_ADDRSTRLEN] = "?";
+    getnameinfo((struct sockaddr *)&peer, peer_len, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+    info("Control: sender %s connected\n", host);
+
+    return rtn_ctrl_new(conn, false);
+}
+
+// tx: connect to the receiver, retried for RTN_CTRL_CONNECT_WAIT so both
+// sides can be started in any order.
+static rtn_ctrl *
+rtn_ctrl_connect(const char *host, int port)
+{
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int err = getaddrinfo(host, service, &hints, &res);
+    if (err != 0) {
+        error("Control: %s: %s\n", host, gai_strerror(err));
+        exit(1);
+    }
+
+    i64 deadline = os_time_get_ns() + RTN_CTRL_CONNECT_WAIT;
+    int fd       = -1;
+    for (;;) {
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd < 0) {
+            perror("socket");
+            exit(1);
+        }
+
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == 0)    break;
+
+        if (errno != ECONNREFUSED || os_time_get_ns() >= deadline) {
+            error("Control: failed to connect to %s:%d: %s\n", host, port, strerror(errno));
+            exit(1);
+        }
+
+        close(fd);
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = RTN_CTRL_CONNECT_RETRY };
+        nanosleep(&ts, NULL);
+    }
+
+    freeaddrinfo(res);
+    info("Control: connected to the receiver %s:%d\n", host, port);
+
+    return rtn_ctrl_new(fd, true);
+}
+
+static void
+rtn_ctrl_alloc_records(rtn_ctrl *ctrl)
+{
+    ctrl->records = calloc(ctrl->params.num_packets, sizeof(stats_record));
+    if (ctrl->records == NULL) {
+        error("Control: failed to allocate the records of %ld packets\n", ctrl->params.num_packets);
+        exit(1);
+    }
+}
+
+// HELLO. tx: send the parameters of the test, the receiver answers once its
+// socket is open (READY). rx: take the parameters of the sender.
+static void
+rtn_ctrl_hello(rtn_ctrl *ctrl, options_t *opts)
+{
+    if (ctrl->sender) {
+        ctrl->params = (rtn_ctrl_params) {
+            .num_packets = opts->num_packets,
+            .cycle_time  = opts->cycle_time,
+            .packet_size = opts->packet_size,
+            .burst_size  = opts->burst_size,
+            .clock_type  = opts->clock_type,
+            .phc         = opts->use_phc,
+        };
+        rtn_ctrl_alloc_records(ctrl);
+
+        ctrl->params.sent = os_time_get_rt_ns();
+        rtn_ctrl_send(ctrl, RTN_CTRL_HELLO, &ctrl->params, sizeof(ctrl->params));
+
+        rtn_ctrl_ready_msg ready;
+        rtn_ctrl_expect(ctrl, RTN_CTRL_READY, &ready, sizeof(ready));
+        i64 t4 = os_time_get_rt_ns();
+        i64 t1 = ctrl->params.sent;
+
+        // offset of the receiver clock, and the round trip without the
+        // time the receiver took to open its socket
+        i64 offset = ((ready.received - t1) + (ready.sent - t4)) / 2;
+        i64 delay  = (t4 - t1) - (ready.sent - ready.received);
+        info("Control: receiver ready, clock offset %+ld ns (round trip %ld ns)\n", offset, delay);
+
+        if (offset > RTN_CTRL_MAX_OFFSET || offset < -RTN_CTRL_MAX_OFFSET) {
+            warn("The clocks of the hosts differ by %ld us, the one-way latencies are off by as much (synchronize them with PTP)\n",
+                 offset / 1000);
+        }
+        if (ready.phc != ctrl->params.phc) {
+            warn("Only the %s converts its hardware timestamps (--phc), tx_hw and rx_hw are in different clock domains\n",
+                 ready.phc ? "receiver" : "sender");
+        }
+        return;
+    }
+
+    rtn_ctrl_expect(ctrl, RTN_CTRL_HELLO, &ctrl->params, sizeof(ctrl->params));
+    ctrl->hello_time = os_time_get_rt_ns();
+
+    rtn_ctrl_params *p = &ctrl->params;
+    if (p->num_packets == 0 || p->num_packets > RTN_CTRL_MAX_PACKETS)   rtn_ctrl_fail(ctrl, "invalid number of packets: %ld (1 to %d)", p->num_packets, RTN_CTRL_MAX_PACKETS);
+    if (p->packet_size < sizeof(payload_t))                             rtn_ctrl_fail(ctrl, "invalid packet size: %d", p->packet_size);
+    if (p->cycle_time == 0 || p->burst_size == 0)                       rtn_ctrl_fail(ctrl, "invalid cycle time %ld or burst size %d", p->cycle_time, p->burst_size);
+    if (p->clock_type != CLOCK_TYPE_REALTIME && p->clock_type != CLOCK_TYPE_TSC)    rtn_ctrl_fail(ctrl, "invalid clock: %d", p->clock_type);
+
+    // the receive side mirrors the sender, its application timestamps come
+    // from the same kind of clock
+    opts->num_packets = p->num_packets;
+    opts->cycle_time  = p->cycle_time;
+    opts->packet_size = p->packet_size;
+    opts->burst_size  = p->burst_size;
+    opts->clock_type  = p->clock_type;
+    opts->clock_name  = p->clock_type == CLOCK_TYPE_TSC ? "tsc" : "realtime";
+    rtn_ctrl_alloc_records(ctrl);
+
+    info("Control: %ld packets of %d bytes every %ld ns (burst %d, clock %s)\n",
+         p->num_packets, p->packet_size, p->cycle_time, p->burst_size, opts->clock_name);
+}
+
+static void *
+rtn_ctrl_watch_fn(void *arg)
+{
+    rtn_ctrl *ctrl = arg;
+    os_thread_set_name(os_thread_self(), "rtn-control");
+
+    rtn_ctrl_done_msg done;
+    u32 len  = 0;
+    int type = rtn_ctrl_recv(ctrl, &done, sizeof(done), &len);
+    if (type == RTN_CTRL_DONE && len == sizeof(done)) {
+        ctrl->num_sent = done.num_sent;
+    } else {
+        warn("Control: the sender went away, the test ends\n");
+        ctrl->gone = true;
+    }
+
+    __atomic_store_n(&ctrl->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// rx: the receive socket is open, wait for the start time. The DONE of the
+// sender is then awaited by a thread, see `rtn_ctrl_sender_done`.
+static void
+rtn_ctrl_ready(rtn_ctrl *ctrl, bool phc)
+{
+    rtn_ctrl_ready_msg ready = { .received = ctrl->hello_time, .phc = phc };
+    ready.sent = os_time_get_rt_ns();
+    rtn_ctrl_send(ctrl, RTN_CTRL_READY, &ready, sizeof(ready));
+
+    rtn_ctrl_start_msg start;
+    rtn_ctrl_expect(ctrl, RTN_CTRL_START, &start, sizeof(start));
+    info("Control: the test starts at %ld (in %ld ms)\n", start.start_time, (start.start_time - os_time_get_rt_ns()) / NSEC_PER_MSEC);
+
+    if (pthread_create(&ctrl->thread, NULL, rtn_ctrl_watch_fn, ctrl) != 0) {
+        error("Control: failed to create the watch thread\n");
+        exit(1);
+    }
+}
+
+static inline bool rtn_ctrl_sender_done(rtn_ctrl *ctrl) { return __atomic_load_n(&ctrl->done, __ATOMIC_ACQUIRE); }
+
+// tx: the first cycle, RTN_CTRL_LEAD ahead aligned to the second.
+static i64
+rtn_ctrl_start(rtn_ctrl *ctrl)
+{
+    rtn_ctrl_start_msg start = { .start_time = os_time_normalize_ts(os_time_get_rt_ns() + RTN_CTRL_LEAD) };
+    rtn_ctrl_send(ctrl, RTN_CTRL_START, &start, sizeof(start));
+    return start.start_time;
+}
+
+// tx: the loop and the stats thread are done, join the records of the
+// receiver with ours. rx: send them.
+static void
+rtn_ctrl_finish(rtn_ctrl *ctrl, u64 num_packets, u64 num_dropped)
+{
+    u64 num_records = ctrl->params.num_packets;
+    stats_record *chunk = malloc(RTN_CTRL_CHUNK * sizeof(stats_record));
+    if (chunk == NULL) {
+        error("Control: failed to allocate the records chunk\n");
+        exit(1);
+    }
+
+    if (ctrl->sender) {
+        rtn_ctrl_done_msg done = { .num_sent = num_packets };
+        rtn_ctrl_send(ctrl, RTN_CTRL_DONE, &done, sizeof(done));
+
+        u64 num_joined = 0;
+        for (;;) {
+            u32 len  = 0;
+            int type = rtn_ctrl_recv(ctrl, chunk, RTN_CTRL_CHUNK * sizeof(stats_record), &len);
+            if (type == RTN_CTRL_RESULTS && len == sizeof(ctrl->results)) {
+                memcpy(&ctrl->results, chunk, sizeof(ctrl->results));
+                break;
+            }
+
+            if (type != RTN_CTRL_RECORDS || len % sizeof(stats_record) != 0) {
+                error("Control: lost the results of the receiver\n");
+                exit(1);
+            }
+
+            for (u32 i = 0; i < len / sizeof(stats_record); i++) {
+                const stats_record *src = &chunk[i];
+                if (src->id >= num_records)     continue;
+
+                stats_record *rec = &ctrl->records[src->id];
+                if (rec->tx_app == 0)   rec->tx_app = src->tx_app;     // our record was lost
+                rec->id     = src->id;
+                rec->rx_app = src->rx_app;
+                rec->rx_sw  = src->rx_sw;
+                rec->rx_hw  = src->rx_hw;
+                num_joined += 1;
+            }
+        }
+
+        if (num_joined != ctrl->results.num_records) {
+            warn("Control: %ld records of the receiver joined, %ld sent\n", num_joined, ctrl->results.num_records);
+        }
+    } else {
+        pthread_join(ctrl->thread, NULL);
+        if (ctrl->gone) {
+            free(chunk);
+            return;
+        }
+
+        // only the packets that arrived
+        u32 n = 0;
+        ctrl->results = (rtn_ctrl_results) { .num_received = num_packets, .num_dropped = num_dropped };
+        for (u64 id = 0; id < num_records; id++) {
+            if (ctrl->records[id].rx_app == 0)  continue;
+
+            chunk[n++] = ctrl->records[id];
+            if (n == RTN_CTRL_CHUNK) {
+                rtn_ctrl_send(ctrl, RTN_CTRL_RECORDS, chunk, n * sizeof(stats_record));
+                ctrl->results.num_records += n;
+                n = 0;
+            }
+        }
+        if (n > 0) {
+            rtn_ctrl_send(ctrl, RTN_CTRL_RECORDS, chunk, n * sizeof(stats_record));
+            ctrl->results.num_records += n;
+        }
+
+        rtn_ctrl_send(ctrl, RTN_CTRL_RESULTS, &ctrl->results, sizeof(ctrl->results));
+        info("Control: sent %ld records to the sender (%ld packets sent)\n", ctrl->results.num_records, ctrl->num_sent);
+    }
+
+    free(chunk);
+}
+
+static void
+rtn_ctrl_destroy(rtn_ctrl *ctrl)
+{
+    if (ctrl == NULL)   return;
+
+    close(ctrl->fd);
+    free(ctrl->records);
+    free(ctrl);
+}
+
+#endif // RTN_CONTROL_H
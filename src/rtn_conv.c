@@ -0,0 +1,167 @@
+////////////////////////////////////////////////////////////////////////////////
+// # RTN Results Converter
+//
+// Turns the binary results of `rtn --format bin` (see rtn_result.h) into CSV.
+// The output is the same as the CSV written by rtn: the configuration of the
+// test as `#` comment lines, then one line per record.
+
+////////////////////////////////////////////////////////////////////////////////
+// # Includes
+#include "rtn_base.h"
+#include "rtn_options.h"
+#include "rtn_result.h"
+
+static char *usage_str =
+    "Usage: %s [-o output] [-c col,col,...] [-s separator] [-i] file.bin\n"
+    "  -o, --output     write to this file instead of stdout\n"
+    "  -c, --columns    columns to export, in this order (default: all)\n"
+    "  -s, --separator  field separator (default: \", \")\n"
+    "  -i, --info       only print the header of the file\n";
+
+static struct option long_opts[] = {
+    { "output",    required_argument, NULL, 'o' },
+    { "columns",   required_argument, NULL, 'c' },
+    { "separator", required_argument, NULL, 's' },
+    { "info",      no_argument,       NULL, 'i' },
+    { "help",      no_argument,       NULL, 'h' },
+    { 0 },
+};
+
+static void
+print_info(const rtn_result_reader *reader, const char *path)
+{
+    const rtn_result_header *hdr = reader->hdr;
+
+    printf("file:     %s\n", path);
+    printf("version:  %d\n", hdr->version);
+    printf("role:     %s\n", hdr->role_id >= 0 && hdr->role_id < (i32)array_size(g_roleid_to_string) ? g_roleid_to_string[hdr->role_id] : "unknown");
+    if (hdr->stream_id >= 0)    printf("stream:   %d\n", hdr->stream_id);
+    printf("created:  %ld\n", hdr->created);
+    printf("clock:    %s\n", hdr->clock);
+    printf("kernel:   %s\n", hdr->kernel);
+    printf("cfg:      %s\n", hdr->cfg);
+    printf("records:  %ld", reader->num_records);
+    if (reader->num_records != hdr->num_records)    printf(" (%ld in the header, file truncated)", hdr->num_records);
+    printf("\n");
+
+    printf("columns: ");
+    for (u32 c = 0; c < hdr->num_columns; c++)  printf(" %s", rtn_result_col_name(hdr->columns[c]));
+    printf("\n");
+}
+
+// Map the `--columns` list to column indexes of the file, returns the number
+// of columns or -1.
+static int
+select_columns(const rtn_result_header *hdr, char *list, u32 *out)
+{
+    int count = 0;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int col = rtn_result_col_from_str(name);
+
+        int idx = -1;
+        for (u32 c = 0; c < hdr->num_columns && col >= 0; c++) {
+            if (hdr->columns[c] == (u32)col)    idx = c;
+        }
+
+        if (idx < 0) {
+            fprintf(stderr, "No column %s in the file\n", name);
+            return -1;
+        }
+
+        if (count == RTN_RESULT_MAX_COLUMNS)    return -1;
+        out[count++] = idx;
+    }
+
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Main
+int
+main(int argc, char *argv[])
+{
+    char *output    = NULL;
+    char *columns   = NULL;
+    char *separator = ", ";
+    bool  info_only = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:c:s:ih", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'o': output    = optarg; break;
+            case 'c': columns   = optarg; break;
+            case 's': separator = optarg; break;
+            case 'i': info_only = true;   break;
+            case 'h':
+            default:
+                fprintf(stderr, usage_str, argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, usage_str, argv[0]);
+        exit(1);
+    }
+
+    const char *path = argv[optind];
+    rtn_result_reader reader;
+    if (rtn_result_open(&reader, path) < 0)     exit(1);
+
+    const rtn_result_header *hdr = reader.hdr;
+    if (info_only) {
+        print_info(&reader, path);
+        rtn_result_reader_close(&reader);
+        return 0;
+    }
+
+    u32 cols[RTN_RESULT_MAX_COLUMNS];
+    int num_cols = hdr->num_columns;
+    if (columns) {
+        num_cols = select_columns(hdr, columns, cols);
+        if (num_cols <= 0) {
+            fprintf(stderr, "Invalid columns: %s\n", columns);
+            exit(1);
+        }
+    } else {
+        for (int c = 0; c < num_cols; c++)  cols[c] = c;
+    }
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+            exit(1);
+        }
+    }
+
+    // large buffer, the output is written sequentially
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    if (hdr->stream_id >= 0)    fprintf(out, "# stream: %d\n", hdr->stream_id);
+    fprintf(out, "# cfg: %s\n", hdr->cfg);
+    fprintf(out, "# clock: %s, kernel: %s\n\n", hdr->clock, hdr->kernel);
+
+    for (int c = 0; c < num_cols; c++) {
+        fprintf(out, "%s%s", c ? separator : "", rtn_result_col_name(hdr->columns[cols[c]]));
+    }
+    fprintf(out, "\n");
+
+    for (u64 r = 0; r < reader.num_records; r++) {
+        for (int c = 0; c < num_cols; c++) {
+            fprintf(out, "%s%ld", c ? separator : "", rtn_result_get(&reader, r, cols[c]));
+        }
+        fprintf(out, "\n");
+    }
+
+    if (out != stdout)  fclose(out);
+    else                fflush(out);
+
+    if (reader.num_records != hdr->num_records) {
+        fprintf(stderr, "%s: truncated file, %ld of %ld records\n", path, reader.num_records, hdr->num_records);
+    }
+
+    rtn_result_reader_close(&reader);
+    return 0;
+}
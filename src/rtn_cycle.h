@@ -0,0 +1,220 @@
+#ifndef RTN_CYCLE_H
+#define RTN_CYCLE_H
+
+#include "rtn_base.h"
+#include "rtn_hist.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Cycle Timer
+//
+// The periodic loop of the tx and ping roles, as in cyclictest: every cycle
+// sleeps with clock_nanosleep(TIMER_ABSTIME) until its start, the wakeup
+// latency (how late the thread runs after the start) is recorded in a
+// histogram, so the timer latency can be told apart from the network latency.
+//
+// A cycle overruns when the body of the previous one is still running at its
+// start. The overrun policy decides what happens next:
+// - catchup: the late cycles run back to back until the loop is on time, the
+//   schedule does not move (each late cycle counts its lateness as latency).
+// - skip: the cycles whose start is already past are dropped (missed), the
+//   loop resumes at the next cycle in the future.
+//
+// The wait strategy trades CPU for wakeup accuracy:
+// - sleep: clock_nanosleep until the start, the wakeup latency of the kernel
+//   (tens of microseconds on a non isolated core).
+// - spin: poll the clock until the start, the CPU is busy the whole cycle.
+// - hybrid: sleep until `spin_margin` before the start, then spin. The margin
+//   must be larger than the usual wakeup latency.
+//
+// With `tsc` (CLOCK_REALTIME only) the clock is read through the calibrated
+// TSC and the spin compares raw cycles, no clock_gettime in the loop.
+
+typedef enum
+{
+    RTN_OVERRUN_CATCHUP,
+    RTN_OVERRUN_SKIP,
+} rtn_overrun_policy;
+
+static inline int
+rtn_overrun_policy_from_str(const char *str)
+{
+    if (cstr_eq(str, "catchup"))    return RTN_OVERRUN_CATCHUP;
+    if (cstr_eq(str, "skip"))       return RTN_OVERRUN_SKIP;
+    return -1;
+}
+
+typedef enum
+{
+    RTN_WAIT_SLEEP,
+    RTN_WAIT_SPIN,
+    RTN_WAIT_HYBRID,
+} rtn_wait_mode;
+
+static const char *g_wait_mode_str[] = {
+    [RTN_WAIT_SLEEP]  = "sleep",
+    [RTN_WAIT_SPIN]   = "spin",
+    [RTN_WAIT_HYBRID] = "hybrid",
+};
+
+static inline int
+rtn_wait_mode_from_str(const char *str)
+{
+    for (usize i = 0; i < array_size(g_wait_mode_str); i++) {
+        if (cstr_eq(str, g_wait_mode_str[i]))   return i;
+    }
+
+    return -1;
+}
+
+typedef struct rtn_cycle_config rtn_cycle_config;
+struct rtn_cycle_config
+{
+    clockid_t           clock;
+    i64                 period;
+    i64                 lead;           // wake up this early (launch time mode)
+    rtn_overrun_policy  overrun;
+    rtn_wait_mode       wait;
+    i64                 spin_margin;    // hybrid: spin for the last `spin_margin` ns
+    bool                tsc;            // read the clock through the TSC (os_tsc_calibrate done)
+};
+
+typedef struct rtn_cycle rtn_cycle;
+struct rtn_cycle
+{
+    clockid_t           clock;
+    i64                 period;
+    i64                 lead;
+    rtn_overrun_policy  policy;
+    rtn_wait_mode       wait;
+    i64                 spin_margin;
+    bool                tsc;
+
+    i64                 next;           // deadline of the next cycle
+    u64                 num_cycles;
+    u64                 num_overruns;   // cycles started after their deadline
+    u64                 num_missed;     // cycles dropped (skip) or run more than a period late (catchup)
+
+    rtn_hist            wakeup;         // now - (deadline - lead), in ns
+};
+
+static inline i64
+rtn_cycle_now(const rtn_cycle *c)
+{
+    if (c->tsc)     return os_tsc_to_rt_ns(os_tsc_read());
+
+    struct timespec ts;
+    clock_gettime(c->clock, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline void
+rtn_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// The first cycle has its deadline at `start`.
+static void
+rtn_cycle_init(rtn_cycle *c, const rtn_cycle_config *cfg, i64 start)
+{
+    memset(c, 0, sizeof(*c));
+    c->clock       = cfg->clock;
+    c->period      = cfg->period;
+    c->lead        = cfg->lead;
+    c->policy      = cfg->overrun;
+    c->wait        = cfg->wait;
+    c->spin_margin = cfg->spin_margin;
+    c->tsc         = cfg->tsc && cfg->clock == CLOCK_REALTIME;
+    c->next        = start;
+    rtn_hist_init(&c->wakeup);
+}
+
+static void
+rtn_cycle_sleep(rtn_cycle *c, i64 until)
+{
+    struct timespec ts = { .tv_sec = until / NSEC_PER_SEC, .tv_nsec = until % NSEC_PER_SEC };
+    int ret;
+    while ((ret = clock_nanosleep(c->clock, TIMER_ABSTIME, &ts, NULL)) == EINTR) {}
+    if (ret != 0) {
+        fprintf(stderr, "clock_nanosleep: %s\n", strerror(ret));
+        exit(1);
+    }
+}
+
+// Returns the time the spin ended.
+static i64
+rtn_cycle_spin(rtn_cycle *c, i64 until)
+{
+    if (c->tsc) {
+        u64 target = os_tsc_from_rt_ns(until);
+        u64 now;
+        while ((now = os_tsc_read()) < target)  rtn_cpu_relax();
+        return os_tsc_to_rt_ns(now);
+    }
+
+    i64 now;
+    while ((now = rtn_cycle_now(c)) < until)   rtn_cpu_relax();
+    return now;
+}
+
+// Sleep until the next cycle and return its deadline, the time after the
+// wakeup is returned in `out_now`.
+static i64
+rtn_cycle_wait(rtn_cycle *c, i64 *out_now)
+{
+    i64 start = c->next - c->lead;
+    i64 now   = rtn_cycle_now(c);
+
+    if (now > start) {
+        c->num_overruns += 1;
+
+        i64 behind = (now - start) / c->period;
+        if (c->policy == RTN_OVERRUN_SKIP) {
+            c->num_missed += behind + 1;
+            c->next       += (behind + 1) * c->period;
+            start         += (behind + 1) * c->period;
+        } else if (behind > 0) {
+            c->num_missed += 1;
+        }
+    }
+
+    switch (c->wait) {
+        case RTN_WAIT_SLEEP:
+            rtn_cycle_sleep(c, start);
+            now = rtn_cycle_now(c);
+            break;
+        case RTN_WAIT_SPIN:
+            now = rtn_cycle_spin(c, start);
+            break;
+        case RTN_WAIT_HYBRID:
+            if (start - c->spin_margin > now)   rtn_cycle_sleep(c, start - c->spin_margin);
+            now = rtn_cycle_spin(c, start);
+            break;
+    }
+
+    rtn_hist_record(&c->wakeup, now - start);
+
+    i64 deadline   = c->next;
+    c->next       += c->period;
+    c->num_cycles += 1;
+
+    *out_now = now;
+    return deadline;
+}
+
+static void
+rtn_cycle_report(const rtn_cycle *c, const char *name, FILE *file)
+{
+    char hist_name[64];
+    snprintf(hist_name, sizeof(hist_name), "%s wakeup latency", name);
+    rtn_hist_print(&c->wakeup, hist_name, file);
+
+    fprintf(file, "%s cycles: %ld, overruns: %ld, missed: %ld (%s, wait=%s%s)\n", name, c->num_cycles, c->num_overruns,
+            c->num_missed, c->policy == RTN_OVERRUN_SKIP ? "skip" : "catchup", g_wait_mode_str[c->wait], c->tsc ? ", tsc" : "");
+}
+
+#endif // RTN_CYCLE_H
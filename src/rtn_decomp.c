@@ -0,0 +1,428 @@
+////////////////////////////////////////////////////////////////////////////////
+// # RTN Latency Decomposition
+//
+// Joins the results of a tx and an rx run (CSV or `--format bin`) by packet id
+// and splits the one-way latency of each packet along its timestamps:
+//
+//     tx_app -> tx_sched -> tx_sw -> tx_hw -> rx_hw -> rx_sw -> rx_app
+//
+// A stage is the time between two consecutive timestamps the packet has, a
+// missing timestamp merges its two stages (e.g. tx_sw -> rx_sw without
+// hardware timestamps), so the stages of a packet always add up to its
+// latency. The outliers are blamed on the stage that exceeds its median the
+// most.
+//
+// The stages across the hosts need synchronized clocks (PTP), the stages
+// between a software and a hardware timestamp a NIC clock synchronized to the
+// system clock (phc2sys), or the hardware timestamps converted by `rtn --phc`.
+
+////////////////////////////////////////////////////////////////////////////////
+// # Includes
+#include "rtn_base.h"
+#include "rtn_hist.h"
+#include "rtn_result.h"
+
+static char *usage_str =
+    "Usage: %s [-t ns] [-n count] tx_file rx_file\n"
+    "  tx_file, rx_file   results of the tx and rx roles, CSV or binary\n"
+    "  -t, --threshold    latency of an outlier, in ns (default: p99 of the latency)\n"
+    "  -n, --top          number of worst packets to list (default: 10)\n";
+
+static struct option long_opts[] = {
+    { "threshold", required_argument, NULL, 't' },
+    { "top",       required_argument, NULL, 'n' },
+    { "help",      no_argument,       NULL, 'h' },
+    { 0 },
+};
+
+// The tool has nothing to do without its buffers: exit on failure, `ptr` is
+// NULL for a new buffer.
+static void *
+decomp_realloc(void *ptr, usize size)
+{
+    void *res = realloc(ptr, size);
+    if (res == NULL && size > 0) {
+        fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+        exit(1);
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Results
+//
+// The columns of a file by rtn_result_col, whatever its format.
+typedef struct result_set result_set;
+struct result_set
+{
+    u64  num_records;
+    i64 *cols[RTN_COL_MAX];     // NULL: not in the file
+};
+
+static void
+result_set_free(result_set *set)
+{
+    for (int c = 0; c < RTN_COL_MAX; c++)   free(set->cols[c]);
+}
+
+static int
+result_set_load_bin(result_set *set, const char *path)
+{
+    rtn_result_reader reader;
+    if (rtn_result_open(&reader, path) < 0)     return -1;
+
+    set->num_records = reader.num_records;
+    for (u32 c = 0; c < reader.hdr->num_columns; c++) {
+        u32 col = reader.hdr->columns[c];
+        if (col >= RTN_COL_MAX || set->cols[col])   continue;
+
+        set->cols[col] = decomp_realloc(NULL, (set->num_records + 1) * sizeof(i64));
+        for (u64 r = 0; r < set->num_records; r++)  set->cols[col][r] = rtn_result_get(&reader, r, c);
+    }
+
+    rtn_result_reader_close(&reader);
+    return 0;
+}
+
+// The CSV of rtn: `#` comment lines, a header line then the records.
+static int
+result_set_load_csv(result_set *set, FILE *file, const char *path)
+{
+    int   map[RTN_RESULT_MAX_COLUMNS];  // field -> rtn_result_col, -1 to skip
+    int   num_fields = 0;
+    u64   capacity   = 0;
+    char *line       = NULL;
+    usize len        = 0;
+
+    while (getline(&line, &len, file) >= 0) {
+        if (line[0] == '#' || line[0] == '\n')  continue;
+
+        if (num_fields == 0) {
+            for (char *name = strtok(line, ", \n"); name && num_fields < RTN_RESULT_MAX_COLUMNS; name = strtok(NULL, ", \n")) {
+                int col = rtn_result_col_from_str(name);
+                if (col >= 0 && set->cols[col] != NULL)     col = -1;
+                if (col >= 0)   set->cols[col] = decomp_realloc(NULL, sizeof(i64));
+                map[num_fields++] = col;
+            }
+            continue;
+        }
+
+        if (set->num_records == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 16;
+            for (int c = 0; c < RTN_COL_MAX; c++) {
+                if (set->cols[c])   set->cols[c] = decomp_realloc(set->cols[c], capacity * sizeof(i64));
+            }
+        }
+
+        char *field = line;
+        for (int f = 0; f < num_fields; f++) {
+            char *end;
+            i64 value = strtoll(field, &end, 10);
+            if (end == field) {
+                fprintf(stderr, "%s: invalid record %ld\n", path, set->num_records);
+                free(line);
+                return -1;
+            }
+
+            if (map[f] >= 0)    set->cols[map[f]][set->num_records] = value;
+            field = end + strspn(end, ", ");
+        }
+        set->num_records += 1;
+    }
+
+    free(line);
+
+    if (num_fields == 0) {
+        fprintf(stderr, "%s: no header line\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+result_set_load(result_set *set, const char *path)
+{
+    memset(set, 0, sizeof(*set));
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char magic[8] = {0};
+    bool bin = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, RTN_RESULT_MAGIC, sizeof(magic)) == 0;
+
+    int ret;
+    if (bin) {
+        ret = result_set_load_bin(set, path);
+    } else {
+        rewind(file);
+        ret = result_set_load_csv(set, file, path);
+    }
+
+    fclose(file);
+
+    if (ret == 0 && set->cols[RTN_COL_ID] == NULL) {
+        fprintf(stderr, "%s: no id column\n", path);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static inline i64
+result_set_get(const result_set *set, int col, u64 row) { return set->cols[col] ? set->cols[col][row] : 0; }
+
+////////////////////////////////////////////////////////////////////////////////
+// # Stages
+//
+// A stage goes from timestamp `from` to timestamp `to` of the chain, the
+// stages between non consecutive timestamps are named after the stages they
+// cover.
+typedef enum
+{
+    TS_TX_APP,
+    TS_TX_SCHED,
+    TS_TX_SW,
+    TS_TX_HW,
+    TS_RX_HW,
+    TS_RX_SW,
+    TS_RX_APP,
+
+    TS_MAX,
+} ts_point;
+
+static const int s_ts_cols[TS_MAX] = {
+    [TS_TX_APP]   = RTN_COL_TX_APP,
+    [TS_TX_SCHED] = RTN_COL_TX_SCHED,
+    [TS_TX_SW]    = RTN_COL_TX_SW,
+    [TS_TX_HW]    = RTN_COL_TX_HW,
+    [TS_RX_HW]    = RTN_COL_RX_HW,
+    [TS_RX_SW]    = RTN_COL_RX_SW,
+    [TS_RX_APP]   = RTN_COL_RX_APP,
+};
+
+// stage ending at each timestamp
+static const char *s_stage_str[TS_MAX] = {
+    [TS_TX_SCHED] = "tx stack",
+    [TS_TX_SW]    = "qdisc",
+    [TS_TX_HW]    = "tx driver/NIC",
+    [TS_RX_HW]    = "wire",
+    [TS_RX_SW]    = "rx NIC/driver",
+    [TS_RX_APP]   = "rx wakeup",
+};
+
+#define STAGE(from, to)     ((from) * TS_MAX + (to))
+#define MAX_STAGES          (TS_MAX * TS_MAX)
+
+typedef struct packet_stages packet_stages;
+struct packet_stages
+{
+    int  num;
+    int  stage[TS_MAX];
+    i64  delta[TS_MAX];
+    i64  total;
+};
+
+// Split the latency of a packet, returns false without the application
+// timestamps of both ends.
+static bool
+packet_split(const i64 *ts, packet_stages *out)
+{
+    out->num = 0;
+    if (ts[TS_TX_APP] == 0 || ts[TS_RX_APP] == 0)   return false;
+
+    int from = TS_TX_APP;
+    for (int to = TS_TX_APP + 1; to < TS_MAX; to++) {
+        if (ts[to] == 0)    continue;
+
+        out->stage[out->num] = STAGE(from, to);
+        out->delta[out->num] = ts[to] - ts[from];
+        out->num            += 1;
+        from                 = to;
+    }
+
+    out->total = ts[TS_RX_APP] - ts[TS_TX_APP];
+    return true;
+}
+
+static void
+stage_name(int stage, char *buf, usize len)
+{
+    int from = stage / TS_MAX, to = stage % TS_MAX;
+    usize n  = snprintf(buf, len, "%s->%s", rtn_result_col_name(s_ts_cols[from]), rtn_result_col_name(s_ts_cols[to]));
+    for (int i = from + 1; i <= to && n < len; i++) {
+        n += snprintf(buf + n, len - n, "%s%s", i == from + 1 ? " (" : " + ", s_stage_str[i]);
+    }
+    if (n < len)    snprintf(buf + n, len - n, ")");
+}
+
+typedef struct outlier outlier;
+struct outlier
+{
+    i64 id;
+    i64 total;
+    int stage;
+    i64 excess;     // over the median of the stage
+};
+
+static void
+print_hist_row(const char *name, const rtn_hist *h)
+{
+    printf("%-52s %9ld %9ld %9ld %9ld %9ld %9ld %6ld\n", name, h->total, h->min,
+           rtn_hist_percentile(h, 50.0), rtn_hist_percentile(h, 99.0), rtn_hist_percentile(h, 99.9), h->max, h->num_negative);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Main
+int
+main(int argc, char *argv[])
+{
+    i64 threshold = 0;
+    int top       = 10;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:n:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 't': threshold = atoll(optarg); break;
+            case 'n': top       = atoi(optarg);  break;
+            case 'h':
+            default:
+                fprintf(stderr, usage_str, argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind != argc - 2 || top < 0) {
+        fprintf(stderr, usage_str, argv[0]);
+        exit(1);
+    }
+
+    result_set tx, rx;
+    if (result_set_load(&tx, argv[optind]) < 0 || result_set_load(&rx, argv[optind + 1]) < 0)     exit(1);
+
+    // rx row of each id
+    i64 max_id = -1;
+    for (u64 r = 0; r < tx.num_records; r++) {
+        if (tx.cols[RTN_COL_ID][r] > max_id)    max_id = tx.cols[RTN_COL_ID][r];
+    }
+
+    i64 *rx_row = decomp_realloc(NULL, (max_id + 1) * sizeof(i64));
+    for (i64 id = 0; id <= max_id; id++)    rx_row[id] = -1;
+    for (u64 r = 0; r < rx.num_records; r++) {
+        i64 id = rx.cols[RTN_COL_ID][r];
+        if (id >= 0 && id <= max_id)    rx_row[id] = r;
+    }
+
+    // first pass: distribution of each stage
+    rtn_hist *stages[MAX_STAGES] = {0};
+    rtn_hist *total = decomp_realloc(NULL, sizeof(rtn_hist));
+    rtn_hist_init(total);
+
+    u64 num_joined = 0, num_incomplete = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        outlier *worst    = decomp_realloc(NULL, (top + 1) * sizeof(outlier));
+        u64 blame[MAX_STAGES] = {0};
+        u64 num_outliers  = 0;
+        int num_worst     = 0;
+
+        if (pass == 1 && threshold == 0)    threshold = rtn_hist_percentile(total, 99.0);
+
+        for (u64 r = 0; r < tx.num_records; r++) {
+            i64 id = tx.cols[RTN_COL_ID][r];
+            if (id < 0 || rx_row[id] < 0)   continue;
+
+            i64 ts[TS_MAX];
+            for (int p = 0; p < TS_MAX; p++) {
+                const result_set *set = p < TS_RX_HW ? &tx : &rx;
+                u64 row               = p < TS_RX_HW ? r : (u64)rx_row[id];
+                ts[p] = result_set_get(set, s_ts_cols[p], row);
+            }
+
+            packet_stages ps;
+            if (!packet_split(ts, &ps)) {
+                if (pass == 0)  num_incomplete += 1;
+                continue;
+            }
+
+            if (pass == 0) {
+                num_joined += 1;
+                rtn_hist_record(total, ps.total);
+                for (int s = 0; s < ps.num; s++) {
+                    if (stages[ps.stage[s]] == NULL) {
+                        stages[ps.stage[s]] = decomp_realloc(NULL, sizeof(rtn_hist));
+                        rtn_hist_init(stages[ps.stage[s]]);
+                    }
+                    rtn_hist_record(stages[ps.stage[s]], ps.delta[s]);
+                }
+                continue;
+            }
+
+            if (ps.total <= threshold)  continue;
+
+            // blame the stage furthest above its median
+            outlier o = { .id = id, .total = ps.total, .stage = -1 };
+            for (int s = 0; s < ps.num; s++) {
+                i64 excess = ps.delta[s] - rtn_hist_percentile(stages[ps.stage[s]], 50.0);
+                if (o.stage < 0 || excess > o.excess) {
+                    o.stage  = ps.stage[s];
+                    o.excess = excess;
+                }
+            }
+
+            num_outliers    += 1;
+            blame[o.stage]  += 1;
+
+            // insertion in the worst packets, by latency
+            int i = num_worst < top ? num_worst++ : top;
+            for (; i > 0 && worst[i - 1].total < o.total; i--)     worst[i] = worst[i - 1];
+            if (i < top)    worst[i] = o;
+        }
+
+        if (pass == 0) {
+            printf("%ld packets sent, %ld received, %ld joined by id", tx.num_records, rx.num_records, num_joined);
+            if (num_incomplete)     printf(", %ld without application timestamps", num_incomplete);
+            printf("\n\n");
+
+            if (num_joined == 0) {
+                fprintf(stderr, "No packet in both files\n");
+                exit(1);
+            }
+
+            printf("%-52s %9s %9s %9s %9s %9s %9s %6s\n", "stage (ns)", "n", "min", "p50", "p99", "p99.9", "max", "neg");
+            char name[128];
+            for (int s = 0; s < MAX_STAGES; s++) {
+                if (stages[s] == NULL)  continue;
+                stage_name(s, name, sizeof(name));
+                print_hist_row(name, stages[s]);
+            }
+            print_hist_row("latency (tx_app->rx_app)", total);
+        } else {
+            printf("\n%ld outliers, latency > %ld ns, blamed on:\n", num_outliers, threshold);
+            char name[128];
+            for (int s = 0; s < MAX_STAGES; s++) {
+                if (blame[s] == 0)  continue;
+                stage_name(s, name, sizeof(name));
+                printf("  %-52s %9ld %6.1f%%\n", name, blame[s], 100.0 * blame[s] / num_outliers);
+            }
+
+            if (num_worst > 0)  printf("\n%9s %12s %12s  %s\n", "id", "latency", "excess", "stage");
+            for (int i = 0; i < num_worst; i++) {
+                stage_name(worst[i].stage, name, sizeof(name));
+                printf("%9ld %12ld %12ld  %s\n", worst[i].id, worst[i].total, worst[i].excess, name);
+            }
+        }
+
+        free(worst);
+    }
+
+    for (int s = 0; s < MAX_STAGES; s++)    free(stages[s]);
+    free(total);
+    free(rx_row);
+    result_set_free(&tx);
+    result_set_free(&rx);
+    return 0;
+}
@@ -0,0 +1,240 @@
+#ifndef RTN_FRAME_H
+#define RTN_FRAME_H
+
+#include "rtn_base.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Frame Templates
+//
+// Backends that bypass the kernel network stack (AF_XDP, AF_PACKET) have to
+// put the Ethernet (and IPv4/UDP) headers on the wire themselves. The headers are built
+// once in a template, so sending a packet only patches the length fields and
+// the IPv4 checksum before copying the payload behind them.
+
+#define RTN_FRAME_HDR_MAX   64
+#define RTN_VLAN_HLEN       4
+#define RTN_FRAME_UDP_HLEN  (ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr_rtn))
+
+// `struct udphdr` from <netinet/udp.h> needs _DEFAULT_SOURCE field names, keep
+// our own definition to stay independent from the libc flavour.
+struct udphdr_rtn {
+    u16 source;
+    u16 dest;
+    u16 len;
+    u16 check;
+};
+
+typedef struct rtn_frame_tmpl rtn_frame_tmpl;
+struct rtn_frame_tmpl
+{
+    u8    hdr[RTN_FRAME_HDR_MAX];
+    usize hdr_len;
+    usize l3_off;       // offset of the IPv4 header, 0 for raw Ethernet frames
+    u32   ip_csum;      // one's complement sum of the IPv4 header without tot_len
+};
+
+static inline u16
+rtn_frame_csum_fold(u32 sum)
+{
+    while (sum >> 16)   sum = (sum & 0xffff) + (sum >> 16);
+    return (u16)~sum;
+}
+
+static inline u32
+rtn_frame_csum_add(u32 sum, const void *data, usize len)
+{
+    const u8 *p = data;
+    for (usize i = 0; i + 1 < len; i += 2)  sum += (p[i] << 8) | p[i + 1];
+    if (len & 1)                            sum += p[len - 1] << 8;
+    return sum;
+}
+
+static void
+rtn_frame_tmpl_init_udp(rtn_frame_tmpl *tmpl, const u8 *smac, const u8 *dmac,
+                        struct in_addr saddr, struct in_addr daddr, u16 sport, u16 dport)
+{
+    memset(tmpl, 0, sizeof(*tmpl));
+
+    struct ethhdr *eth = (struct ethhdr *)tmpl->hdr;
+    memcpy(eth->h_dest,   dmac, ETH_ALEN);
+    memcpy(eth->h_source, smac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+
+    tmpl->l3_off = ETH_HLEN;
+
+    struct iphdr *ip = (struct iphdr *)(tmpl->hdr + tmpl->l3_off);
+    ip->version  = 4;
+    ip->ihl      = sizeof(struct iphdr) / 4;
+    ip->ttl      = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->frag_off = htons(IP_DF);
+    ip->saddr    = saddr.s_addr;
+    ip->daddr    = daddr.s_addr;
+
+    struct udphdr_rtn *udp = (struct udphdr_rtn *)(ip + 1);
+    udp->source = htons(sport);
+    udp->dest   = htons(dport);
+    udp->check  = 0;    // optional for UDP over IPv4
+
+    tmpl->hdr_len = RTN_FRAME_UDP_HLEN;
+    tmpl->ip_csum = rtn_frame_csum_add(0, ip, sizeof(struct iphdr));
+}
+
+// Ethernet only template (raw L2 traffic), with an optional 802.1Q tag. The
+// VLAN id and PCP are encoded once in the TCI.
+static void
+rtn_frame_tmpl_init_eth(rtn_frame_tmpl *tmpl, const u8 *smac, const u8 *dmac,
+                        u16 ethertype, int vlan_id, int vlan_pcp)
+{
+    memset(tmpl, 0, sizeof(*tmpl));
+
+    u8 *p = tmpl->hdr;
+    memcpy(p, dmac, ETH_ALEN);  p += ETH_ALEN;
+    memcpy(p, smac, ETH_ALEN);  p += ETH_ALEN;
+
+    if (vlan_id >= 0) {
+        u16 tpid = htons(ETH_P_8021Q);
+        u16 tci  = htons((u16)(((vlan_pcp & 0x7) << 13) | (vlan_id & 0xfff)));
+        memcpy(p, &tpid, 2);    p += 2;
+        memcpy(p, &tci,  2);    p += 2;
+    }
+
+    u16 proto = htons(ethertype);
+    memcpy(p, &proto, 2);       p += 2;
+
+    tmpl->hdr_len = p - tmpl->hdr;
+    tmpl->l3_off  = 0;
+}
+
+// Write headers and payload into `frame`, returns the length of the frame.
+static inline usize
+rtn_frame_build(const rtn_frame_tmpl *tmpl, u8 *frame, const void *data, usize len)
+{
+    memcpy(frame, tmpl->hdr, tmpl->hdr_len);
+    memcpy(frame + tmpl->hdr_len, data, len);
+
+    if (tmpl->l3_off == 0)  return tmpl->hdr_len + len;
+
+    struct iphdr *ip = (struct iphdr *)(frame + tmpl->l3_off);
+    u16 ip_len       = (u16)(tmpl->hdr_len - tmpl->l3_off + len);
+    ip->tot_len      = htons(ip_len);
+    ip->check        = htons(rtn_frame_csum_fold(tmpl->ip_csum + ip_len));
+
+    struct udphdr_rtn *udp = (struct udphdr_rtn *)(ip + 1);
+    udp->len               = htons((u16)(sizeof(struct udphdr_rtn) + len));
+
+    return tmpl->hdr_len + len;
+}
+
+// Return the UDP payload of an IPv4 frame addressed to `port`, or -1 when the
+// frame is something else.
+static inline isize
+rtn_frame_parse_udp(const u8 *frame, usize len, u16 port, const u8 **data)
+{
+    if (len < RTN_FRAME_UDP_HLEN)   return -1;
+
+    const struct ethhdr *eth = (const struct ethhdr *)frame;
+    if (eth->h_proto != htons(ETH_P_IP))    return -1;
+
+    const struct iphdr *ip = (const struct iphdr *)(frame + ETH_HLEN);
+    if (ip->protocol != IPPROTO_UDP || ip->ihl != 5)    return -1;
+
+    const struct udphdr_rtn *udp = (const struct udphdr_rtn *)(ip + 1);
+    if (udp->dest != htons(port))   return -1;
+
+    usize udp_len = ntohs(udp->len);
+    if (udp_len < sizeof(*udp) || ETH_HLEN + sizeof(*ip) + udp_len > len)  return -1;
+
+    *data = (const u8 *)(udp + 1);
+    return udp_len - sizeof(*udp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Interface Helpers
+static int
+rtn_if_get_hwaddr(int sockfd, const char *ifname, u8 *mac)
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+    if (ioctl(sockfd, SIOCGIFHWADDR, &ifr) == -1) {
+        perror("ioctl(SIOCGIFHWADDR)");
+        return -1;
+    }
+
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    return 0;
+}
+
+static int
+rtn_if_get_ipv4(int sockfd, const char *ifname, struct in_addr *addr)
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+    ifr.ifr_addr.sa_family = AF_INET;
+    if (ioctl(sockfd, SIOCGIFADDR, &ifr) == -1) {
+        perror("ioctl(SIOCGIFADDR)");
+        return -1;
+    }
+
+    *addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+    return 0;
+}
+
+static int
+rtn_mac_from_str(const char *str, u8 *mac)
+{
+    unsigned int m[ETH_ALEN];
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != ETH_ALEN) {
+        return -1;
+    }
+
+    for (int i = 0; i < ETH_ALEN; i++)  mac[i] = (u8)m[i];
+    return 0;
+}
+
+// Look up the MAC address of `addr` in the kernel neighbour table. If the
+// entry is missing, a datagram is sent through the kernel stack to trigger
+// the ARP resolution and the table is checked again for up to one second.
+// The datagram goes to the discard port, so it never reaches a test receiver.
+static int
+rtn_neigh_resolve(const char *ifname, struct in_addr addr, u8 *mac)
+{
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, ip_str, sizeof(ip_str));
+
+    for (int attempt = 0; attempt < 100; attempt++) {
+        FILE *file = fopen("/proc/net/arp", "r");
+        if (file == NULL) {
+            perror("fopen(/proc/net/arp)");
+            return -1;
+        }
+
+        char line[256];
+        while (fgets(line, sizeof(line), file)) {
+            char ip[64], hw[64], dev[64];
+            unsigned int type, flags;
+            if (sscanf(line, "%63s 0x%x 0x%x %63s %*s %63s", ip, &type, &flags, hw, dev) != 5)  continue;
+            if (!cstr_eq(ip, ip_str) || !cstr_eq(dev, ifname) || !(flags & 0x2))           continue;
+
+            fclose(file);
+            return rtn_mac_from_str(hw, mac);
+        }
+        fclose(file);
+
+        if (attempt == 0) {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(9), .sin_addr = addr };
+            setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname));
+            sendto(fd, "", 0, 0, (struct sockaddr *)&sin, sizeof(sin));
+            close(fd);
+        }
+
+        usleep(1000 * 10);
+    }
+
+    return -1;
+}
+
+#endif // RTN_FRAME_H
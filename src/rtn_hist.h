@@ -0,0 +1,169 @@
+#ifndef RTN_HIST_H
+#define RTN_HIST_H
+
+#include "rtn_base.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Latency Histogram
+//
+// Fixed-memory log-linear histogram of nanosecond values (HDR style). Values
+// below 2^(SUB_BITS+1) have their own bucket, above that every power of two is
+// split in 2^SUB_BITS buckets, so the relative error is below 1/2^SUB_BITS
+// (0.8%) over the whole i64 range. Recording is O(1) and never allocates, a
+// histogram has a single writer; histograms of other threads or runs are
+// combined with `rtn_hist_merge` once their writer is done.
+//
+// Negative values (e.g. one-way latency with unsynchronized clocks) are
+// counted in the first bucket, `min` keeps the exact value. The counters are
+// stored with relaxed atomics, another thread can take snapshots while the
+// histogram is recorded (telemetry).
+
+#define RTN_HIST_SUB_BITS       7
+#define RTN_HIST_SUB_COUNT      (1 << RTN_HIST_SUB_BITS)
+#define RTN_HIST_NUM_BUCKETS    ((64 - RTN_HIST_SUB_BITS + 1) * RTN_HIST_SUB_COUNT)
+
+typedef struct rtn_hist rtn_hist;
+struct rtn_hist
+{
+    u64  counts[RTN_HIST_NUM_BUCKETS];
+    u64  total;
+    u64  num_negative;
+    i64  min;
+    i64  max;
+    f64  sum;               // for the mean, an i64 sum could overflow
+};
+
+static inline void
+rtn_hist_init(rtn_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = INT64_MAX;
+    h->max = INT64_MIN;
+}
+
+static inline u32
+rtn_hist_bucket(u64 value)
+{
+    if (value < (2u << RTN_HIST_SUB_BITS))  return value;
+
+    u32 msb   = 63 - __builtin_clzll(value);
+    u32 shift = msb - RTN_HIST_SUB_BITS;
+    return (shift << RTN_HIST_SUB_BITS) + (u32)(value >> shift);
+}
+
+// Highest value that falls in `bucket`.
+static inline i64
+rtn_hist_bucket_value(u32 bucket)
+{
+    if (bucket < (2u << RTN_HIST_SUB_BITS))     return bucket;
+
+    u32 shift = (bucket >> RTN_HIST_SUB_BITS) - 1;
+    u64 top   = bucket - (shift << RTN_HIST_SUB_BITS);
+    u64 value = ((top + 1) << shift) - 1;
+    return value > INT64_MAX ? INT64_MAX : (i64)value;
+}
+
+static inline void
+rtn_hist_record(rtn_hist *h, i64 value)
+{
+    if (value < 0)  h->num_negative += 1;
+
+    u64 *count = &h->counts[value < 0 ? 0 : rtn_hist_bucket(value)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    h->sum += value;
+    if (value < h->min)     h->min = value;
+    if (value > h->max)     h->max = value;
+}
+
+static void
+rtn_hist_merge(rtn_hist *dst, const rtn_hist *src)
+{
+    for (u32 i = 0; i < RTN_HIST_NUM_BUCKETS; i++)  dst->counts[i] += src->counts[i];
+
+    dst->total        += src->total;
+    dst->num_negative += src->num_negative;
+    dst->sum          += src->sum;
+    if (src->min < dst->min)    dst->min = src->min;
+    if (src->max > dst->max)    dst->max = src->max;
+}
+
+// Value below which `percentile` (0-100) of the samples fall, clamped to the
+// exact min/max.
+static i64
+rtn_hist_percentile(const rtn_hist *h, f64 percentile)
+{
+    if (h->total == 0)  return 0;
+
+    u64 rank = (u64)(percentile / 100.0 * h->total + 0.5);
+    if (rank < 1)           rank = 1;
+    if (rank > h->total)    rank = h->total;
+
+    u64 count = 0;
+    for (u32 i = 0; i < RTN_HIST_NUM_BUCKETS; i++) {
+        count += h->counts[i];
+        if (count >= rank) {
+            i64 value = rtn_hist_bucket_value(i);
+            if (value < h->min)     value = h->min;
+            if (value > h->max)     value = h->max;
+            return value;
+        }
+    }
+
+    return h->max;
+}
+
+static inline i64 rtn_hist_mean (const rtn_hist *h) { return h->total ? (i64)(h->sum / h->total) : 0; }
+
+// One line summary: count, min, mean, tail percentiles and max.
+static void
+rtn_hist_print(const rtn_hist *h, const char *name, FILE *file)
+{
+    if (h->total == 0) {
+        fprintf(file, "%s: no samples\n", name);
+        return;
+    }
+
+    fprintf(file, "%s: n=%ld min=%ld mean=%ld p50=%ld p90=%ld p99=%ld p99.9=%ld p99.99=%ld max=%ld\n",
+            name, h->total, h->min, rtn_hist_mean(h),
+            rtn_hist_percentile(h, 50.0), rtn_hist_percentile(h, 90.0), rtn_hist_percentile(h, 99.0),
+            rtn_hist_percentile(h, 99.9), rtn_hist_percentile(h, 99.99), h->max);
+
+    if (h->num_negative > 0)    fprintf(file, "%s: %ld negative values counted as 0\n", name, h->num_negative);
+}
+
+// CSV for plotting, one line per non-empty bucket: the upper bound of the
+// bucket, its count and the cumulative percentile. Several histograms can be
+// written to the same file, they are told apart by `name`.
+static void
+rtn_hist_export(const rtn_hist *h, const char *name, FILE *file)
+{
+    u64 count = 0;
+    for (u32 i = 0; i < RTN_HIST_NUM_BUCKETS; i++) {
+        if (h->counts[i] == 0)  continue;
+
+        count += h->counts[i];
+        fprintf(file, "%s, %ld, %ld, %.6f\n", name, rtn_hist_bucket_value(i), h->counts[i], 100.0 * count / h->total);
+    }
+}
+
+static inline void rtn_hist_export_header (FILE *file) { fprintf(file, "hist, value, count, percentile\n"); }
+
+// Export `count` histograms to the CSV file at `path`.
+static int
+rtn_hist_save(const char *path, int count, const rtn_hist *hists[], const char *names[])
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    rtn_hist_export_header(file);
+    for (int i = 0; i < count; i++)     rtn_hist_export(hists[i], names[i], file);
+
+    fclose(file);
+    return 0;
+}
+
+#endif // RTN_HIST_H
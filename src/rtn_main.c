@@ -7,18 +7,26 @@
 ////////////////////////////////////////////////////////////////////////////////
 // # Includes
 #include "rtn_base.h"
-#include "rtn_client.h"
+#include "rtn_control.h"
+#include "rtn_cycle.h"
+#include "rtn_hist.h"
 #include "rtn_log.h"
 #include "rtn_options.h"
 #include "rtn_packet.h"
+#include "rtn_phc.h"
 #include "rtn_ping.h"
+#include "rtn_result.h"
 #include "rtn_socket.h"
 #include "rtn_stats.h"
-#include "rtn_server.h"
+#include "rtn_stream.h"
+#include "rtn_telemetry.h"
 #include "rtn_txrx.h"
 
 // # C Files
 #include "rtn_socket.c"
+#include "rtn_xdp.c"
+#include "rtn_tpacket.c"
+#include "rtn_uring.c"
 
 ////////////////////////////////////////////////////////////////////////////////
 // # Globals
@@ -33,15 +41,718 @@ static options_t g_opts = {
     .packet_size  = 256,
     .cpus         = "1",
     .cycle_time   = 1000000,  // 1 ms
+    .rx_timeout   = 1000000000, // 1 s
     .num_packets  = 1000,
+    .burst_size   = 1,
+    .socket_type  = "udp",
+    .engine       = "socket",
+    .xdp_queue    = 0,
+    .xdp_mode     = "generic",
+    .ethertype    = RTN_RAW_ETHERTYPE_DEFAULT,
+    .vlan_id      = -1,
     .verbose      = false,
     .save_file    = false,
+    .format       = "csv",
+    .overrun      = "catchup",
+    .wait         = "sleep",
+    .spin_margin  = 50000,    // 50 us
+    .clock_name   = "realtime",
+    .telemetry_interval = 1000000000, // 1 s
     .log_level    = "info",
 };
 
 static char *usage_str = 
     "Usage: %s [-p sched_policy] [-P sched_priority] [-r role] [-i interface]"
-    "[-d dest_ip] [-o port] [-s packet_size] [-c cpus] [-n num_packets] [-C cycle_time]\n";
+    "[-d dest_ip] [-o port] [-s packet_size] [-c cpus] [-n num_packets] [-C cycle_time] [-b burst_size]\n"
+    "          [-t udp|raw|mmap|xdp] [--xdp-queue queue] [--xdp-mode generic|native|zerocopy] [--dst-mac mac]\n"
+    "          [--ethertype type] [--vlan id] [--pcp prio] [--engine socket|uring] [--sqpoll]\n"
+    "          [--async] [--rx-timeout ns] [--txtime-lead ns] [--stream port:cycle:size:prio:cpu ...]\n"
+    "          [--hist-file file] [--format csv|bin] [--telemetry name] [--telemetry-interval ns]\n"
+    "          [--overrun catchup|skip] [--wait sleep|spin|hybrid] [--spin-margin ns] [--busy-poll us]\n"
+    "          [--clock realtime|tsc] [--phc] [--hugepages] [--rx-queues n] [--control port]\n";
+
+// Long only options
+enum {
+    OPT_XDP_QUEUE = 256,
+    OPT_XDP_MODE,
+    OPT_DST_MAC,
+    OPT_ETHERTYPE,
+    OPT_VLAN,
+    OPT_PCP,
+    OPT_ENGINE,
+    OPT_SQPOLL,
+    OPT_ASYNC,
+    OPT_RX_TIMEOUT,
+    OPT_TXTIME_LEAD,
+    OPT_STREAM,
+    OPT_HIST_FILE,
+    OPT_FORMAT,
+    OPT_TELEMETRY,
+    OPT_TELEMETRY_INTERVAL,
+    OPT_OVERRUN,
+    OPT_WAIT,
+    OPT_SPIN_MARGIN,
+    OPT_BUSY_POLL,
+    OPT_CLOCK,
+    OPT_PHC,
+    OPT_HUGEPAGES,
+    OPT_RX_QUEUES,
+    OPT_CONTROL,
+};
+
+static struct option long_opts[] = {
+    { "policy",      required_argument, NULL, 'p'           },
+    { "priority",    required_argument, NULL, 'P'           },
+    { "role",        required_argument, NULL, 'r'           },
+    { "interface",   required_argument, NULL, 'i'           },
+    { "dest",        required_argument, NULL, 'd'           },
+    { "port",        required_argument, NULL, 'o'           },
+    { "size",        required_argument, NULL, 's'           },
+    { "cpus",        required_argument, NULL, 'c'           },
+    { "num-packets", required_argument, NULL, 'n'           },
+    { "cycle",       required_argument, NULL, 'C'           },
+    { "burst",       required_argument, NULL, 'b'           },
+    { "socket",      required_argument, NULL, 't'           },
+    { "xdp-queue",   required_argument, NULL, OPT_XDP_QUEUE },
+    { "xdp-mode",    required_argument, NULL, OPT_XDP_MODE  },
+    { "dst-mac",     required_argument, NULL, OPT_DST_MAC   },
+    { "ethertype",   required_argument, NULL, OPT_ETHERTYPE },
+    { "vlan",        required_argument, NULL, OPT_VLAN      },
+    { "pcp",         required_argument, NULL, OPT_PCP       },
+    { "engine",      required_argument, NULL, OPT_ENGINE    },
+    { "sqpoll",      no_argument,       NULL, OPT_SQPOLL    },
+    { "async",       no_argument,       NULL, OPT_ASYNC     },
+    { "rx-timeout",  required_argument, NULL, OPT_RX_TIMEOUT },
+    { "txtime-lead", required_argument, NULL, OPT_TXTIME_LEAD },
+    { "stream",      required_argument, NULL, OPT_STREAM    },
+    { "hist-file",   required_argument, NULL, OPT_HIST_FILE },
+    { "format",      required_argument, NULL, OPT_FORMAT    },
+    { "telemetry",   required_argument, NULL, OPT_TELEMETRY },
+    { "telemetry-interval", required_argument, NULL, OPT_TELEMETRY_INTERVAL },
+    { "overrun",     required_argument, NULL, OPT_OVERRUN   },
+    { "wait",        required_argument, NULL, OPT_WAIT      },
+    { "spin-margin", required_argument, NULL, OPT_SPIN_MARGIN },
+    { "busy-poll",   required_argument, NULL, OPT_BUSY_POLL },
+    { "clock",       required_argument, NULL, OPT_CLOCK     },
+    { "phc",         no_argument,       NULL, OPT_PHC       },
+    { "hugepages",   no_argument,       NULL, OPT_HUGEPAGES },
+    { "rx-queues",   required_argument, NULL, OPT_RX_QUEUES },
+    { "control",     required_argument, NULL, OPT_CONTROL   },
+    { "log-level",   required_argument, NULL, 'l'           },
+    { "verbose",     no_argument,       NULL, 'v'           },
+    { "save-file",   no_argument,       NULL, 'f'           },
+    { "help",        no_argument,       NULL, 'h'           },
+    { 0 },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// # Helpers
+
+// Create the socket used for the tests, exits on failure.
+static rtn_socket *
+open_socket(options_t *opts, bool use_uring)
+{
+    int sock_type = rtn_socket_type_from_str(opts->socket_type);
+    if (sock_type != RTN_SOCK_TYPE_UDP && sock_type != RTN_SOCK_TYPE_RAW && sock_type != RTN_SOCK_TYPE_MMAP && sock_type != RTN_SOCK_TYPE_XDP) {
+        error("Unsupported socket type: %s\n", opts->socket_type);
+        exit(1);
+    }
+
+    rtn_socket *sock = NULL;
+    if (sock_type == RTN_SOCK_TYPE_XDP) {
+        int mode = rtn_xdp_mode_from_str(opts->xdp_mode);
+        if (mode == -1) {
+            error("Invalid XDP mode: %s\n", opts->xdp_mode);
+            exit(1);
+        }
+
+        rtn_xdp_config xdp_cfg = {
+            .queue_id = opts->xdp_queue,
+            .mode     = mode,
+            .dst_mac  = opts->dst_mac,
+        };
+        sock = rtn_socket_new_xdp(opts->interface, opts->port, &xdp_cfg);
+    } else if (sock_type == RTN_SOCK_TYPE_RAW || sock_type == RTN_SOCK_TYPE_MMAP) {
+        if (opts->ethertype <= ETH_P_802_3_MIN || opts->ethertype > 0xffff || opts->vlan_id > 4094 || opts->vlan_pcp < 0 || opts->vlan_pcp > 7) {
+            error("Invalid raw socket parameters: ethertype=0x%x, vlan=%d, pcp=%d\n", opts->ethertype, opts->vlan_id, opts->vlan_pcp);
+            exit(1);
+        }
+
+        rtn_raw_config raw_cfg = {
+            .ethertype = opts->ethertype,
+            .vlan_id   = opts->vlan_id,
+            .vlan_pcp  = opts->vlan_pcp,
+            .dst_mac   = opts->dst_mac,
+        };
+        sock = sock_type == RTN_SOCK_TYPE_RAW ? rtn_socket_new_raw(opts->interface, &raw_cfg) : rtn_socket_new_mmap(opts->interface, &raw_cfg);
+    } else {
+        sock = rtn_socket_new(opts->interface, opts->port, sock_type);
+    }
+
+    if (sock == NULL) {
+        error("Failed to create rtn_socket\n");
+        exit(1);
+    }
+
+    struct sockaddr_in dest_addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(opts->port),
+        .sin_addr.s_addr = inet_addr(opts->dest_ip),
+    };
+    // the receiver never sends, kernel-bypass sockets would needlessly try to
+    // resolve the MAC address of the destination
+    if (opts->role_id != ROLE_RX &&
+        rtn_socket_set_dest_addr(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+        error("Failed to set the destination address\n");
+        exit(1);
+    }
+
+    // every role that sends reads its TX timestamps from the error queue: the
+    // stats thread for tx, ping and pong themselves
+    if (rtn_socket_has_timestamps(sock))    rtn_socket_enable_timestamping(sock, opts->interface, opts->role_id != ROLE_RX);
+
+    if (opts->busy_poll > 0 && rtn_socket_set_busy_poll(sock, opts->busy_poll) < 0) {
+        error("Failed to enable busy polling (SO_BUSY_POLL)\n");
+        exit(1);
+    }
+
+    // the receivers wake up to see the end of the test
+    if (opts->role_id == ROLE_RX && rx_has_rcv_timeout(sock) && rtn_socket_set_rcv_timeout(sock, RTN_RX_IDLE) < 0) {
+        error("Failed to set the receive timeout\n");
+        exit(1);
+    }
+
+    if (opts->txtime_lead > 0 && rtn_socket_opt_set_txtimestamp(sock) < 0) {
+        error("Failed to enable the launch time mode (SO_TXTIME)\n");
+        exit(1);
+    }
+
+    if (use_uring) {
+        rtn_uring_config uring_cfg = { .sqpoll = opts->sqpoll, .sqpoll_cpu = -1 };
+        if (rtn_socket_enable_uring(sock, &uring_cfg) < 0) {
+            error("Failed to set up the io_uring engine\n");
+            exit(1);
+        }
+    }
+
+    return sock;
+}
+
+// Format of the records of the tx/rx roles.
+static rtn_stats_fmt
+results_fmt(const options_t *opts)
+{
+    if (opts->role_id == ROLE_TX)   return opts->txtime_lead > 0 ? RTN_STATS_FMT_TX_TXTIME : RTN_STATS_FMT_TX;
+    return RTN_STATS_FMT_RX;
+}
+
+// Binary results file of the tx/rx records, the configuration of the test
+// is saved in its header.
+static rtn_result *
+open_results_bin(options_t *opts, const char *kernel_str, int stream_id, rtn_stats_fmt fmt, const char *filename)
+{
+    u32 columns[RTN_RESULT_MAX_COLUMNS];
+    u32 num_columns = stats_result_columns(fmt, columns);
+
+    rtn_result *result = rtn_result_new(filename, columns, num_columns);
+    if (result == NULL) {
+        error("Failed to create %s\n", filename);
+        exit(1);
+    }
+
+    rtn_result_header *hdr = result->hdr;
+    hdr->role_id   = opts->role_id;
+    hdr->stream_id = stream_id;
+    snprintf(hdr->clock, sizeof(hdr->clock), "CLOCK_REALTIME");
+    snprintf(hdr->kernel, sizeof(hdr->kernel), "%s %s (%s)", opts->os_info.sysname, opts->os_info.release, kernel_str);
+    options_to_str(opts, hdr->cfg, sizeof(hdr->cfg));
+
+    return result;
+}
+
+// Open the results file and write the configuration, `stream_id` is -1
+// outside the multi-stream mode. The binary format sets `*result` instead of
+// `*out`.
+static void
+open_results(options_t *opts, const char *kernel_str, int stream_id, rtn_stats_fmt fmt, FILE **out, rtn_result **result)
+{
+    bool  bin          = cstr_eq(opts->format, "bin");
+    char *output       = NULL;
+    FILE *file_results = NULL;
+    char filename[128] = {0};
+
+    *out    = NULL;
+    *result = NULL;
+    if (opts->save_file) {
+        const char *ext = bin ? "bin" : "csv";
+        if (stream_id < 0)  snprintf(filename, sizeof(filename), "%s_%ldus_%s.%s", opts->role_name, opts->cycle_time / 1000, kernel_str, ext);
+        else {
+            char stream[16];
+            options_stream_name(opts, stream, sizeof(stream));
+            snprintf(filename, sizeof(filename), "%s_%ldus_%s_%s.%s", opts->role_name, opts->cycle_time / 1000, kernel_str, stream, ext);
+        }
+        output = filename;
+
+        if (bin) {
+            info("Writing results to %s\n", output);
+            *result = open_results_bin(opts, kernel_str, stream_id, fmt, filename);
+            return;
+        }
+
+        file_results = fopen(filename, "w");
+        if (file_results == NULL) {
+            error("Failed to open %s: %s\n", filename, strerror(errno));
+            exit(1);
+        }
+    } else {
+        file_results = stdout;
+        output       = "STDOUT";
+    }
+
+    info("Writing results to %s\n", output);
+
+    if (stream_id >= 0)     fprintf(file_results, "# stream: %d\n", stream_id);
+
+    char cfg[1024];
+    options_to_str(opts, cfg, sizeof(cfg));
+    fprintf(file_results, "# cfg: %s\n\n", cfg);
+
+    *out = file_results;
+}
+
+// The stats thread streams the records of the tx/rx roles to `out`, for the
+// talker it also reads the TX timestamps from the error queue. Returns false
+// when the role does not record stats.
+static bool
+start_stats_thread(options_t *opts, rtn_socket *sock, FILE *out, rtn_result *result, pthread_t *thread, stats_thread_args *args)
+{
+    if (opts->role_id != ROLE_TX && opts->role_id != ROLE_RX)  return false;
+
+    *args = (stats_thread_args) {
+        .num_packets   = opts->num_packets,
+        .sock          = sock,
+        .ring          = rtn_ring_new(RTN_STATS_RING_SIZE, sizeof(rtn_pkt_stat)),
+        .sem_start     = &opts->sem_stats_start,
+        .errqueue      = opts->role_id == ROLE_TX && rtn_socket_has_timestamps(sock),
+        .tsc           = opts->role_id == ROLE_RX && opts->clock_type == CLOCK_TYPE_TSC,
+        .phc           = opts->phc,
+        .out           = out,
+        .result        = result,
+        .fmt           = results_fmt(opts),
+        .latency       = opts->role_id == ROLE_RX ? malloc(sizeof(rtn_hist)) : NULL,
+        .flows         = opts->role_id == ROLE_RX && opts->rx_queues > 0 ? calloc(RTN_STATS_MAX_FLOWS, sizeof(stats_flow)) : NULL,
+        .records       = opts->control ? opts->control->records : NULL,
+        .txtime_offset = os_time_get_tai_ns() - os_time_get_rt_ns(),
+        .cycle_time    = opts->cycle_time,
+        .burst_size    = opts->burst_size,
+    };
+
+    if (args->ring == NULL) {
+        error("Failed to allocate the stats ring\n");
+        exit(1);
+    }
+
+    if (opts->role_id == ROLE_RX && args->latency == NULL) {
+        error("Failed to allocate the latency histogram\n");
+        exit(1);
+    }
+
+    if (args->latency)  rtn_hist_init(args->latency);
+
+    // the histograms of the flows are allocated up front, not on the stats
+    // path when a new source shows up
+    if (opts->role_id == ROLE_RX && opts->rx_queues > 0) {
+        if (args->flows == NULL) {
+            error("Failed to allocate the flows of the receiver\n");
+            exit(1);
+        }
+
+        for (u32 i = 0; i < RTN_STATS_MAX_FLOWS; i++) {
+            args->flows[i].latency = malloc(sizeof(rtn_hist));
+            if (args->flows[i].latency == NULL) {
+                error("Failed to allocate the latency histogram of flow %u\n", i);
+                exit(1);
+            }
+
+            rtn_hist_init(args->flows[i].latency);
+        }
+    }
+
+    // live stats, one source per stream
+    if (opts->telemetry) {
+        char name[32], stream[16];
+        options_stream_name(opts, stream, sizeof(stream));
+        if (opts->num_streams > 0)  snprintf(name, sizeof(name), "%s %s", opts->role_name, stream);
+        else                        snprintf(name, sizeof(name), "%s", opts->role_name);
+
+        args->jitter = malloc(sizeof(rtn_hist));
+        if (args->jitter == NULL) {
+            error("Failed to allocate the jitter histogram\n");
+            exit(1);
+        }
+
+        rtn_hist_init(args->jitter);
+        args->tm = rtn_telemetry_add(opts->telemetry, name, args->latency, args->jitter);
+    }
+
+    // Initialize the semaphore
+    os_sem_init(&opts->sem_stats_start, 0, 0);
+
+    if (pthread_create(thread, NULL, stats_thread_fn, args) != 0) {
+        error("Failed to create stats thread\n");
+        exit(1);
+    }
+
+    // set the thread priority low to avoid affecting the main thread
+    os_thread_set_priority(*thread, OS_SCHED_FIFO, 1);
+    return true;
+}
+
+// Wait for the last records, the latency histogram is kept for the report
+// (`free_stats_thread`).
+static void
+stop_stats_thread(pthread_t thread, stats_thread_args *args)
+{
+    pthread_join(thread, NULL);
+
+    if (args->out && args->out != stdout)   fclose(args->out);
+    if (args->result)                       rtn_result_close(args->result);
+    rtn_ring_destroy(args->ring);
+}
+
+static void
+free_stats_thread(stats_thread_args *args)
+{
+    for (u32 i = 0; args->flows && i < RTN_STATS_MAX_FLOWS; i++)    free(args->flows[i].latency);
+
+    free(args->latency);
+    free(args->jitter);
+    free(args->flows);
+}
+
+// --clock tsc, --phc: every second recalibrate the TSC and sample the PHC
+// against CLOCK_REALTIME, with SCHED_OTHER on the default CPUs.
+#define CLOCK_UPDATE_INTERVAL   (1 * NSEC_PER_SEC)
+#define CLOCK_THREAD_POLL       (100 * NSEC_PER_MSEC)
+
+static bool s_clock_thread_stop;
+
+static void *
+clock_thread_fn(void *arg)
+{
+    options_t *opts = arg;
+    os_thread_set_name(os_thread_self(), "rtn-clock");
+
+    i64 next = os_time_get_ns() + CLOCK_UPDATE_INTERVAL;
+    while (!__atomic_load_n(&s_clock_thread_stop, __ATOMIC_ACQUIRE)) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = CLOCK_THREAD_POLL };
+        nanosleep(&ts, NULL);
+
+        if (os_time_get_ns() < next)    continue;
+
+        if (opts->clock_type == CLOCK_TYPE_TSC)     os_tsc_recalibrate();
+        if (opts->phc && rtn_phc_update(opts->phc) < 0)     warn("Failed to sample the PHC\n");
+        next += CLOCK_UPDATE_INTERVAL;
+    }
+
+    return NULL;
+}
+
+static void
+stop_clock_thread(pthread_t thread)
+{
+    __atomic_store_n(&s_clock_thread_stop, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+}
+
+// rx: one-way latency of the application (rx_app - tx_app), the clocks of the
+// two hosts must be synchronized
+static void
+report_latency(options_t *opts, rtn_hist **hists, const char **names, int count)
+{
+    for (int i = 0; i < count; i++)     rtn_hist_print(hists[i], names[i], stderr);
+
+    if (opts->hist_file)    rtn_hist_save(opts->hist_file, count, (const rtn_hist **)hists, names);
+}
+
+// --control, tx: the records of both hosts joined by packet id, saved as the
+// results of an `e2e` role, with the one-way latency of the applications and
+// of the kernels (software and hardware timestamps, when both hosts have them).
+static void
+save_e2e_results(options_t *opts, const char *kernel_str, u64 num_sent)
+{
+    rtn_ctrl *ctrl = opts->control;
+
+    options_t e2e = *opts;
+    e2e.role_name = "e2e";
+
+    stats_thread_args args = { .fmt = RTN_STATS_FMT_E2E };
+    open_results(&e2e, kernel_str, -1, RTN_STATS_FMT_E2E, &args.out, &args.result);
+    stats_write_header(&args);
+
+    rtn_hist   *hists = malloc(3 * sizeof(rtn_hist));
+    const char *names[3] = { "latency", "latency_sw", "latency_hw" };
+    if (hists == NULL) {
+        error("Failed to allocate the latency histograms\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < 3; i++)     rtn_hist_init(&hists[i]);
+
+    u64 num_received = 0;
+    for (u64 id = 0; id < ctrl->params.num_packets; id++) {
+        const stats_record *rec = &ctrl->records[id];
+        if (rec->tx_app == 0)   continue;
+
+        rtn_pkt_stat stat = {
+            .id          = id,
+            .app_tstamps = { .tx_ts = rec->tx_app, .rx_ts = rec->rx_app },
+            .tx_tstamps  = { .hw_ts = rec->tx_hw, .sched_ts = rec->tx_sched, .sw_ts = rec->tx_sw },
+            .rx_tstamps  = { .hw_ts = rec->rx_hw, .sw_ts = rec->rx_sw },
+        };
+        stats_write_record(&args, &stat);
+
+        if (rec->rx_app == 0)   continue;
+
+        num_received += 1;
+        rtn_hist_record(&hists[0], rec->rx_app - rec->tx_app);
+        if (rec->tx_sw && rec->rx_sw)   rtn_hist_record(&hists[1], rec->rx_sw - rec->tx_sw);
+        if (rec->tx_hw && rec->rx_hw)   rtn_hist_record(&hists[2], rec->rx_hw - rec->tx_hw);
+    }
+
+    if (args.out && args.out != stdout)     fclose(args.out);
+    if (args.result)                        rtn_result_close(args.result);
+
+    u64 lost = num_sent > num_received ? num_sent - num_received : 0;
+    info("Receiver: %ld/%ld packets received, %ld lost (%.3f%%)\n", num_received, num_sent, lost, num_sent ? 100.0 * lost / num_sent : 0.0);
+
+    rtn_ctrl_results *res = &ctrl->results;
+    // a packet of the receive loop is a record, a record lost in the ring or a duplicate
+    u64 num_kept = res->num_records + res->num_dropped;
+    if (res->num_received > num_kept)   warn("%ld duplicated packets at the receiver\n", res->num_received - num_kept);
+    if (res->num_dropped > 0)           warn("%ld records lost in the stats ring of the receiver\n", res->num_dropped);
+
+    rtn_hist   *report[3];
+    const char *report_names[3];
+    int count = 0;
+    for (int i = 0; i < 3; i++) {
+        if (i > 0 && hists[i].total == 0)   continue;
+
+        report[count]       = &hists[i];
+        report_names[count] = names[i];
+        count += 1;
+    }
+
+    report_latency(opts, report, report_names, count);
+    free(hists);
+}
+
+static char *
+get_kernel_str(options_t *opts)
+{
+    char *kernel_str = NULL;
+
+    // get the cmdline use to boot the kernel
+    char cmdline[1024] = {0};
+    FILE *file_cmdline = fopen("/proc/cmdline", "r");
+    if (file_cmdline) {
+        char *ret = fgets(cmdline, sizeof(cmdline), file_cmdline);
+        if (ret == NULL) {
+            error("Failed to read /proc/cmdline\n");
+            exit(1);
+        }
+        fclose(file_cmdline);   
+
+        // remove newline
+        cmdline[strcspn(cmdline, "\n")] = 0;
+    }
+
+    char *rt  = strstr(opts->os_info.release, "rt");
+    char *pro = strstr(opts->os_info.release, "realtime");
+    if (rt || pro) {
+        info("Detected Realtime OS: %s %s (%s)\n", opts->os_info.sysname, opts->os_info.release, cmdline);
+
+        // check if boot cmdline contains `rcu_nocb` or `irqaffinity`
+        if (strstr(cmdline, "rcu_nocb") || strstr(cmdline, "irqaffinity")) {
+            kernel_str = "rt-params";
+        } else {
+            kernel_str = rt != NULL ? "rt" : "realtime";
+        }
+
+    } else {
+        info("Detected Non-Realtime OS: %s %s (%s)\n", opts->os_info.sysname, opts->os_info.release, cmdline);
+        kernel_str = "linux";
+    }
+
+    return kernel_str;
+}
+
+// Reuseport group: the flows of all the receivers, merged by source. Every
+// flow should be seen by a single receiver, the one of the CPU of its RX
+// queue.
+typedef struct group_flow group_flow;
+struct group_flow
+{
+    u64         key;
+    u64         num_packets;
+    u64         per_queue[MAX_NUM_STREAMS];
+    rtn_hist    latency;
+};
+
+static int
+merge_flows(rtn_stream *streams, int num_streams, group_flow *flows)
+{
+    int num_flows = 0;
+    for (int i = 0; i < num_streams; i++) {
+        stats_thread_args *args = &streams[i].stats_args;
+        for (u32 j = 0; j < args->num_flows; j++) {
+            stats_flow *src = &args->flows[j];
+
+            int k = 0;
+            while (k < num_flows && flows[k].key != src->key)   k++;
+            if (k == RTN_STATS_MAX_FLOWS)   continue;
+
+            if (k == num_flows) {
+                memset(&flows[k], 0, sizeof(flows[k]));
+                flows[k].key = src->key;
+                rtn_hist_init(&flows[k].latency);
+                num_flows += 1;
+            }
+
+            flows[k].num_packets  += src->num_packets;
+            flows[k].per_queue[i] += src->num_packets;
+            rtn_hist_merge(&flows[k].latency, src->latency);
+        }
+    }
+
+    return num_flows;
+}
+
+// Multi-stream mode: one socket, RT thread and stats thread per stream, the
+// main thread only waits for them. The results of each stream are streamed
+// to their own file.
+static void
+run_streams(options_t *opts, bool use_uring)
+{
+    int num_streams     = opts->num_streams;
+    rtn_stream *streams = calloc(num_streams, sizeof(rtn_stream));
+    if (streams == NULL) {
+        error("Failed to allocate %d streams\n", num_streams);
+        exit(1);
+    }
+
+    // all the tx streams wake up for the first time at the same instant
+    options_t base  = *opts;
+    base.start_time = os_time_normalize_ts(os_time_get_rt_ns() + 2 * NSEC_PER_SEC);
+    base.save_file  = true;
+
+    // the receivers of a reuseport group stop together, see rx_idle
+    bool rx_group_stop = false;
+    if (opts->rx_queues > 0)    base.rx_group_stop = &rx_group_stop;
+
+    char *kernel_str = get_kernel_str(opts);
+    for (int i = 0; i < num_streams; i++) {
+        rtn_stream *stream = &streams[i];
+        rtn_stream_init(stream, i, &base, &opts->streams[i]);
+
+        stream->sock = open_socket(&stream->opts, use_uring);
+        if (opts->role_id == ROLE_PONG)     continue;
+
+        FILE       *out;
+        rtn_result *result;
+        open_results(&stream->opts, kernel_str, i, results_fmt(&stream->opts), &out, &result);
+        stream->stats_on = start_stats_thread(&stream->opts, stream->sock, out, result, &stream->stats_thread, &stream->stats_args);
+    }
+
+    // the sockets joined the group in stream order
+    if (opts->rx_queues > 0) {
+        int cpus[MAX_NUM_STREAMS];
+        for (int i = 0; i < num_streams; i++)   cpus[i] = opts->streams[i].cpu;
+
+        if (rtn_socket_attach_reuseport_cpu(streams[0].sock, cpus, num_streams) < 0) {
+            error("Failed to attach the steering program to the reuseport group\n");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < num_streams; i++) {
+        if (pthread_create(&streams[i].thread, NULL, stream_thread_fn, &streams[i]) != 0) {
+            error("Failed to create the thread of stream %d\n", i);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < num_streams; i++) {
+        rtn_stream *stream = &streams[i];
+        pthread_join(stream->thread, NULL);
+        if (stream->stats_on)   stop_stats_thread(stream->stats_thread, &stream->stats_args);
+
+        info("Stream %d: port=%d, cpu=%s, %d packets\n", i, stream->opts.port, stream->cpus, stream->pkt_count);
+        rtn_socket_destroy(stream->sock);
+    }
+
+    // latency of each stream, of each flow of a reuseport group and of all
+    // the streams together
+    if (opts->role_id == ROLE_RX) {
+        rtn_hist   *hists[MAX_NUM_STREAMS + RTN_STATS_MAX_FLOWS + 1];
+        const char *names[MAX_NUM_STREAMS + RTN_STATS_MAX_FLOWS + 1];
+        char        bufs[MAX_NUM_STREAMS + RTN_STATS_MAX_FLOWS][48];
+        int         count = 0;
+
+        rtn_hist *all = malloc(sizeof(rtn_hist));
+        if (all == NULL) {
+            error("Failed to allocate the latency histogram\n");
+            exit(1);
+        }
+
+        rtn_hist_init(all);
+        for (int i = 0; i < num_streams; i++) {
+            char stream[16];
+            options_stream_name(&streams[i].opts, stream, sizeof(stream));
+            snprintf(bufs[count], sizeof(bufs[count]), "latency_%s", stream);
+            hists[count] = streams[i].stats_args.latency;
+            names[count] = bufs[count];
+            rtn_hist_merge(all, hists[count]);
+            count += 1;
+        }
+
+        group_flow *flows = opts->rx_queues > 0 ? malloc(RTN_STATS_MAX_FLOWS * sizeof(group_flow)) : NULL;
+        if (opts->rx_queues > 0 && flows == NULL) {
+            error("Failed to allocate the flows of the group\n");
+            exit(1);
+        }
+
+        int num_flows = flows ? merge_flows(streams, num_streams, flows) : 0;
+        for (int i = 0; i < num_flows; i++) {
+            char flow[32];
+            rtn_socket_flow_str(flows[i].key, flow, sizeof(flow));
+
+            char queues[256];
+            int len = 0;
+            for (int q = 0; q < num_streams && len < (int)sizeof(queues); q++) {
+                if (flows[i].per_queue[q])  len += snprintf(queues + len, sizeof(queues) - len, " q%d=%ld", q, flows[i].per_queue[q]);
+            }
+            info("Flow %s: %ld packets,%s\n", flow, flows[i].num_packets, queues);
+
+            snprintf(bufs[count], sizeof(bufs[count]), "latency_%s", flow);
+            hists[count] = &flows[i].latency;
+            names[count] = bufs[count];
+            count += 1;
+        }
+
+        hists[count] = all;
+        names[count] = "latency";
+
+        report_latency(opts, hists, names, count + 1);
+        free(flows);
+        free(all);
+    }
+
+    if (opts->telemetry)    rtn_telemetry_stop(opts->telemetry);
+
+    for (int i = 0; i < num_streams; i++)   free_stats_thread(&streams[i].stats_args);
+    free(streams);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // # Main
@@ -51,7 +762,7 @@ main(int argc, char *argv[])
     ////////////////////////////////////////////////////////////////////////////
     // Initialization & Command Line Parsing
     int opt;
-    while ((opt = getopt(argc, argv, "p:P:r:i:d:o:s:c:n:C:l:vfha")) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:P:r:i:d:o:s:c:n:C:b:t:l:vfha", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'p': g_opts.sched_policy = optarg;        break;
             case 'P': g_opts.sched_prio   = atoi(optarg);  break;
@@ -63,6 +774,43 @@ main(int argc, char *argv[])
             case 'c': g_opts.cpus         = optarg;        break;
             case 'n': g_opts.num_packets  = atoll(optarg); break;
             case 'C': g_opts.cycle_time   = atoll(optarg); break;
+            case 'b': g_opts.burst_size   = atoi(optarg);  break;
+            case 't': g_opts.socket_type  = optarg;        break;
+            case OPT_XDP_QUEUE: g_opts.xdp_queue = atoi(optarg); break;
+            case OPT_XDP_MODE:  g_opts.xdp_mode  = optarg;       break;
+            case OPT_DST_MAC:   g_opts.dst_mac   = optarg;       break;
+            case OPT_ETHERTYPE: g_opts.ethertype = strtol(optarg, NULL, 0); break;
+            case OPT_VLAN:      g_opts.vlan_id   = atoi(optarg); break;
+            case OPT_PCP:       g_opts.vlan_pcp  = atoi(optarg); break;
+            case OPT_ENGINE:    g_opts.engine    = optarg;       break;
+            case OPT_SQPOLL:    g_opts.sqpoll    = true;         break;
+            case OPT_ASYNC:      g_opts.ping_async = true;          break;
+            case OPT_RX_TIMEOUT: g_opts.rx_timeout = atoll(optarg); break;
+            case OPT_TXTIME_LEAD: g_opts.txtime_lead = atoll(optarg); break;
+            case OPT_HIST_FILE:  g_opts.hist_file  = optarg;        break;
+            case OPT_FORMAT:     g_opts.format     = optarg;        break;
+            case OPT_TELEMETRY:  g_opts.telemetry_name = optarg;    break;
+            case OPT_TELEMETRY_INTERVAL: g_opts.telemetry_interval = atoll(optarg); break;
+            case OPT_OVERRUN:    g_opts.overrun    = optarg;        break;
+            case OPT_WAIT:       g_opts.wait       = optarg;        break;
+            case OPT_SPIN_MARGIN: g_opts.spin_margin = atoll(optarg); break;
+            case OPT_BUSY_POLL:  g_opts.busy_poll  = atoi(optarg);  break;
+            case OPT_CLOCK:      g_opts.clock_name = optarg;        break;
+            case OPT_PHC:        g_opts.use_phc    = true;          break;
+            case OPT_HUGEPAGES:  g_opts.hugepages  = true;          break;
+            case OPT_RX_QUEUES:  g_opts.rx_queues  = atoi(optarg);  break;
+            case OPT_CONTROL:    g_opts.control_port = atoi(optarg); break;
+            case OPT_STREAM: {
+                if (g_opts.num_streams == MAX_NUM_STREAMS) {
+                    fprintf(stderr, "Too many streams, the maximum is %d\n", MAX_NUM_STREAMS);
+                    exit(1);
+                }
+                if (stream_spec_parse(optarg, &g_opts.streams[g_opts.num_streams]) < 0) {
+                    fprintf(stderr, "Invalid stream: %s (port:cycle_time:packet_size:priority:cpu)\n", optarg);
+                    exit(1);
+                }
+                g_opts.num_streams += 1;
+            } break;
             case 'l': g_opts.log_level    = optarg;        break;
             case 'v': g_opts.verbose      = true;          break;
             case 'f': g_opts.save_file    = true;          break;
@@ -88,11 +836,6 @@ main(int argc, char *argv[])
 
     logger_set_level(log_level);
 
-    if (g_opts.num_packets > MAX_NUM_PACKETS) {
-        error("Number of packets exceeds the maximum limit: %d\n", MAX_NUM_PACKETS);
-        exit(1);
-    }
-    
     debug("Starting RT Network Application: %s\n", g_opts.role_name);
     g_opts.role_id = role_name_to_id(g_opts.role_name); 
     if (g_opts.role_id == -1) {
@@ -100,66 +843,268 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    if (g_opts.packet_size < (int)sizeof(payload_t)) {
+        error("Packet size must be >= %zu bytes (header of the payload)\n", sizeof(payload_t));
+        exit(1);
+    }
+
+    if (g_opts.burst_size < 1 || (g_opts.burst_size > 1 && g_opts.role_id != ROLE_TX && g_opts.role_id != ROLE_RX)) {
+        error("Burst size must be >= 1 and is only supported by the tx and rx roles\n");
+        exit(1);
+    }
+
+    bool use_uring = cstr_eq(g_opts.engine, "uring");
+    if (!use_uring && !cstr_eq(g_opts.engine, "socket")) {
+        error("Invalid engine: %s\n", g_opts.engine);
+        exit(1);
+    }
+
+    if (g_opts.sqpoll && !use_uring) {
+        error("SQPOLL is only available with the io_uring engine\n");
+        exit(1);
+    }
+
+    if (g_opts.ping_async && g_opts.role_id != ROLE_PING) {
+        error("Async mode is only for ping role\n");
+        exit(1);
+    }
+
+    if (g_opts.rx_timeout <= 0) {
+        error("Invalid receive timeout: %ld\n", g_opts.rx_timeout);
+        exit(1);
+    }
+
+    g_opts.overrun_policy = rtn_overrun_policy_from_str(g_opts.overrun);
+    if (g_opts.overrun_policy < 0) {
+        error("Invalid overrun policy: %s (catchup, skip)\n", g_opts.overrun);
+        exit(1);
+    }
+
+    g_opts.wait_mode = rtn_wait_mode_from_str(g_opts.wait);
+    if (g_opts.wait_mode < 0 || g_opts.spin_margin < 0) {
+        error("Invalid wait mode: %s (sleep, spin, hybrid) or spin margin: %ld\n", g_opts.wait, g_opts.spin_margin);
+        exit(1);
+    }
+
+    if (cstr_eq(g_opts.clock_name, "tsc")) {
+        g_opts.clock_type = CLOCK_TYPE_TSC;
+    } else if (!cstr_eq(g_opts.clock_name, "realtime")) {
+        error("Invalid clock: %s (realtime, tsc)\n", g_opts.clock_name);
+        exit(1);
+    }
+
+    if (g_opts.busy_poll < 0 || (g_opts.busy_poll > 0 && g_opts.role_id != ROLE_RX && g_opts.role_id != ROLE_PONG)) {
+        error("Busy poll time must be >= 0 and is only supported by the rx and pong roles\n");
+        exit(1);
+    }
+
+    if (g_opts.txtime_lead < 0 || (g_opts.txtime_lead > 0 && g_opts.role_id != ROLE_TX)) {
+        error("Launch time lead must be >= 0 and is only supported by the tx role\n");
+        exit(1);
+    }
+
+    if (g_opts.num_streams == 0 && g_opts.txtime_lead >= (i64)g_opts.cycle_time) {
+        error("Launch time lead (%ld) must be shorter than the cycle time (%ld)\n", g_opts.txtime_lead, g_opts.cycle_time);
+        exit(1);
+    }
+
+    if (g_opts.num_streams > 0) {
+        if (g_opts.role_id != ROLE_TX && g_opts.role_id != ROLE_RX) {
+            error("Multi-stream mode is only supported by the tx and rx roles\n");
+            exit(1);
+        }
+
+        // streams are told apart by their UDP port
+        if (!cstr_eq(g_opts.socket_type, "udp")) {
+            error("Multi-stream mode requires UDP sockets\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < g_opts.num_streams; i++) {
+            stream_spec_t *spec = &g_opts.streams[i];
+            if (g_opts.txtime_lead >= (i64)spec->cycle_time) {
+                error("Launch time lead (%ld) must be shorter than the cycle time of stream %d (%ld)\n", g_opts.txtime_lead, i, spec->cycle_time);
+                exit(1);
+            }
+
+            for (int j = 0; j < i; j++) {
+                if (g_opts.streams[j].port == spec->port) {
+                    error("Streams %d and %d use the same port %d\n", j, i, spec->port);
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    // reuseport group: one rx or pong stream per CPU of -c, on the same port
+    if (g_opts.rx_queues != 0) {
+        if (g_opts.rx_queues < 0 || g_opts.rx_queues > MAX_NUM_STREAMS) {
+            error("Invalid number of rx queues: %d (1 to %d)\n", g_opts.rx_queues, MAX_NUM_STREAMS);
+            exit(1);
+        }
+
+        if ((g_opts.role_id != ROLE_RX && g_opts.role_id != ROLE_PONG) || g_opts.num_streams > 0 || g_opts.rt_app_test) {
+            error("Reuseport groups are only supported by the rx and pong roles, without --stream\n");
+            exit(1);
+        }
+
+        if (!cstr_eq(g_opts.socket_type, "udp") || use_uring) {
+            error("Reuseport groups require UDP sockets and the socket engine\n");
+            exit(1);
+        }
+
+        char cpus_str[256];
+        snprintf(cpus_str, sizeof(cpus_str), "%s", g_opts.cpus);
+        int num_cpus = 0;
+        for (char *token = strtok(cpus_str, ","); token != NULL && num_cpus < g_opts.rx_queues; token = strtok(NULL, ",")) {
+            g_opts.streams[num_cpus++] = (stream_spec_t) {
+                .port        = g_opts.port,
+                .cycle_time  = g_opts.cycle_time,
+                .packet_size = g_opts.packet_size,
+                .sched_prio  = g_opts.sched_prio,
+                .cpu         = atoi(token),
+            };
+        }
+
+        if (num_cpus < g_opts.rx_queues) {
+            error("%d rx queues need as many CPUs in -c, one per receiver (%s)\n", g_opts.rx_queues, g_opts.cpus);
+            exit(1);
+        }
+
+        g_opts.num_streams = g_opts.rx_queues;
+    }
+
+    if (!cstr_eq(g_opts.format, "csv") && !cstr_eq(g_opts.format, "bin")) {
+        error("Invalid results format: %s\n", g_opts.format);
+        exit(1);
+    }
+
+    // binary results always go to a file
+    if (cstr_eq(g_opts.format, "bin"))  g_opts.save_file = true;
+
+    if (g_opts.telemetry_name && g_opts.telemetry_interval < NSEC_PER_MSEC) {
+        error("Invalid telemetry interval: %ld, it must be at least 1 ms\n", g_opts.telemetry_interval);
+        exit(1);
+    }
+
     if (g_opts.rt_app_test && g_opts.role_id != ROLE_PONG) {
         error("Realtime application test is only for pong role\n");
         exit(1);
     }
+
+    if (g_opts.control_port != 0) {
+        if (g_opts.control_port < 0 || g_opts.control_port > 65535) {
+            error("Invalid control port: %d\n", g_opts.control_port);
+            exit(1);
+        }
+
+        if ((g_opts.role_id != ROLE_TX && g_opts.role_id != ROLE_RX) || g_opts.num_streams > 0) {
+            error("The control channel is only supported by the tx and rx roles, without --stream or --rx-queues\n");
+            exit(1);
+        }
+
+        if (g_opts.role_id == ROLE_TX && g_opts.num_packets > RTN_CTRL_MAX_PACKETS) {
+            error("The control channel keeps the records in memory, at most %d packets\n", RTN_CTRL_MAX_PACKETS);
+            exit(1);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Control channel: the sender connects to the receiver, which takes the
+    // parameters of the test from it (see rtn_control.h)
+    if (g_opts.control_port > 0) {
+        if (g_opts.role_id == ROLE_TX)  g_opts.control = rtn_ctrl_connect(g_opts.dest_ip, g_opts.control_port);
+        else                            g_opts.control = rtn_ctrl_accept(g_opts.control_port);
+
+        rtn_ctrl_hello(g_opts.control, &g_opts);
+    }
     
     ////////////////////////////////////////////////////////////////////////////
-    // Lock memory
-    os_vm_lockall();
+    // Lock memory: the buffers of the RT loops are prefaulted when they are
+    // allocated, on huge pages with --hugepages
+    if (os_vm_lockall() < 0)    warn("Failed to lock the memory (mlockall): %s\n", strerror(errno));
+    os_vm_set_hugepages(g_opts.hugepages);
 
     ////////////////////////////////////////////////////////////////////////////
-    // Create the socket used for the tests
+    // Clocks: the TSC and the PHC are calibrated once here, then updated by
+    // a SCHED_OTHER thread. Without an invariant TSC the timestamps come from
+    // clock_gettime.
+    if (g_opts.clock_type == CLOCK_TYPE_TSC) {
+        if (os_tsc_calibrate() < 0) {
+            warn("No invariant TSC, using CLOCK_REALTIME\n");
+            g_opts.clock_type = CLOCK_TYPE_REALTIME;
+        } else {
+            info("TSC clock: %.3f MHz\n", (f64)((u64)1 << 32) * 1000.0 / os_tsc_get()->mult);
+        }
+    }
 
-    rtn_socket *sock = rtn_socket_new(g_opts.interface, g_opts.port, RTN_SOCK_TYPE_UDP);
-    if (sock == NULL) {
-        error("Failed to create rtn_socket\n");
+    if (g_opts.use_phc) {
+        int index = rtn_socket_phc_index(g_opts.interface);
+        if (index < 0) {
+            error("No PTP hardware clock on %s\n", g_opts.interface);
+            exit(1);
+        }
+
+        g_opts.phc = rtn_phc_open(index);
+        if (g_opts.phc == NULL || rtn_phc_update(g_opts.phc) < 0) {
+            error("Failed to read the PTP hardware clock /dev/ptp%d\n", index);
+            exit(1);
+        }
+
+        info("Hardware timestamps converted from /dev/ptp%d to CLOCK_REALTIME (%s)\n", index, s_rtn_phc_method_str[g_opts.phc->method]);
+    }
+
+    pthread_t clock_thread;
+    bool clock_thread_on = g_opts.clock_type == CLOCK_TYPE_TSC || g_opts.phc;
+    if (clock_thread_on && pthread_create(&clock_thread, NULL, clock_thread_fn, &g_opts) != 0) {
+        error("Failed to create the clock thread\n");
         exit(1);
     }
 
-    struct sockaddr_in dest_addr = {
-        .sin_family      = AF_INET,
-        .sin_port        = htons(g_opts.port),
-        .sin_addr.s_addr = inet_addr(g_opts.dest_ip),
-    };
-    rtn_socket_set_dest_addr(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    ////////////////////////////////////////////////////////////////////////////
+    // Telemetry: the publisher runs with SCHED_OTHER, the sources are added
+    // by the roles
+    if (g_opts.telemetry_name) {
+        g_opts.telemetry = rtn_telemetry_new(g_opts.telemetry_name, g_opts.telemetry_interval, &g_opts);
+        if (g_opts.telemetry == NULL || rtn_telemetry_start(g_opts.telemetry) < 0) {
+            error("Failed to start the telemetry\n");
+            exit(1);
+        }
 
-    rtn_socket_enable_timestamping(sock, g_opts.interface);
+        info("Publishing telemetry to /dev/shm%s every %ld ms\n", g_opts.telemetry->path, g_opts.telemetry_interval / NSEC_PER_MSEC);
+    }
 
     ////////////////////////////////////////////////////////////////////////////
-    // 
-
-    g_pkt_stats.stats = malloc(MAX_NUM_PACKETS * sizeof(rtn_pkt_stat));
-    if (g_pkt_stats.stats == NULL) {
-        error("Failed to allocate memory for packet stats\n");
-        exit(1);
+    // Multi-stream mode
+    os_faults faults = os_faults_get(RUSAGE_SELF);
+    if (g_opts.num_streams > 0) {
+        run_streams(&g_opts, use_uring);
+        os_faults_print(os_faults_since(faults, RUSAGE_SELF), "Process", stderr);
+        if (clock_thread_on)    stop_clock_thread(clock_thread);
+        if (g_opts.phc)         rtn_phc_report(g_opts.phc, stderr);
+        rtn_phc_close(g_opts.phc);
+        return 0;
     }
 
+    ////////////////////////////////////////////////////////////////////////////
+    // Create the socket used for the tests
+    rtn_socket *sock = open_socket(&g_opts, use_uring);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Results: the tx/rx records are streamed to the file during the test
 
 #define STAT_THREAD 1
 #if STAT_THREAD
     pthread_t stats_thread;
-    stats_thread_args stats_args = {
-        .num_packets   = g_opts.num_packets,
-        .sock          = sock,
-        .sem_start     = &g_opts.sem_stats_start,
-    };
-    if (g_opts.role_id == ROLE_TX) 
-    {
-        // Initialize the semaphore
-        os_sem_init(&g_opts.sem_stats_start, 0, 0);
-
-        // The stats thread will read from the error queue and gather statistics
-        // only for the talker role.
-        // FIXME: Can we make it more generic?   
-        if (pthread_create(&stats_thread, NULL, stats_thread_fn, &stats_args) != 0) {
-            error("Failed to create stats thread\n");
-            exit(1);
-        }
-
-        // set the thread priority low to avoid affecting the main thread
-        os_thread_set_priority(stats_thread, OS_SCHED_FIFO, 1);
+    stats_thread_args stats_args = {0};
+    bool stats_thread_on = false;
+    char *kernel_str     = NULL;
+    if (g_opts.role_id == ROLE_TX || g_opts.role_id == ROLE_RX) {
+        kernel_str = get_kernel_str(&g_opts);
+        FILE       *out;
+        rtn_result *result;
+        open_results(&g_opts, kernel_str, -1, results_fmt(&g_opts), &out, &result);
+        stats_thread_on  = start_stats_thread(&g_opts, sock, out, result, &stats_thread, &stats_args);
     }
 #endif
 
@@ -167,9 +1112,6 @@ main(int argc, char *argv[])
         // Set CPU affinity
         pthread_t self = os_thread_self();
 
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-
         int cpus[128]   = {0};
         usize ncpus     = 0;
         char *cpus_str  = g_opts.cpus;
@@ -187,119 +1129,61 @@ main(int argc, char *argv[])
         }
 
         // Set scheduling policy
-        os_sched_policy policy_id;
-        if      (cstr_eq(g_opts.sched_policy, "rr"))        policy_id = OS_SCHED_RR;
-        else if (cstr_eq(g_opts.sched_policy, "fifo"))      policy_id = OS_SCHED_FIFO;
-        else                                                policy_id = OS_SCHED_OTHER; 
-
+        os_sched_policy policy_id = sched_policy_name_to_id(g_opts.sched_policy);
         if (os_thread_set_priority(self, policy_id, g_opts.sched_prio) < 0) {
             error("Failed to set thread priority\n");
             exit(1);
         }
     }
 
+    os_stack_prefault();
+
+    // the receiver is listening, both sides agree on the first cycle
+    if (g_opts.control) {
+        if (g_opts.role_id == ROLE_TX)  g_opts.start_time = rtn_ctrl_start(g_opts.control);
+        else                            rtn_ctrl_ready(g_opts.control, g_opts.use_phc);
+    }
+
     int pkt_count = 0;
     switch (g_opts.role_id) {
-        case ROLE_TX:       pkt_count = do_tx(&g_opts, sock);   break;
-        case ROLE_RX:     pkt_count = do_rx(&g_opts, sock);   break;
-        case ROLE_PING:         pkt_count = do_ping(&g_opts, sock); break;
-        case ROLE_PONG:         pkt_count = do_pong(&g_opts, sock); break;
-        default:                error("Invalid role id: %d\n", g_opts.role_id); break;
+        case ROLE_TX:       pkt_count = do_tx(&g_opts, sock, stats_args.ring);   break;
+        case ROLE_RX:       pkt_count = do_rx(&g_opts, sock, stats_args.ring);   break;
+        case ROLE_PING:     pkt_count = do_ping(&g_opts, sock); break;
+        case ROLE_PONG:     pkt_count = do_pong(&g_opts, sock); break;
+        default:            error("Invalid role id: %d\n", g_opts.role_id); break;
     }
 
 #if STAT_THREAD
-    if (g_opts.role_id == ROLE_TX) {
-        while (!g_finished_to_gather_stats)     usleep(1000 * 10);
-        pthread_join(stats_thread, NULL);
-    }
-#endif
+    u64 num_dropped = 0;
+    if (stats_thread_on) {
+        num_dropped = __atomic_load_n(&stats_args.ring->num_dropped, __ATOMIC_RELAXED);
+        stop_stats_thread(stats_thread, &stats_args);
+        info("Saved %ld records (%d packets)\n", stats_args.num_written, pkt_count);
 
-    options_t *opts = &g_opts;
-
-    ////////////////////////////////////////////////////////////////////////////
-    // Write results to file
-    if (opts->role_id == ROLE_TX || opts->role_id == ROLE_RX) {
-        info("Saving results\n");
-
-        char *kernel_str = NULL;
-
-        {
-            // get the cmdline use to boot the kernel
-            char cmdline[1024] = {0};
-            FILE *file_cmdline = fopen("/proc/cmdline", "r");
-            if (file_cmdline) {
-                char *ret = fgets(cmdline, sizeof(cmdline), file_cmdline);
-                if (ret == NULL) {
-                    error("Failed to read /proc/cmdline\n");
-                    exit(1);
-                }
-                fclose(file_cmdline);   
-
-                // remove newline
-                cmdline[strcspn(cmdline, "\n")] = 0;
-            }
+        if (stats_args.latency) {
+            const char *name = "latency";
+            report_latency(&g_opts, &stats_args.latency, &name, 1);
+        }
+    }
 
-            char *rt  = strstr(opts->os_info.release, "rt");
-            char *pro = strstr(opts->os_info.release, "realtime");
-            if (rt || pro) {
-                info("Detected Realtime OS: %s %s (%s)\n", opts->os_info.sysname, opts->os_info.release, cmdline);
+    if (g_opts.control) {
+        rtn_ctrl_finish(g_opts.control, pkt_count, num_dropped);
+        if (g_opts.role_id == ROLE_TX)  save_e2e_results(&g_opts, kernel_str, pkt_count);
+        rtn_ctrl_destroy(g_opts.control);
+    }
+#endif
 
-                // check if boot cmdline contains `rcu_nocb` or `irqaffinity`
-                if (strstr(cmdline, "rcu_nocb") || strstr(cmdline, "irqaffinity")) {
-                    kernel_str = "rt-params";
-                } else {
-                    kernel_str = rt != NULL ? "rt" : "realtime";
-                }
+    if (g_opts.telemetry)   rtn_telemetry_stop(g_opts.telemetry);
+    if (clock_thread_on)    stop_clock_thread(clock_thread);
+    if (g_opts.phc)         rtn_phc_report(g_opts.phc, stderr);
+    os_faults_print(os_faults_since(faults, RUSAGE_SELF), "Process", stderr);
 
-            } else {
-                info("Detected Non-Realtime OS: %s %s (%s)\n", opts->os_info.sysname, opts->os_info.release, cmdline);
-                kernel_str = "linux";
-            }
-        }
-
-        char *output       = NULL;
-        FILE *file_results = NULL;
-        if (g_opts.save_file) {
-            char filename[128] = {0};
-            snprintf(filename, sizeof(filename), "%s_%ldus_%s.csv", opts->role_name, opts->cycle_time / 1000, kernel_str);
-            file_results = fopen(filename, "w");
-            output       = filename;
-        } else {
-            file_results = stdout;
-            output       = "STDOUT";
-        }
-
-        info("Writing results to %s\n", output);
-
-        fprintf(file_results,
-                "# cfg: P=%s, p=%d, r=%s, i=%s, d=%s, o=%d, s=%d, c=%s, n=%ld, C=%ld, v=%d\n\n",
-                opts->sched_policy, opts->sched_prio, opts->role_name, opts->interface, opts->dest_ip,
-                opts->port, opts->packet_size, opts->cpus, opts->num_packets, opts->cycle_time,
-                opts->verbose);
-
-        if (g_opts.role_id == ROLE_TX) {
-            fprintf(file_results, "id, tx_app, tx_sched, tx_sw, tx_hw\n");
-            for (int i = 0; i < pkt_count; ++i) {
-                rtn_pkt_stat *pstat = &g_pkt_stats.stats[i];
-                fprintf(file_results, 
-                        "%ld, %ld, %ld, %ld, %ld\n", 
-                        pstat->id, pstat->app_tstamps.tx_ts, pstat->tx_tstamps.sched_ts, 
-                        pstat->tx_tstamps.sw_ts, pstat->tx_tstamps.hw_ts);
-            }
-        } else {
-            fprintf(file_results, "id, rx_app, rx_sw, rx_hw\n");
-            for (int i = 0; i < pkt_count; i++) {
-                rtn_pkt_stat *stat = &g_pkt_stats.stats[i];
-                fprintf(file_results,
-                        "%ld, %ld, %ld, %ld\n", 
-                        stat->id, stat->app_tstamps.rx_ts, stat->rx_tstamps.sw_ts, stat->rx_tstamps.hw_ts);
-            }
-        }
+#if STAT_THREAD
+    if (stats_thread_on)    free_stats_thread(&stats_args);
+#endif
 
-        fclose(file_results);
-    }
-    
     rtn_socket_destroy(sock);
+    rtn_phc_close(g_opts.phc);
 
     return 0;
 }
@@ -5,7 +5,7 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 // # Constants
-#define MAX_NUM_PACKETS 10000000
+#define MAX_NUM_STREAMS 16
 
 ////////////////////////////////////////////////////////////////////////////////
 typedef enum {
@@ -32,6 +32,48 @@ role_name_to_id(const char *role)
     return -1;
 }
 
+static inline int
+sched_policy_name_to_id(const char *policy)
+{
+    if      (cstr_eq(policy, "rr"))     return OS_SCHED_RR;
+    else if (cstr_eq(policy, "fifo"))   return OS_SCHED_FIFO;
+    else                                return OS_SCHED_OTHER;
+}
+
+// A periodic stream of the multi-stream mode: `port:cycle_time:packet_size:priority:cpu`
+typedef struct stream_spec stream_spec_t;
+struct stream_spec {
+    int      port;
+    u64      cycle_time;        // in nanoseconds
+    int      packet_size;       // in bytes
+    int      sched_prio;
+    int      cpu;
+};
+
+static inline int
+stream_spec_parse(const char *str, stream_spec_t *spec)
+{
+    i64 fields[5];
+    const char *p = str;
+    for (int i = 0; i < 5; i++) {
+        char *end;
+        fields[i] = strtoll(p, &end, 0);
+        if (end == p || fields[i] < 0)                  return -1;
+        if (i < 4 && *end != ':')                       return -1;
+        if (i == 4 && *end != '\0')                     return -1;
+        p = end + 1;
+    }
+
+    spec->port        = fields[0];
+    spec->cycle_time  = fields[1];
+    spec->packet_size = fields[2];
+    spec->sched_prio  = fields[3];
+    spec->cpu         = fields[4];
+
+    if (spec->port == 0 || spec->port > 65535 || spec->cycle_time == 0 || spec->packet_size == 0)  return -1;
+    return 0;
+}
+
 typedef struct options options_t;
 struct options {
     // Scheduling
@@ -47,14 +89,46 @@ struct options {
     char    *interface;
     int      port;
     char    *dest_ip;
+    char    *socket_type;       // udp, raw, mmap, xdp
+    char    *engine;            // socket, uring
+    bool     sqpoll;            // io_uring engine: kernel thread polls the submissions
+    int      xdp_queue;         // NIC queue the XDP socket is bound to
+    char    *xdp_mode;          // generic, native, zerocopy
+    char    *dst_mac;           // destination MAC for raw and kernel-bypass sockets
+    int      ethertype;         // raw sockets
+    int      vlan_id;           // raw sockets, -1 for untagged frames
+    int      vlan_pcp;          // raw sockets, 802.1Q priority code point
+    int      control_port;      // tx, rx: TCP port of the control channel, 0 when off (see rtn_control.h)
+    struct rtn_ctrl *control;   // the control channel, NULL when off
+
+    // Multi-stream mode: one thread and one socket per stream
+    stream_spec_t streams[MAX_NUM_STREAMS];
+    int      num_streams;
+    int      rx_queues;         // rx, pong: receivers of the reuseport group (one stream per CPU of -c), 0 when off
+    int      rx_queue;          // index of the receiver in the group
+    bool    *rx_group_stop;     // rx: end of the test, shared by the receivers of the group (see rx_idle)
 
     // Timing
     u64      cycle_time;        // cycle time in nanoseconds
-    int      clock_type;        // CLOCK_TYPE_REALTIME or CLOCK_TYPE_MONOTONIC
+    i64      start_time;        // tx: first wakeup (CLOCK_REALTIME), 0 for 2s after start aligned to the second
+    char    *clock_name;        // realtime, tsc
+    int      clock_type;        // CLOCK_TYPE_REALTIME, CLOCK_TYPE_TSC, or CLOCK_TYPE_MONOTONIC (pong app test)
+    i64      rx_timeout;        // ping: how long to wait for a reply, in nanoseconds
+    i64      txtime_lead;       // tx: wake up this early and let the qdisc send at the deadline (SO_TXTIME), 0 to disable
+    char    *overrun;           // tx, ping: a cycle starts late, catchup or skip (see rtn_cycle.h)
+    int      overrun_policy;    // rtn_overrun_policy
+    char    *wait;              // tx, ping: how to wait for a cycle, sleep, spin or hybrid
+    int      wait_mode;         // rtn_wait_mode
+    i64      spin_margin;       // hybrid wait: spin for the last `spin_margin` ns
+    int      busy_poll;         // rx, pong: SO_BUSY_POLL time in microseconds, 0 to disable
+    bool     use_phc;           // convert the hardware timestamps to CLOCK_REALTIME (see rtn_phc.h)
+    struct rtn_phc *phc;        // PHC of the interface, NULL when off
+    bool     hugepages;         // back the buffers of the RT loops with huge pages (see os_vm_alloc)
 
     // Packet Generation
     int      packet_size;       // in bytes
 	u64      num_packets;       // number of frames
+    int      burst_size;        // packets sent per cycle with a single sendmmsg
 
     // OS Info
     struct utsname  os_info;
@@ -63,10 +137,38 @@ struct options {
     char    *log_level;
     bool     verbose;
     bool     save_file;
+    char    *format;        // results file: csv, bin (see rtn_result.h)
+    char    *hist_file;     // export the latency histograms (CSV) to this file
     bool     rt_app_test;   // only for pong 
+    bool     ping_async;    // only for ping: receive the replies on a separate thread
+
+    // Telemetry: live stats in the shared memory segment /rtn-<name>
+    char    *telemetry_name;            // NULL when off
+    i64      telemetry_interval;        // ns
+    struct rtn_telemetry *telemetry;
 
     // Temporary
     os_sem   sem_stats_start;
 };
 
+// Name of a stream in the reports and the results files: its port in
+// multi-stream mode, its index in a reuseport group.
+static inline void
+options_stream_name(const options_t *opts, char *buf, usize size)
+{
+    if (opts->rx_queues > 0)    snprintf(buf, size, "q%d", opts->rx_queue);
+    else                        snprintf(buf, size, "p%d", opts->port);
+}
+
+// The options of the test, saved with its results.
+static inline int
+options_to_str(const options_t *opts, char *buf, usize len)
+{
+    return snprintf(buf, len, 
+                    "P=%s, p=%d, r=%s, i=%s, d=%s, o=%d, s=%d, c=%s, n=%ld, C=%ld, b=%d, e=%s, L=%ld, v=%d",
+                    opts->sched_policy, opts->sched_prio, opts->role_name, opts->interface, opts->dest_ip,
+                    opts->port, opts->packet_size, opts->cpus, opts->num_packets, opts->cycle_time,
+                    opts->burst_size, opts->engine, opts->txtime_lead, opts->verbose);
+}
+
 #endif // RTN_OPTIONS_H
\ No newline at end of file
@@ -3,19 +3,14 @@
 
 #include "rtn_base.h"
 
+// The end of the test is not in the stream, see rtn_control.h. The value 2
+// was the end packet and is not reused.
 typedef enum {
     PAYLOAD_TYPE_UNKNOWN = 0,
     PAYLOAD_TYPE_DATA    = 1,
-    PAYLOAD_TYPE_END     = 2,
     PAYLOAD_TYPE_IGNORE  = 3,
 } payload_type_t;
 
-// static char *g_payload_type_names[] = {
-//     "UNKNOWN",
-//     "DATA",
-//     "END",
-// };
-
 typedef struct payload payload_t;
 struct payload 
 {
@@ -24,6 +19,73 @@ struct payload
     i64     cycle;
     i64     jitter;
     u8      type;
+
+    // pong: the turnaround of an earlier reply, from its kernel RX to its
+    // kernel TX timestamp, only known once that reply was sent
+    u64     peer_seqno;
+    i64     peer_turnaround;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// # Packet Pool
+//
+// The packet buffers of the RT loops are allocated once: page aligned, locked
+// and prefaulted (os_vm_alloc), each packet is preformatted from a template
+// header and zero padded. A cycle only patches the fields that change (seqno,
+// timestamp, type), the rest of the packet is never written again, so no
+// memset of `packet_size` bytes runs in the timed window.
+
+#define RTN_PKT_ALIGN   64
+
+typedef struct rtn_pkt_pool rtn_pkt_pool;
+struct rtn_pkt_pool
+{
+    u8     *mem;
+    usize   len;            // bytes used, os_vm_alloc rounds up to whole pages
+    usize   stride;         // distance between two packets, cache line aligned
+    usize   count;
+    usize   packet_size;
+};
+
+// `tmpl` is copied at the start of every packet, NULL for zeroed packets.
+static rtn_pkt_pool *
+rtn_pkt_pool_new(usize count, usize packet_size, const payload_t *tmpl)
+{
+    rtn_pkt_pool *pool = calloc(1, sizeof(rtn_pkt_pool));
+    if (pool == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    pool->count       = count;
+    pool->packet_size = packet_size;
+    pool->stride      = (packet_size + RTN_PKT_ALIGN - 1) & ~(usize)(RTN_PKT_ALIGN - 1);
+    pool->len         = count * pool->stride;
+
+    pool->mem = os_vm_alloc(pool->len);
+    if (pool->mem == NULL) {
+        perror("mmap");
+        free(pool);
+        return NULL;
+    }
+
+    if (tmpl) {
+        for (usize i = 0; i < count; i++)   memcpy(pool->mem + i * pool->stride, tmpl, sizeof(payload_t));
+    }
+
+    return pool;
+}
+
+static void
+rtn_pkt_pool_destroy(rtn_pkt_pool *pool)
+{
+    if (pool == NULL)   return;
+
+    os_vm_free(pool->mem, pool->len);
+    free(pool);
+}
+
+static inline u8        *rtn_pkt_pool_get     (rtn_pkt_pool *pool, usize i) { return pool->mem + i * pool->stride; }
+static inline payload_t *rtn_pkt_pool_payload (rtn_pkt_pool *pool, usize i) { return (payload_t *)rtn_pkt_pool_get(pool, i); }
+
 #endif  // RTN_PACKET_H
\ No newline at end of file
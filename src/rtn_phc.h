@@ -0,0 +1,228 @@
+#ifndef RTN_PHC_H
+#define RTN_PHC_H
+
+#include "rtn_base.h"
+
+#include <linux/ptp_clock.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// # PHC Clock Domain
+//
+// The hardware timestamps (tx_hw, rx_hw) are taken by the NIC with its PTP
+// hardware clock (/dev/ptpN), the other timestamps with CLOCK_REALTIME. Unless
+// phc2sys keeps both in sync (and even then the PHC is usually TAI), the
+// differences between the two domains are meaningless.
+//
+// The PHC is sampled against CLOCK_REALTIME about every second, with the most
+// accurate method of the driver:
+// - precise:  PTP_SYS_OFFSET_PRECISE, cross timestamp taken by the hardware
+//             (PCIe PTM, ART), no read delay.
+// - extended: PTP_SYS_OFFSET_EXTENDED, the system clock is read just before
+//             and after the PHC register, the shortest of a few reads is used.
+// - basic:    PTP_SYS_OFFSET, the same with the whole ioctl in the window.
+//
+// The last two samples give an offset/drift model, the hardware timestamps are
+// converted to CLOCK_REALTIME when the records are exported:
+//
+//     rt_ns = phc_ns + offset + (phc_ns - base_phc) * drift >> 32
+//
+// The model is published with a sequence counter, as the TSC calibration.
+
+#define RTN_PHC_SAMPLES     9
+
+typedef enum
+{
+    RTN_PHC_PRECISE,
+    RTN_PHC_EXTENDED,
+    RTN_PHC_BASIC,
+} rtn_phc_method;
+
+static const char *s_rtn_phc_method_str[] = {
+    [RTN_PHC_PRECISE]  = "precise",
+    [RTN_PHC_EXTENDED] = "extended",
+    [RTN_PHC_BASIC]    = "basic",
+};
+
+typedef struct rtn_phc rtn_phc;
+struct rtn_phc
+{
+    int             fd;
+    int             index;
+    rtn_phc_method  method;
+
+    // model, written by rtn_phc_update only
+    u32             seq;            // odd while the model is updated
+    i64             base_phc;       // PHC time of the last sample
+    i64             offset;         // CLOCK_REALTIME - PHC at base_phc
+    i64             drift;          // (d rt - d phc) / d phc, 32.32 fixed point
+
+    // statistics of the samples
+    u64             num_samples;
+    i64             last_delay;     // width of the read window of the last sample, 0 for precise
+    i64             max_delay;
+};
+
+static inline i64 rtn_phc_ts_ns(const struct ptp_clock_time *t) { return t->sec * NSEC_PER_SEC + t->nsec; }
+
+static rtn_phc *
+rtn_phc_open(int index)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/ptp%d", index);
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    rtn_phc *phc = calloc(1, sizeof(rtn_phc));
+    if (phc == NULL) {
+        perror("calloc(phc)");
+        close(fd);
+        return NULL;
+    }
+
+    phc->fd      = fd;
+    phc->index   = index;
+    phc->method  = RTN_PHC_PRECISE;
+    return phc;
+}
+
+static void
+rtn_phc_close(rtn_phc *phc)
+{
+    if (phc == NULL)    return;
+
+    close(phc->fd);
+    free(phc);
+}
+
+// One (PHC, CLOCK_REALTIME) pair, the method falls back to the next one when
+// the driver does not support it.
+static int
+rtn_phc_sample(rtn_phc *phc, i64 *out_phc, i64 *out_rt, i64 *out_delay)
+{
+    if (phc->method == RTN_PHC_PRECISE) {
+        struct ptp_sys_offset_precise req;
+        memset(&req, 0, sizeof(req));
+        if (ioctl(phc->fd, PTP_SYS_OFFSET_PRECISE, &req) == 0) {
+            *out_phc   = rtn_phc_ts_ns(&req.device);
+            *out_rt    = rtn_phc_ts_ns(&req.sys_realtime);
+            *out_delay = 0;
+            return 0;
+        }
+
+        phc->method = RTN_PHC_EXTENDED;
+    }
+
+    if (phc->method == RTN_PHC_EXTENDED) {
+        struct ptp_sys_offset_extended *req = calloc(1, sizeof(*req));
+        if (req == NULL) {
+            perror("calloc(ptp_sys_offset_extended)");
+            return -1;
+        }
+
+        req->n_samples = RTN_PHC_SAMPLES;
+
+        int res = ioctl(phc->fd, PTP_SYS_OFFSET_EXTENDED, req);
+        if (res == 0) {
+            *out_delay = INT64_MAX;
+            for (uint i = 0; i < req->n_samples; i++) {
+                i64 pre   = rtn_phc_ts_ns(&req->ts[i][0]);
+                i64 post  = rtn_phc_ts_ns(&req->ts[i][2]);
+                if (post - pre >= *out_delay)   continue;
+
+                *out_phc   = rtn_phc_ts_ns(&req->ts[i][1]);
+                *out_rt    = pre + (post - pre) / 2;
+                *out_delay = post - pre;
+            }
+        }
+
+        free(req);
+        if (res == 0)   return 0;
+
+        phc->method = RTN_PHC_BASIC;
+    }
+
+    // [sys, phc, sys, phc, ..., sys]
+    struct ptp_sys_offset req;
+    memset(&req, 0, sizeof(req));
+    req.n_samples = RTN_PHC_SAMPLES;
+    if (ioctl(phc->fd, PTP_SYS_OFFSET, &req) < 0) {
+        perror("ioctl(PTP_SYS_OFFSET)");
+        return -1;
+    }
+
+    *out_delay = INT64_MAX;
+    for (uint i = 0; i < req.n_samples; i++) {
+        i64 pre   = rtn_phc_ts_ns(&req.ts[2 * i]);
+        i64 post  = rtn_phc_ts_ns(&req.ts[2 * i + 2]);
+        if (post - pre >= *out_delay)   continue;
+
+        *out_phc   = rtn_phc_ts_ns(&req.ts[2 * i + 1]);
+        *out_rt    = pre + (post - pre) / 2;
+        *out_delay = post - pre;
+    }
+
+    return 0;
+}
+
+// Take a sample and move the model to it, the drift is measured since the
+// previous sample.
+static int
+rtn_phc_update(rtn_phc *phc)
+{
+    i64 phc_ns, rt_ns, delay;
+    if (rtn_phc_sample(phc, &phc_ns, &rt_ns, &delay) < 0)    return -1;
+
+    i64 drift = phc->drift;
+    if (phc->num_samples > 0 && phc_ns > phc->base_phc) {
+        // the offset moved by `err` in `d_phc`
+        i64 d_phc = phc_ns - phc->base_phc;
+        i64 err   = rt_ns - phc_ns - phc->offset;
+        drift     = (i64)(((i128)err << 32) / d_phc);
+    }
+
+    __atomic_store_n(&phc->seq, phc->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&phc->base_phc, phc_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&phc->offset, rt_ns - phc_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&phc->drift, drift, __ATOMIC_RELAXED);
+    __atomic_store_n(&phc->seq, phc->seq + 1, __ATOMIC_RELEASE);
+
+    phc->num_samples += 1;
+    phc->last_delay   = delay;
+    if (delay > phc->max_delay)     phc->max_delay = delay;
+
+    return 0;
+}
+
+// A PHC timestamp in CLOCK_REALTIME, 0 (not available) is kept.
+static inline i64
+rtn_phc_to_rt_ns(rtn_phc *phc, i64 phc_ns)
+{
+    if (phc_ns == 0)    return 0;
+
+    u32 seq;
+    i64 base_phc, offset, drift;
+    do {
+        seq      = __atomic_load_n(&phc->seq, __ATOMIC_ACQUIRE);
+        base_phc = __atomic_load_n(&phc->base_phc, __ATOMIC_RELAXED);
+        offset   = __atomic_load_n(&phc->offset, __ATOMIC_RELAXED);
+        drift    = __atomic_load_n(&phc->drift, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&phc->seq, __ATOMIC_RELAXED));
+
+    return phc_ns + offset + (i64)(((i128)(phc_ns - base_phc) * drift) >> 32);
+}
+
+static void
+rtn_phc_report(const rtn_phc *phc, FILE *file)
+{
+    fprintf(file, "PHC /dev/ptp%d (%s): offset=%ld ns, drift=%.3f ppm, samples=%ld, read delay last=%ld max=%ld ns\n",
+            phc->index, s_rtn_phc_method_str[phc->method], phc->offset, phc->drift * 1e6 / 4294967296.0,
+            phc->num_samples, phc->last_delay, phc->max_delay);
+}
+
+#endif // RTN_PHC_H
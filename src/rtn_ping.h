@@ -3,10 +3,15 @@
 
 #include "rtn_base.h"
 
+#include "rtn_cycle.h"
+#include "rtn_hist.h"
 #include "rtn_socket.h"
 #include "rtn_packet.h"
+#include "rtn_phc.h"
+#include "rtn_result.h"
 #include "rtn_stats.h"
 #include "rtn_options.h"
+#include "rtn_telemetry.h"
 
 #define MAX_PKT_TEST    2000000
 #define MAX_NUM_TESTS   20
@@ -26,10 +31,252 @@ struct rt_app_stats_array
     usize           count;
 };
 
-static rt_app_stats_array_t s_rt_app_stats[MAX_NUM_TESTS];
-static int s_num_tests = -1;
+// Receive times of the tests of a tx talker (pong -a), one array per test.
+typedef struct rt_app_test rt_app_test_t;
+struct rt_app_test
+{
+    rt_app_stats_array_t    tests[MAX_NUM_TESTS];
+    rtn_hist                hist[MAX_NUM_TESTS];    // receive interval of each test
+    int                     num_tests;              // current test, -1 before the first
+};
+
 static bool s_pong_stop  = false;
 
+// Save the receive times of test `test` to rt_app_test_<test>.csv or .bin,
+// the binary file has the id, rx_app and jitter columns.
+static void
+rt_app_test_save(options_t *opts, rt_app_test_t *app, int test)
+{
+    rt_app_stats_array_t *array = &app->tests[test];
+    bool bin = cstr_eq(opts->format, "bin");
+
+    char filename[128] = {0};
+    snprintf(filename, sizeof(filename), "rt_app_test_%d.%s", test, bin ? "bin" : "csv");
+    info("Writing results to %s (%d/%d)\n", filename, test+1, app->num_tests+1);
+
+    if (bin) {
+        static const u32 columns[] = { RTN_COL_ID, RTN_COL_RX_APP, RTN_COL_JITTER };
+        rtn_result *result = rtn_result_new(filename, columns, array_size(columns));
+        if (result == NULL) {
+            perror("rtn_result_new");
+            exit(1);
+        }
+
+        result->hdr->role_id = opts->role_id;
+        snprintf(result->hdr->clock, sizeof(result->hdr->clock), "CLOCK_MONOTONIC");
+        snprintf(result->hdr->kernel, sizeof(result->hdr->kernel), "%s %s", opts->os_info.sysname, opts->os_info.release);
+        options_to_str(opts, result->hdr->cfg, sizeof(result->hdr->cfg));
+
+        for (usize j = 0; j < array->count; j++) {
+            rt_app_stats_t *stat = &array->stats[j];
+            i64 values[]         = { stat->id, stat->rx_tstamp, stat->jitter };
+            if (rtn_result_append(result, values) < 0) {
+                error("Failed to write %s\n", filename);
+                exit(1);
+            }
+        }
+
+        rtn_result_close(result);
+        return;
+    }
+
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+
+    fprintf(file, "id,rx_tstamp,jitter\n");
+    for (usize j = 0; j < array->count; j++) {
+        rt_app_stats_t *stat = &array->stats[j];
+        fprintf(file, "%ld,%ld,%ld\n", stat->id, stat->rx_tstamp, stat->jitter);
+    }
+
+    fclose(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Pong
+//
+// Pong is a reflector: every probe goes back to its source address, so a
+// single pong serves any number of pingers. The state of each peer (source
+// address and port) lives in a hash table preallocated for PONG_MAX_PEERS
+// peers: the arrival jitter echoed in the reply, the lost and reordered
+// probes and the turnaround of its last reply. The thread sleeps in epoll and
+// drains the socket at every wakeup. With --rx-queues several pong threads
+// share the port, each with its own table (a peer always lands on the same
+// one).
+//
+// The source is only known with UDP sockets and the socket engine, otherwise
+// the replies go to -d and all the probes count as a single peer.
+//
+// The kernel TX timestamp of a reply only comes back from the error queue once
+// the reply is sent: the RX timestamps of the probes are kept in a ring indexed
+// by the number of the reply (SOF_TIMESTAMPING_OPT_ID), and the turnaround of
+// a reply (kernel RX to kernel TX, the time spent in the stack and the
+// application of the peer) is sent with the next reply to the same peer.
+#define PONG_TS_RING        1024                    // replies whose TX timestamp may still be queued
+#define PONG_MAX_PEERS      256                     // peers with their own state, the others are only echoed
+#define PONG_PEER_SLOTS     (2 * PONG_MAX_PEERS)    // hash table, at most half full
+#define PONG_POLL_TIMEOUT   100                     // ms, the stop flag is checked at least this often
+
+typedef struct pong_ts pong_ts;
+struct pong_ts
+{
+    u32 id;                     // number of the reply
+    u32 peer;                   // index + 1 in the peer table, 0 when not tracked
+    u64 seqno;
+    i64 rx_sw;
+    i64 rx_hw;
+};
+
+typedef struct pong_peer pong_peer;
+struct pong_peer
+{
+    u64                     key;            // rtn_socket_flow_key of the source
+    struct sockaddr_storage addr;
+
+    u64     num_probes;
+    u64     num_lost;           // skipped sequence numbers
+    u64     num_reordered;      // older than the newest probe: late or duplicated
+    u64     next_seqno;
+    i64     last_recv_time;
+    i64     max_jitter;         // |interval - cycle| of consecutive probes
+    f64     sum_jitter;
+    u64     num_jitter;
+
+    // newest reply with a TX timestamp, echoed in the next reply
+    u64     peer_seqno;
+    i64     peer_turnaround;
+};
+
+typedef struct pong_peers pong_peers;
+struct pong_peers
+{
+    pong_peer  *peers;          // in order of arrival
+    u32        *slots;          // index + 1 in `peers`, 0 when free
+    u32         num_peers;
+    u64         num_overflow;   // probes of the peers past PONG_MAX_PEERS
+};
+
+static int
+pong_peers_init(pong_peers *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->peers = os_vm_alloc(PONG_MAX_PEERS * sizeof(pong_peer));
+    t->slots = os_vm_alloc(PONG_PEER_SLOTS * sizeof(u32));
+    return t->peers && t->slots ? 0 : -1;
+}
+
+static void
+pong_peers_free(pong_peers *t)
+{
+    os_vm_free(t->peers, PONG_MAX_PEERS * sizeof(pong_peer));
+    os_vm_free(t->slots, PONG_PEER_SLOTS * sizeof(u32));
+}
+
+static inline u32 pong_peer_hash (u64 key) { return (u32)((key * 0x9e3779b97f4a7c15ull) >> 32) & (PONG_PEER_SLOTS - 1); }
+
+// The peer of a source, added at its first probe (linear probing). NULL when
+// the table is full.
+static pong_peer *
+pong_peers_get(pong_peers *t, const struct sockaddr_storage *addr)
+{
+    u64 key = rtn_socket_flow_key(addr);
+    for (u32 i = pong_peer_hash(key);; i = (i + 1) & (PONG_PEER_SLOTS - 1)) {
+        u32 slot = t->slots[i];
+        if (slot != 0) {
+            if (t->peers[slot - 1].key == key)  return &t->peers[slot - 1];
+            continue;
+        }
+
+        if (t->num_peers == PONG_MAX_PEERS) {
+            t->num_overflow += 1;
+            return NULL;
+        }
+
+        pong_peer *peer = &t->peers[t->num_peers];
+        peer->key       = key;
+        peer->addr      = *addr;
+        t->slots[i]     = ++t->num_peers;
+        return peer;
+    }
+}
+
+// Account a probe of the peer, returns the arrival jitter for the reply. A
+// new test of the same peer starts again at seqno 0 (tx) or 1 (ping).
+static i64
+pong_peer_update(pong_peer *peer, u64 seqno, i64 cycle_time, i64 now)
+{
+    if (peer->num_probes > 0 && seqno < peer->next_seqno && seqno <= 1) {
+        peer->next_seqno     = seqno;
+        peer->last_recv_time = 0;
+    }
+
+    if (peer->num_probes > 0 && seqno < peer->next_seqno)   peer->num_reordered += 1;
+    else if (peer->num_probes > 0)                          peer->num_lost      += seqno - peer->next_seqno;
+    if (seqno >= peer->next_seqno)  peer->next_seqno = seqno + 1;
+
+    i64 jitter = 0;
+    if (peer->last_recv_time) {
+        jitter = now - peer->last_recv_time - cycle_time;
+
+        i64 abs_jitter    = jitter < 0 ? -jitter : jitter;
+        peer->sum_jitter += abs_jitter;
+        peer->num_jitter += 1;
+        if (abs_jitter > peer->max_jitter)  peer->max_jitter = abs_jitter;
+    }
+
+    peer->num_probes     += 1;
+    peer->last_recv_time  = now;
+    return jitter;
+}
+
+static void
+pong_peers_report(const pong_peers *t, const char *name, FILE *file)
+{
+    fprintf(file, "%s: %u peers", name, t->num_peers);
+    if (t->num_overflow)    fprintf(file, ", %ld probes of the peers past the first %d not tracked", t->num_overflow, PONG_MAX_PEERS);
+    fprintf(file, "\n");
+
+    for (u32 i = 0; i < t->num_peers; i++) {
+        const pong_peer *peer = &t->peers[i];
+
+        char addr[32];
+        rtn_socket_flow_str(peer->key, addr, sizeof(addr));
+        fprintf(file, "  %s: probes=%ld, lost=%ld, reordered=%ld, jitter mean=%ld max=%ld ns\n", addr, peer->num_probes,
+                peer->num_lost, peer->num_reordered, peer->num_jitter ? (i64)(peer->sum_jitter / peer->num_jitter) : 0,
+                peer->max_jitter);
+    }
+}
+
+// Read the TX timestamps of the replies already sent, the turnaround of the
+// newest one of a peer goes in its next reply. The hardware timestamps are
+// used when the probe has one too. Without a ring the timestamps are only
+// drained.
+static void
+pong_read_tx_tstamps(rtn_socket *sock, const pong_ts *ring, pong_peers *peers)
+{
+    for (;;) {
+        uint ts_id         = 0;
+        rtn_pkt_stat pstat = {0};
+        int type = stats_read_tx_tstamp(sock, &ts_id, &pstat);
+        if (type < 0)   break;
+
+        const pong_ts *ts = ring ? &ring[ts_id % PONG_TS_RING] : NULL;
+        if (ts == NULL || ts->id != ts_id || ts->peer == 0)     continue;
+
+        pong_peer *peer = &peers->peers[ts->peer - 1];
+        if (type == RTN_PKT_TS_TYPE_TX_HW && ts->rx_hw && pstat.tx_tstamps.hw_ts) {
+            peer->peer_seqno      = ts->seqno;
+            peer->peer_turnaround = pstat.tx_tstamps.hw_ts - ts->rx_hw;
+        } else if (type == RTN_PKT_TS_TYPE_TX_SW && ts->rx_sw) {
+            peer->peer_seqno      = ts->seqno;
+            peer->peer_turnaround = pstat.tx_tstamps.sw_ts - ts->rx_sw;
+        }
+    }
+}
+
 void 
 sigint_handler(int signo)
 {
@@ -37,33 +284,156 @@ sigint_handler(int signo)
     s_pong_stop = true;
 }
 
+// Wait for probes: epoll on the socket, the completions with the io_uring
+// engine. 0 on timeout.
+static int
+pong_wait(rtn_socket *sock, int epfd)
+{
+    if (sock->uring)    return rtn_socket_poll(sock, PONG_POLL_TIMEOUT * NSEC_PER_MSEC);
+
+    struct epoll_event ev;
+    return epoll_wait(epfd, &ev, 1, PONG_POLL_TIMEOUT);
+}
+
+static int do_rt_app_test(options_t *opts, rtn_socket *sock);
+
 static int
 do_pong(options_t *opts, rtn_socket *sock)
 {
-    u8 *packet = malloc(opts->packet_size);
+    signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigint_handler);
+
+    if (opts->rt_app_test)  return do_rt_app_test(opts, sock);
+
+    // the reply is built in the receive buffer, only its header is patched
+    rtn_pkt_pool *pool = rtn_pkt_pool_new(1, opts->packet_size, NULL);
+    pong_ts *ts_ring   = os_vm_alloc(PONG_TS_RING * sizeof(pong_ts));
+    pong_peers peers;
+    if (pool == NULL || ts_ring == NULL || pong_peers_init(&peers) < 0) {
+        error("Failed to allocate the packet buffer and the peer table\n");
+        exit(1);
+    }
+
+    u8 *packet = rtn_pkt_pool_get(pool, 0);
+
+    int epfd = epoll_create1(0);
+    struct epoll_event ev = { .events = EPOLLIN };
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sock->fd, &ev) < 0) {
+        perror("epoll");
+        exit(1);
+    }
+
+    char name[32], stream[16];
+    options_stream_name(opts, stream, sizeof(stream));
+    if (opts->num_streams > 0)  snprintf(name, sizeof(name), "Pong %s", stream);
+    else                        snprintf(name, sizeof(name), "Pong");
+
+    rtn_tm_source *tm = rtn_telemetry_add(opts->telemetry, "pong", NULL, NULL);
+
+    bool timestamps  = rtn_socket_has_timestamps(sock);
+    bool tsc         = opts->clock_type == CLOCK_TYPE_TSC;
+    u32 num_sent     = 0;
+    os_faults faults = os_faults_get(RUSAGE_THREAD);
+    while (!s_pong_stop) {
+        int res = pong_wait(sock, epfd);
+        if (res < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        if (res <= 0)   continue;
+
+        // the probes of all the peers queued so far
+        for (;;) {
+            rtn_pkt_stat rx = {0};
+            struct sockaddr_storage src;
+            int ret = rtn_socket_receive_from(sock, packet, opts->packet_size, timestamps ? &rx : NULL, MSG_DONTWAIT, &src);
+            if (ret == -1) {
+                if (errno == EAGAIN || errno == EINTR)  break;
+
+                perror("recvmsg");
+                exit(1);
+            }
+
+            i64 now = tsc ? os_tsc_to_rt_ns(os_tsc_read()) : os_time_get_rt_ns();
+
+            if (timestamps)     pong_read_tx_tstamps(sock, ts_ring, &peers);
+
+            payload_t *payload = (payload_t *)packet;
+            u64 seqno          = payload->seqno;
+
+            // the sequence number is echoed, the pinger matches replies to probes
+            pong_peer *peer          = pong_peers_get(&peers, &src);
+            payload->timestamp       = now;
+            payload->type            = PAYLOAD_TYPE_DATA;
+            payload->jitter          = peer ? pong_peer_update(peer, seqno, payload->cycle, now) : 0;
+            payload->peer_seqno      = peer ? peer->peer_seqno : 0;
+            payload->peer_turnaround = peer ? peer->peer_turnaround : 0;
+
+            ret = rtn_socket_send_to(sock, packet, ret, &src, 0);
+            if (ret == -1) {
+                perror("sendmsg");
+                exit(1);
+            }
+
+            if (tm)     rtn_tm_add(&tm->packets, 1);
+
+            pong_ts *ts = &ts_ring[num_sent % PONG_TS_RING];
+            ts->id      = num_sent;
+            ts->peer    = peer ? (u32)(peer - peers.peers) + 1 : 0;
+            ts->seqno   = seqno;
+            ts->rx_sw   = rx.rx_tstamps.sw_ts;
+            ts->rx_hw   = rx.rx_tstamps.hw_ts;
+            num_sent   += 1;
+        }
+    }
 
-    int flags = 0;
-    if (opts->rt_app_test) {
-        signal(SIGINT, sigint_handler);
+    os_faults_print(os_faults_since(faults, RUSAGE_THREAD), name, stderr);
+    pong_peers_report(&peers, name, stderr);
 
-        for (int i = 0; i < MAX_NUM_TESTS; i++) {
-            s_rt_app_stats[i].stats = malloc(MAX_PKT_TEST * sizeof(rt_app_stats_t));
-            s_rt_app_stats[i].count = 0;
+    close(epfd);
+    pong_peers_free(&peers);
+    os_vm_free(ts_ring, PONG_TS_RING * sizeof(pong_ts));
+    rtn_pkt_pool_destroy(pool);
+
+    return num_sent;
+}
+
+// Receive times of the tests of a tx talker (-a) on CLOCK_MONOTONIC, one
+// file per test. A test starts at seqno 0, the packets are sent back zeroed.
+static int
+do_rt_app_test(options_t *opts, rtn_socket *sock)
+{
+    rtn_pkt_pool *pool = rtn_pkt_pool_new(1, opts->packet_size, NULL);
+    rt_app_test_t *app = os_vm_alloc(sizeof(rt_app_test_t));
+    if (pool == NULL || app == NULL) {
+        error("Failed to allocate the packet buffer\n");
+        exit(1);
+    }
+
+    u8 *packet     = rtn_pkt_pool_get(pool, 0);
+    app->num_tests = -1;
+    for (int i = 0; i < MAX_NUM_TESTS; i++) {
+        app->tests[i].stats = os_vm_alloc(MAX_PKT_TEST * sizeof(rt_app_stats_t));
+        if (app->tests[i].stats == NULL) {
+            error("Failed to allocate the receive times of test %d\n", i);
+            exit(1);
         }
 
-        opts->clock_type = CLOCK_TYPE_MONOTONIC;
-        flags            = MSG_DONTWAIT;
+        app->tests[i].count = 0;
+        rtn_hist_init(&app->hist[i]);
     }
 
+    bool timestamps = rtn_socket_has_timestamps(sock);
+
     int ret;
     rt_app_stats_array_t *stat_array = NULL;
-    i64 cycle_time     = 0;
     i64 last_recv_time = 0;
+    os_faults faults   = os_faults_get(RUSAGE_THREAD);
     while (!s_pong_stop) {
-        memset(packet, 0, opts->packet_size);
-
         debug("Waiting for packet\n");
-        ret = rtn_socket_receive_message(sock, packet, opts->packet_size, NULL, flags);
+        struct sockaddr_storage src;
+        ret = rtn_socket_receive_from(sock, packet, opts->packet_size, NULL, MSG_DONTWAIT, &src);
         if (ret == -1) {
             if (errno == EAGAIN) {
                 usleep(1);
@@ -72,44 +442,31 @@ do_pong(options_t *opts, rtn_socket *sock)
             perror("recvmsg");
             exit(1);
         }
-        
-        i64 now;
-        if (opts->clock_type == CLOCK_TYPE_REALTIME) {
-            now = os_time_get_rt_ns();
-        } else {
-            now = os_time_get_ns();
-        }
 
+        i64 now = os_time_get_ns();
+
+        // the TX timestamps of the replies are not used
+        if (timestamps)     pong_read_tx_tstamps(sock, NULL, NULL);
+
+        // a test starts at seqno 0 (tx role), ping probes start at 1
         payload_t *payload = (payload_t *)packet;
+        if (payload->seqno == 0 || stat_array == NULL) {
+            if (app->num_tests == MAX_NUM_TESTS - 1)    break;
 
-        if (opts->rt_app_test) {
-            if (payload->seqno == 0) {
-                s_num_tests += 1;
-                stat_array = &s_rt_app_stats[s_num_tests];
-            }
-            
-            stat_array->stats[stat_array->count].id         = payload->seqno;
-            stat_array->stats[stat_array->count].rx_tstamp  = now;
-            stat_array->stats[stat_array->count].jitter     = now - last_recv_time;
-            stat_array->count                              += 1;
-
-            memset(packet, 0, ret);
-
-        } else {
-            cycle_time         = payload->cycle;
-            if (payload->type == PAYLOAD_TYPE_END) {
-                fprintf(stderr, "Received end packet\n");
-                // stop = 1;
-            } 
-        
-            memset(packet, 0, ret);
-
-            payload->timestamp = now;
-            payload->type      = PAYLOAD_TYPE_DATA;
-            payload->jitter    = now - last_recv_time - cycle_time;        
+            app->num_tests += 1;
+            stat_array = &app->tests[app->num_tests];
         }
 
-        ret = rtn_socket_send_message(sock, packet, ret, 0);
+        // the first interval of a test spans the pause between tests
+        if (stat_array->count > 0)  rtn_hist_record(&app->hist[app->num_tests], now - last_recv_time);
+
+        stat_array->stats[stat_array->count].id         = payload->seqno;
+        stat_array->stats[stat_array->count].rx_tstamp  = now;
+        stat_array->stats[stat_array->count].jitter     = now - last_recv_time;
+        stat_array->count                              += 1;
+
+        memset(packet, 0, ret);
+        ret = rtn_socket_send_to(sock, packet, ret, &src, 0);
         if (ret == -1) {
             perror("sendmsg");
             exit(1);
@@ -118,38 +475,410 @@ do_pong(options_t *opts, rtn_socket *sock)
         last_recv_time = now;
     }
 
-    // open a file for each test to write in csv format the id,rx_tstamp
-    info("Saving results for %d tests\n", s_num_tests+1);
-    for (int i = 0; i <= s_num_tests; i++) {
-        char filename[128] = {0};
-        snprintf(filename, sizeof(filename), "rt_app_test_%d.csv", i);
-        FILE *file = fopen(filename, "w");
-        if (file == NULL) {
-            perror("fopen");
-            exit(1);
+    os_faults_print(os_faults_since(faults, RUSAGE_THREAD), "Pong", stderr);
+    rtn_pkt_pool_destroy(pool);
+
+    // one file per test
+    info("Saving results for %d tests\n", app->num_tests+1);
+    for (int i = 0; i <= app->num_tests; i++)   rt_app_test_save(opts, app, i);
+
+    // receive interval of each test and of all the tests together
+    rtn_hist *all = malloc(sizeof(rtn_hist));
+    if (all == NULL) {
+        error("Failed to allocate the interval histogram\n");
+        exit(1);
+    }
+
+    rtn_hist_init(all);
+    for (int i = 0; i <= app->num_tests; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Interval (test %d)", i);
+        rtn_hist_print(&app->hist[i], name, stderr);
+        rtn_hist_merge(all, &app->hist[i]);
+    }
+
+    if (app->num_tests >= 0) {
+        rtn_hist_print(all, "Interval (all tests)", stderr);
+
+        if (opts->hist_file) {
+            const rtn_hist *hists[] = { all };
+            const char     *names[] = { "interval" };
+            rtn_hist_save(opts->hist_file, 1, hists, names);
+        }
+    }
+
+    free(all);
+
+    for (int i = 0; i < MAX_NUM_TESTS; i++)     os_vm_free(app->tests[i].stats, MAX_PKT_TEST * sizeof(rt_app_stats_t));
+    os_vm_free(app, sizeof(rt_app_test_t));
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # RTT Table
+//
+// Replies are matched to their probe by sequence number. The table is
+// preallocated for the whole test and indexed by seqno (1..num_probes), so a
+// reply can arrive late, out of order or twice without any lookup. The RTT
+// and jitter distributions are accumulated in histograms as replies arrive.
+//
+// The kernel timestamps of each probe (TX from the error queue, RX from the
+// reply) and the turnaround reported by pong break the RTT down at the end:
+//
+//     stack      = (tx_sw - tx_app) + (rx_app - rx_sw)    local network stack
+//     peer       = turnaround of pong, kernel RX to kernel TX
+//     wire       = (rx - tx) - peer                       links and switches
+//
+// The wire time uses the hardware timestamps when both ends have one. Only the
+// local clock is involved in each term, the hosts do not need to be in sync.
+typedef struct ping_tstamps ping_tstamps;
+struct ping_tstamps
+{
+    i64 tx_sched;
+    i64 tx_sw;
+    i64 tx_hw;
+    i64 rx_app;
+    i64 rx_sw;
+    i64 rx_hw;
+    i64 peer;               // 0: not reported (yet)
+};
+
+typedef struct ping_table ping_table;
+struct ping_table
+{
+    u64  num_probes;
+    i64 *tx_times;          // 0: probe not sent yet
+    i64 *rtt;               // -1: no reply (yet)
+    i64 *jitter;
+    ping_tstamps *ts;
+
+    u64  num_replies;
+    u64  num_duplicates;
+    u64  num_reordered;     // replies older than the newest reply received
+    u64  num_unknown;       // replies with a seqno we never sent
+    u64  max_seqno;
+
+    rtn_hist rtt_hist;
+    rtn_hist jitter_hist;   // |jitter|, the deviation from the cycle measured by pong
+
+    // telemetry, NULL when off: replies are counted by the receiver, probes
+    // without a reply after --rx-timeout by the sender
+    rtn_tm_source *tm;
+    u64            next_expire;
+};
+
+static void
+ping_table_init(ping_table *table, u64 num_probes)
+{
+    memset(table, 0, sizeof(*table));
+    table->num_probes = num_probes;
+    // written by the RT loop: prefaulted (zeroed) up front
+    table->tx_times   = os_vm_alloc((num_probes + 1) * sizeof(i64));
+    table->rtt        = os_vm_alloc((num_probes + 1) * sizeof(i64));
+    table->jitter     = os_vm_alloc((num_probes + 1) * sizeof(i64));
+    table->ts         = os_vm_alloc((num_probes + 1) * sizeof(ping_tstamps));
+    if (table->tx_times == NULL || table->rtt == NULL || table->jitter == NULL || table->ts == NULL) {
+        error("Failed to allocate the RTT table\n");
+        exit(1);
+    }
+
+    for (u64 i = 0; i <= num_probes; i++)   table->rtt[i] = -1;
+
+    table->next_expire = 1;
+
+    rtn_hist_init(&table->rtt_hist);
+    rtn_hist_init(&table->jitter_hist);
+}
+
+static void
+ping_table_free(ping_table *table)
+{
+    os_vm_free(table->tx_times, (table->num_probes + 1) * sizeof(i64));
+    os_vm_free(table->rtt, (table->num_probes + 1) * sizeof(i64));
+    os_vm_free(table->jitter, (table->num_probes + 1) * sizeof(i64));
+    os_vm_free(table->ts, (table->num_probes + 1) * sizeof(ping_tstamps));
+}
+
+// The sender and the receiver may run on different threads: the TX time is
+// published before the probe is sent, the number of replies is read by the
+// sender to stop waiting early.
+static inline void ping_table_sent        (ping_table *table, u64 seqno, i64 now) { __atomic_store_n(&table->tx_times[seqno], now, __ATOMIC_RELEASE); }
+static inline bool ping_table_has_reply   (ping_table *table, u64 seqno)          { return __atomic_load_n(&table->rtt[seqno], __ATOMIC_ACQUIRE) >= 0; }
+static inline u64  ping_table_num_replies (ping_table *table)                     { return __atomic_load_n(&table->num_replies, __ATOMIC_ACQUIRE); }
+
+static void
+ping_table_record(ping_table *table, u64 seqno, i64 rx_time, i64 jitter, i64 rx_app, const rtn_pkt_stat *rx)
+{
+    i64 tx_time = seqno >= 1 && seqno <= table->num_probes ? __atomic_load_n(&table->tx_times[seqno], __ATOMIC_ACQUIRE) : 0;
+    if (tx_time == 0) {
+        table->num_unknown += 1;
+        return;
+    }
+
+    if (table->rtt[seqno] >= 0) {
+        table->num_duplicates += 1;
+        return;
+    }
+
+    if (seqno < table->max_seqno)   table->num_reordered += 1;
+    else                            table->max_seqno      = seqno;
+
+    rtn_hist_record(&table->rtt_hist, rx_time - tx_time);
+    rtn_hist_record(&table->jitter_hist, jitter < 0 ? -jitter : jitter);
+
+    table->jitter[seqno]    = jitter;
+    table->ts[seqno].rx_app = rx_app;
+    table->ts[seqno].rx_sw  = rx->rx_tstamps.sw_ts;
+    table->ts[seqno].rx_hw  = rx->rx_tstamps.hw_ts;
+    __atomic_store_n(&table->rtt[seqno], rx_time - tx_time, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->num_replies, table->num_replies + 1, __ATOMIC_RELEASE);
+
+    if (table->tm)  rtn_tm_add(&table->tm->packets, 1);
+}
+
+// The turnaround of an earlier reply, reported by pong.
+static void
+ping_table_peer(ping_table *table, u64 seqno, i64 turnaround)
+{
+    if (seqno >= 1 && seqno <= table->num_probes && turnaround > 0)     table->ts[seqno].peer = turnaround;
+}
+
+// Match the TX timestamps of the error queue to the probes: the probes are the
+// only packets sent on the socket, probe `seqno` is send `seqno - 1`.
+static void
+ping_table_read_tx_tstamps(ping_table *table, rtn_socket *sock)
+{
+    for (;;) {
+        uint ts_id         = 0;
+        rtn_pkt_stat pstat = {0};
+        int type = stats_read_tx_tstamp(sock, &ts_id, &pstat);
+        if (type < 0)   break;
+
+        u64 seqno = (u64)ts_id + 1;
+        if (seqno > table->num_probes)  continue;
+
+        ping_tstamps *ts = &table->ts[seqno];
+        switch (type) {
+            case RTN_PKT_TS_TYPE_TX_SCHED:  ts->tx_sched = pstat.tx_tstamps.sched_ts; break;
+            case RTN_PKT_TS_TYPE_TX_SW:     ts->tx_sw    = pstat.tx_tstamps.sw_ts;    break;
+            case RTN_PKT_TS_TYPE_TX_HW:     ts->tx_hw    = pstat.tx_tstamps.hw_ts;    break;
+            default:                                                                  break;
+        }
+    }
+}
+
+// Telemetry: count the probes sent more than `timeout` ago without a reply,
+// a reply arriving later is still recorded.
+static void
+ping_table_expire(ping_table *table, i64 now, i64 timeout)
+{
+    if (table->tm == NULL)  return;
+
+    for (; table->next_expire <= table->num_probes; table->next_expire++) {
+        u64 seqno   = table->next_expire;
+        i64 tx_time = __atomic_load_n(&table->tx_times[seqno], __ATOMIC_ACQUIRE);
+        if (tx_time == 0 || now - tx_time < timeout)    break;
+
+        if (!ping_table_has_reply(table, seqno))    rtn_tm_add(&table->tm->drops, 1);
+    }
+}
+
+static void
+ping_table_report(options_t *opts, ping_table *table)
+{
+    u64 num_lost = table->num_probes - table->num_replies;
+    fprintf(stderr, "Sent %ld probes, received %ld replies\n", table->num_probes, table->num_replies);
+    fprintf(stderr, "Lost: %ld (%.3f%%), Reordered: %ld, Duplicates: %ld, Unknown: %ld\n",
+            num_lost, 100.0 * num_lost / table->num_probes, table->num_reordered, table->num_duplicates, table->num_unknown);
+
+    if (table->num_replies == 0) {
+        fprintf(stderr, "No replies received\n");
+        return;
+    }
+
+    // one clock domain, CLOCK_REALTIME, for the CSV and the breakdown
+    for (u64 i = 1; i <= table->num_probes; i++) {
+        ping_tstamps *ts = &table->ts[i];
+        if (opts->clock_type == CLOCK_TYPE_TSC)     ts->rx_app = os_time_stamp_to_ns(true, ts->rx_app);
+        if (opts->phc) {
+            ts->tx_hw = rtn_phc_to_rt_ns(opts->phc, ts->tx_hw);
+            ts->rx_hw = rtn_phc_to_rt_ns(opts->phc, ts->rx_hw);
         }
+    }
+
+    // entries with a negative RTT are probes without a reply, 0 is a
+    // timestamp that is not available
+    if (opts->verbose) {     
+        fprintf(stderr, "Saving results\n");
+        printf("id, rtt, jitter, cycle_time, tx_app, tx_sched, tx_sw, tx_hw, rx_app, rx_sw, rx_hw, peer\n");
+        for (u64 i = 1; i <= table->num_probes; i++) {
+            if (table->rtt[i] < 0)  continue;
 
-        info("Writing results to %s (%d/%d)\n", filename, i+1, s_num_tests+1);        
-        fprintf(file, "id,rx_tstamp,jitter\n");
-        for (usize j = 0; j < s_rt_app_stats[i].count; j++) {
-            rt_app_stats_t *stat = &s_rt_app_stats[i].stats[j];
-            fprintf(file, "%ld,%ld,%ld\n", stat->id, stat->rx_tstamp, stat->jitter);
+            const ping_tstamps *ts = &table->ts[i];
+            printf("%ld, %ld, %ld, %ld, %ld, %ld, %ld, %ld, %ld, %ld, %ld, %ld\n", i - 1, table->rtt[i], table->jitter[i], opts->cycle_time,
+                   table->tx_times[i], ts->tx_sched, ts->tx_sw, ts->tx_hw, ts->rx_app, ts->rx_sw, ts->rx_hw, ts->peer);
         }
+    }
 
-        fclose(file);
+    rtn_hist_print(&table->rtt_hist, "RTT", stderr);
+    rtn_hist_print(&table->jitter_hist, "Jitter", stderr);
 
-        free(s_rt_app_stats[i].stats);
+    // RTT breakdown, for the probes with the kernel timestamps
+    rtn_hist *stack = malloc(3 * sizeof(rtn_hist));
+    if (stack == NULL) {
+        error("Failed to allocate the RTT breakdown histograms\n");
+        exit(1);
     }
 
-    return 0;
+    rtn_hist *wire  = &stack[1];
+    rtn_hist *peer  = &stack[2];
+    for (int i = 0; i < 3; i++)     rtn_hist_init(&stack[i]);
+
+    for (u64 i = 1; i <= table->num_probes; i++) {
+        const ping_tstamps *ts = &table->ts[i];
+        if (table->rtt[i] < 0)  continue;
+
+        if (ts->tx_sw && ts->rx_sw)     rtn_hist_record(stack, (ts->tx_sw - table->tx_times[i]) + (ts->rx_app - ts->rx_sw));
+
+        i64 tx = ts->tx_hw && ts->rx_hw ? ts->tx_hw : ts->tx_sw;
+        i64 rx = ts->tx_hw && ts->rx_hw ? ts->rx_hw : ts->rx_sw;
+        if (ts->peer && tx && rx) {
+            rtn_hist_record(wire, rx - tx - ts->peer);
+            rtn_hist_record(peer, ts->peer);
+        }
+    }
+
+    if (stack->total > 0 || peer->total > 0) {
+        rtn_hist_print(stack, "RTT stack", stderr);
+        rtn_hist_print(wire, "RTT wire", stderr);
+        rtn_hist_print(peer, "RTT peer", stderr);
+    }
+
+    if (opts->hist_file) {
+        const rtn_hist *hists[] = { &table->rtt_hist, &table->jitter_hist };
+        const char     *names[] = { "rtt", "jitter" };
+        rtn_hist_save(opts->hist_file, 2, hists, names);
+    }
+
+    free(stack);
+}
+
+// Drain the replies already received and the TX timestamps of the probes,
+// returns the number of new replies. The RTT ends at the kernel RX timestamp
+// when `kernel_ts` is set and the socket provides it, otherwise at the time
+// the reply is read.
+static u64
+ping_receive_replies(options_t *opts, rtn_socket *sock, u8 *packet, ping_table *table, bool kernel_ts)
+{
+    payload_t *payload = (payload_t *)packet;
+    u64 num_replies    = table->num_replies;
+    bool timestamps    = rtn_socket_has_timestamps(sock);
+    bool tsc           = opts->clock_type == CLOCK_TYPE_TSC;
+
+    for (;;) {
+        rtn_pkt_stat pstat = {0};
+        int ret = rtn_socket_receive_message(sock, packet, opts->packet_size, timestamps ? &pstat : NULL, MSG_DONTWAIT);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EINTR)  break;
+            perror("recvmsg");
+            exit(1);
+        }
+
+        // rx_app is kept in raw cycles with --clock tsc until the report
+        i64 rx_app  = os_time_stamp(tsc);
+        i64 rx_time = kernel_ts && pstat.rx_tstamps.sw_ts ? pstat.rx_tstamps.sw_ts : os_time_stamp_to_ns(tsc, rx_app);
+        ping_table_record(table, payload->seqno, rx_time, payload->jitter, rx_app, &pstat);
+        ping_table_peer(table, payload->peer_seqno, payload->peer_turnaround);
+    }
+
+    // POLLERR until the error queue is empty
+    if (timestamps)     ping_table_read_tx_tstamps(table, sock);
+
+    return table->num_replies - num_replies;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// # Async Receiver
+//
+// With --async the replies are read by a dedicated thread, created with the
+// scheduling policy and affinity of the sender, so the cycle loop never waits
+// for them.
+typedef struct ping_rx_args ping_rx_args;
+struct ping_rx_args
+{
+    options_t  *opts;
+    rtn_socket *sock;
+    ping_table *table;
+    bool        stop;
+};
+
+static void *
+ping_rx_thread_fn(void *arg)
+{
+    ping_rx_args *args = arg;
+    os_stack_prefault();
+
+    rtn_pkt_pool *pool = rtn_pkt_pool_new(1, args->opts->packet_size, NULL);
+    if (pool == NULL) {
+        error("Failed to allocate the reply buffer\n");
+        exit(1);
+    }
+
+    u8 *packet = rtn_pkt_pool_get(pool, 0);
+
+    while (!__atomic_load_n(&args->stop, __ATOMIC_ACQUIRE)) {
+        int res = rtn_socket_poll(args->sock, 100 * NSEC_PER_MSEC);
+        if (res < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        if (res > 0)    ping_receive_replies(args->opts, args->sock, packet, args->table, false);
+    }
+
+    rtn_pkt_pool_destroy(pool);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Ping
+//
+// Three ways to collect the replies:
+// - sync (default): after each probe wait for its reply, at most --rx-timeout,
+//   a lost reply is counted and the test goes on.
+// - async (--async): a receiver thread matches the replies while the cycle
+//   loop keeps sending, several probes can be in flight.
+// - io_uring engine: the receive completions are reaped at every cycle. The
+//   RTT ends at the kernel RX timestamp of the reply when available, so it
+//   does not depend on the cycle in which the completion is reaped.
 static int
 do_ping(options_t *opts, rtn_socket *sock)
 {
-    u8 *packet = malloc(opts->packet_size);
-    payload_t *payload = (payload_t *)packet;
-    payload->type = PAYLOAD_TYPE_DATA;
+    // probe and reply buffers, the probe is patched at every cycle
+    rtn_pkt_pool *pool = rtn_pkt_pool_new(2, opts->packet_size, &(payload_t) { .type = PAYLOAD_TYPE_DATA, .cycle = opts->cycle_time });
+    if (pool == NULL) {
+        error("Failed to allocate the packet buffers\n");
+        exit(1);
+    }
+
+    u8 *packet         = rtn_pkt_pool_get(pool, 0);
+    u8 *reply          = rtn_pkt_pool_get(pool, 1);
+    payload_t *payload = rtn_pkt_pool_payload(pool, 0);
+
+    bool reap_in_loop = sock->uring != NULL;
+    bool use_thread   = opts->ping_async && !reap_in_loop;
+
+    ping_table table;
+    ping_table_init(&table, opts->num_packets);
+    table.tm = rtn_telemetry_add(opts->telemetry, "ping", &table.rtt_hist, &table.jitter_hist);
+
+    pthread_t    rx_thread;
+    ping_rx_args rx_args = { .opts = opts, .sock = sock, .table = &table };
+    if (use_thread && pthread_create(&rx_thread, NULL, ping_rx_thread_fn, &rx_args) != 0) {
+        error("Failed to create the receiver thread\n");
+        exit(1);
+    }
 
     i64 start_time  = os_time_get_rt_ns();
     i64 wakeup_time = os_time_normalize_ts(start_time + 2 * NSEC_PER_SEC);
@@ -157,112 +886,99 @@ do_ping(options_t *opts, rtn_socket *sock)
     fprintf(stderr, "Start time:  %ld\n", start_time);
     fprintf(stderr, "Wakeup time: %ld\n", wakeup_time);
 
-    i64 *rtt_latencies    = malloc(MAX_NUM_PACKETS * sizeof(u64));
-    i64 *jitter_latencies = malloc(MAX_NUM_PACKETS * sizeof(u64));
-    u64 num_latencies    = 0;
-    
-    int ret;
-    struct timespec sleep_ts;
-    bool stop = false;
-    while (!stop) {
-        sleep_ts.tv_sec  = wakeup_time / NSEC_PER_SEC;
-        sleep_ts.tv_nsec = wakeup_time % NSEC_PER_SEC;
+    rtn_cycle *cycle = os_vm_alloc(sizeof(rtn_cycle));
+    if (cycle == NULL) {
+        error("Failed to allocate the cycle\n");
+        exit(1);
+    }
 
-        ret = clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &sleep_ts, NULL);
-        if (ret == -1) {
-            perror("clock_nanosleep");
-            exit(1);
-        }
+    rtn_cycle_init(cycle, &(rtn_cycle_config) { .clock = CLOCK_REALTIME, .period = opts->cycle_time,
+                   .overrun = opts->overrun_policy, .wait = opts->wait_mode, .spin_margin = opts->spin_margin,
+                   .tsc = opts->clock_type == CLOCK_TYPE_TSC }, wakeup_time);
 
-        wakeup_time += opts->cycle_time;
+    int ret;
+    os_faults faults = os_faults_get(RUSAGE_THREAD);
+    for (u64 seqno = 1; seqno <= table.num_probes; seqno++) {
+        i64 now;
+        rtn_cycle_wait(cycle, &now);
 
-        memset(packet, 0, opts->packet_size);
-        i64 now = os_time_get_rt_ns();
-        if (num_latencies == opts->num_packets - 1) {
-            fprintf(stderr, "Sending end packet\n");
-            payload->type = PAYLOAD_TYPE_END;
-            stop          = true;
-        } else {
-            payload->type      = PAYLOAD_TYPE_DATA;
-        }
+        ping_table_expire(&table, now, opts->rx_timeout);
 
-        payload->cycle     = opts->cycle_time;
         payload->timestamp = now;
-        payload->seqno     = num_latencies + 1;
+        payload->seqno     = seqno;
 
-        // printf("Sending packet %ld at %ld\n", payload->seqno, now);
+        ping_table_sent(&table, seqno, now);
         ret = rtn_socket_send_message(sock, packet, opts->packet_size, 0);
         if (ret == -1) {
             perror("sendmsg");
             exit(1);
         }
 
-        memset(packet, 0, opts->packet_size);
-        ret = rtn_socket_receive_message(sock, packet, opts->packet_size, NULL, 0);
-        if (ret == -1) {
-            perror("recvmsg");
-            exit(1);
+        if (reap_in_loop) {
+            ping_receive_replies(opts, sock, reply, &table, true);
+        } else if (!use_thread) {
+            // wait for this reply, late replies of previous probes are
+            // recorded on the way
+            i64 deadline = now + opts->rx_timeout;
+            while (!ping_table_has_reply(&table, seqno)) {
+                i64 left = deadline - os_time_get_rt_ns();
+                if (left <= 0) {
+                    debug("No reply for probe %ld\n", seqno);
+                    break;
+                }
+
+                ret = rtn_socket_poll(sock, left);
+                if (ret < 0 && errno != EINTR) {
+                    perror("poll");
+                    exit(1);
+                }
+
+                if (ret > 0)    ping_receive_replies(opts, sock, reply, &table, false);
+            }
         }
-
-        rtt_latencies[num_latencies]     = os_time_get_rt_ns() - now;
-        jitter_latencies[num_latencies]  = payload->jitter;
-        num_latencies                   += 1;        
     }
 
-    // calculate statistics
-    u64 min_rtt = UINT64_MAX;
-    u64 max_rtt = 0;
-    u64 avg_rtt = 0;
-    for (u64 i = 0; i < num_latencies; i++) {
-        u64 rtt = rtt_latencies[i];
-        if (rtt < min_rtt) {
-            min_rtt = rtt;
-        }
-        if (rtt > max_rtt) {
-            max_rtt = rtt;
+    // give the replies still in flight up to --rx-timeout to arrive
+    i64 deadline = os_time_get_rt_ns() + opts->rx_timeout;
+    while (ping_table_num_replies(&table) < table.num_probes) {
+        i64 left = deadline - os_time_get_rt_ns();
+        if (left <= 0)  break;
+
+        if (use_thread) {
+            usleep(1000);
+        } else if (rtn_socket_poll(sock, left) > 0) {
+            ping_receive_replies(opts, sock, reply, &table, reap_in_loop);
         }
-        avg_rtt += rtt;
     }
+    faults = os_faults_since(faults, RUSAGE_THREAD);
 
-    avg_rtt /= num_latencies;
-
-    // jitter can be negative
-    i64 min_jitter = INT64_MAX;
-    i64 max_jitter = INT64_MIN;
-    i64 avg_jitter = 0;
-    for (u64 i = 0; i < num_latencies; i++) {
-        i64 jitter = jitter_latencies[i];
-        if (jitter < min_jitter) {
-            min_jitter = jitter;
-        }
-        if (jitter > max_jitter) {
-            max_jitter = jitter;
-        }
-        avg_jitter += jitter;
+    if (use_thread) {
+        __atomic_store_n(&rx_args.stop, true, __ATOMIC_RELEASE);
+        pthread_join(rx_thread, NULL);
     }
 
-    avg_jitter /= (i64)num_latencies;
+    if (rtn_socket_has_timestamps(sock))    ping_table_read_tx_tstamps(&table, sock);
 
-    if (opts->verbose) {     
-        fprintf(stderr, "Saving results\n");
-        printf("id, rtt, jitter, cycle_time\n");
-        for (u64 i = 0; i < num_latencies; i++) {
-            printf("%ld, %ld, %ld, %ld\n", i, rtt_latencies[i], jitter_latencies[i], opts->cycle_time);
-        }
-    }
+    ping_table_expire(&table, os_time_get_rt_ns() + opts->rx_timeout, opts->rx_timeout);
+    rtn_telemetry_detach(opts->telemetry, table.tm);
 
-    fprintf(stderr, "Peer disconnected, received %ld packets\n", num_latencies);
-    fprintf(stderr, "RTT Min: %ld\n", min_rtt);
-    fprintf(stderr, "RTT Max: %ld\n", max_rtt);
-    fprintf(stderr, "RTT Avg: %ld\n", avg_rtt);
+    ping_table_report(opts, &table);
+    rtn_cycle_report(cycle, "Ping", stderr);
+    os_faults_print(faults, "Ping", stderr);
 
-    fprintf(stderr, "Jitter Min: %ld\n", min_jitter);
-    fprintf(stderr, "Jitter Max: %ld\n", max_jitter);
-    fprintf(stderr, "Jitter Avg: %ld\n", avg_jitter);
+    if (sock->uring) {
+        fprintf(stderr, "io_uring: %ld sends, %ld receives, %ld io_uring_enter calls\n",
+                sock->uring->num_sends, sock->uring->num_recvs, sock->uring->num_enter);
+    }
 
     fprintf(stderr, "Done\n");
 
-    return num_latencies;
+    u64 num_replies = table.num_replies;
+    ping_table_free(&table);
+    os_vm_free(cycle, sizeof(rtn_cycle));
+    rtn_pkt_pool_destroy(pool);
+
+    return num_replies;
 }
 
-#endif // RTN_PING_H
\ No newline at end of file
+#endif // RTN_PING_H
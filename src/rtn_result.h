@@ -0,0 +1,328 @@
+#ifndef RTN_RESULT_H
+#define RTN_RESULT_H
+
+#include "rtn_base.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Binary Results
+//
+// Columnar file of i64 values, written through mmap while the test runs and
+// turned into CSV by `rtn-conv`. The layout (native byte order) is:
+//
+//     [header, 4 KB][block 0][block 1]...
+//
+// A block holds `block_size` records, column after column: the value of
+// column `c` of record `r` is at
+//
+//     header_size + (r / block_size) * num_columns * block_size * 8
+//                 + c * block_size * 8 + (r % block_size) * 8
+//
+// Only one block is mapped at a time, so the memory used does not depend on
+// the number of records (the process runs with mlockall). The header, and its
+// `num_records`, is rewritten every time a block is complete: a file is
+// readable while it is written or after a crash, up to its last block. The
+// last block is truncated to the records it holds.
+
+#define RTN_RESULT_MAGIC            "RTNRES\0\0"
+#define RTN_RESULT_VERSION          1
+#define RTN_RESULT_HEADER_SIZE      4096
+#define RTN_RESULT_BLOCK_SIZE       (1 << 16)   // records, 512 KB per column
+#define RTN_RESULT_MAX_COLUMNS      16
+
+typedef enum
+{
+    RTN_COL_ID,
+    RTN_COL_TX_APP,
+    RTN_COL_TX_SCHED,
+    RTN_COL_TX_SW,
+    RTN_COL_TX_HW,
+    RTN_COL_TX_TXTIME,
+    RTN_COL_TX_TXTIME_ERR,
+    RTN_COL_RX_APP,
+    RTN_COL_RX_SW,
+    RTN_COL_RX_HW,
+    RTN_COL_JITTER,
+
+    RTN_COL_MAX,
+} rtn_result_col;
+
+static const char *g_result_col_str[] = {
+    [RTN_COL_ID]            = "id",
+    [RTN_COL_TX_APP]        = "tx_app",
+    [RTN_COL_TX_SCHED]      = "tx_sched",
+    [RTN_COL_TX_SW]         = "tx_sw",
+    [RTN_COL_TX_HW]         = "tx_hw",
+    [RTN_COL_TX_TXTIME]     = "tx_txtime",
+    [RTN_COL_TX_TXTIME_ERR] = "tx_txtime_err",
+    [RTN_COL_RX_APP]        = "rx_app",
+    [RTN_COL_RX_SW]         = "rx_sw",
+    [RTN_COL_RX_HW]         = "rx_hw",
+    [RTN_COL_JITTER]        = "jitter",
+};
+
+static inline const char *
+rtn_result_col_name(u32 col)
+{
+    return col < RTN_COL_MAX ? g_result_col_str[col] : "unknown";
+}
+
+static inline int
+rtn_result_col_from_str(const char *name)
+{
+    for (int i = 0; i < RTN_COL_MAX; i++) {
+        if (cstr_eq(name, g_result_col_str[i]))    return i;
+    }
+
+    return -1;
+}
+
+typedef struct rtn_result_header rtn_result_header;
+struct rtn_result_header
+{
+    char    magic[8];
+    u32     version;
+    u32     header_size;
+    u32     block_size;                         // records per block
+    u32     num_columns;
+    u64     num_records;                        // complete records in the file
+    i32     role_id;
+    i32     stream_id;                          // -1 outside the multi-stream mode
+    i64     created;                            // CLOCK_REALTIME
+    u32     columns[RTN_RESULT_MAX_COLUMNS];    // rtn_result_col
+    char    clock[32];                          // clock of the application timestamps
+    char    kernel[256];
+    char    cfg[1024];                          // options, same as the `# cfg:` line of the CSV
+};
+
+typedef struct rtn_result rtn_result;
+struct rtn_result
+{
+    int                 fd;
+    rtn_result_header  *hdr;        // RTN_RESULT_HEADER_SIZE bytes, written as is
+    i64                *block;      // block being written, NULL before the first record
+    u64                 block_idx;
+    u32                 row;        // next record in the block
+};
+
+static inline usize
+rtn_result_block_bytes(const rtn_result_header *hdr)
+{
+    return (usize)hdr->num_columns * hdr->block_size * sizeof(i64);
+}
+
+static inline i64
+rtn_result_block_offset(const rtn_result_header *hdr, u64 block_idx)
+{
+    return hdr->header_size + (i64)(block_idx * rtn_result_block_bytes(hdr));
+}
+
+static int
+rtn_result_write_header(rtn_result *res)
+{
+    if (pwrite(res->fd, res->hdr, RTN_RESULT_HEADER_SIZE, 0) != RTN_RESULT_HEADER_SIZE) {
+        perror("pwrite");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Create the file at `path` with the given columns, the caller fills the
+// description of the test (`hdr->clock`, `hdr->kernel`, `hdr->cfg`, ...)
+// before the first record.
+static rtn_result *
+rtn_result_new(const char *path, const u32 *columns, u32 num_columns)
+{
+    if (num_columns == 0 || num_columns > RTN_RESULT_MAX_COLUMNS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    rtn_result *res = calloc(1, sizeof(rtn_result));
+    if (res == NULL)    return NULL;
+
+    res->hdr = calloc(1, RTN_RESULT_HEADER_SIZE);
+    if (res->hdr == NULL) {
+        free(res);
+        return NULL;
+    }
+
+    res->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (res->fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        free(res->hdr);
+        free(res);
+        return NULL;
+    }
+
+    rtn_result_header *hdr = res->hdr;
+    memcpy(hdr->magic, RTN_RESULT_MAGIC, sizeof(hdr->magic));
+    hdr->version     = RTN_RESULT_VERSION;
+    hdr->header_size = RTN_RESULT_HEADER_SIZE;
+    hdr->block_size  = RTN_RESULT_BLOCK_SIZE;
+    hdr->num_columns = num_columns;
+    hdr->stream_id   = -1;
+    hdr->created     = os_time_get_rt_ns();
+    memcpy(hdr->columns, columns, num_columns * sizeof(u32));
+
+    if (ftruncate(res->fd, RTN_RESULT_HEADER_SIZE) < 0 || rtn_result_write_header(res) < 0) {
+        perror("ftruncate");
+        close(res->fd);
+        free(res->hdr);
+        free(res);
+        return NULL;
+    }
+
+    return res;
+}
+
+static int
+rtn_result_map_block(rtn_result *res)
+{
+    usize len = rtn_result_block_bytes(res->hdr);
+    i64   off = rtn_result_block_offset(res->hdr, res->block_idx);
+
+    if (ftruncate(res->fd, off + len) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+
+    void *block = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, res->fd, off);
+    if (block == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    res->block = block;
+    res->row   = 0;
+    return 0;
+}
+
+// Append a record, `values` holds one value per column in the order of the
+// header.
+static int
+rtn_result_append(rtn_result *res, const i64 *values)
+{
+    if (res->block == NULL && rtn_result_map_block(res) < 0)    return -1;
+
+    u32 block_size = res->hdr->block_size;
+    for (u32 c = 0; c < res->hdr->num_columns; c++)  res->block[(usize)c * block_size + res->row] = values[c];
+
+    res->row              += 1;
+    res->hdr->num_records += 1;
+
+    // the block is complete: unmap it (the page cache writes it back) and
+    // publish its records
+    if (res->row == block_size) {
+        munmap(res->block, rtn_result_block_bytes(res->hdr));
+        res->block      = NULL;
+        res->block_idx += 1;
+        return rtn_result_write_header(res);
+    }
+
+    return 0;
+}
+
+// Write the header with the final number of records and close the file.
+static int
+rtn_result_close(rtn_result *res)
+{
+    int ret = 0;
+    if (res->block) {
+        munmap(res->block, rtn_result_block_bytes(res->hdr));
+
+        // drop the unused part of the last column
+        usize used = ((usize)(res->hdr->num_columns - 1) * res->hdr->block_size + res->row) * sizeof(i64);
+        if (ftruncate(res->fd, rtn_result_block_offset(res->hdr, res->block_idx) + used) < 0) {
+            perror("ftruncate");
+            ret = -1;
+        }
+    }
+
+    if (rtn_result_write_header(res) < 0)   ret = -1;
+
+    close(res->fd);
+    free(res->hdr);
+    free(res);
+    return ret;
+}
+
+// ## Reader
+
+typedef struct rtn_result_reader rtn_result_reader;
+struct rtn_result_reader
+{
+    const rtn_result_header *hdr;
+    const u8                *data;
+    usize                    size;
+    u64                      num_records;   // records fully present in the file
+};
+
+static int
+rtn_result_open(rtn_result_reader *reader, const char *path)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (usize)st.st_size < sizeof(rtn_result_header)) {
+        fprintf(stderr, "%s: not a results file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    reader->data = data;
+    reader->size = st.st_size;
+    reader->hdr  = data;
+
+    const rtn_result_header *hdr = reader->hdr;
+    if (memcmp(hdr->magic, RTN_RESULT_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != RTN_RESULT_VERSION ||
+        hdr->num_columns == 0 || hdr->num_columns > RTN_RESULT_MAX_COLUMNS || hdr->block_size == 0) {
+        fprintf(stderr, "%s: not a results file (version %d)\n", path, RTN_RESULT_VERSION);
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    // a file still being written may be ahead of its header, a truncated
+    // one behind it: keep the records whose last column is in the file
+    u64 num_records = hdr->num_records;
+    while (num_records > 0) {
+        u64 last = num_records - 1;
+        usize end = rtn_result_block_offset(hdr, last / hdr->block_size)
+                  + ((usize)(hdr->num_columns - 1) * hdr->block_size + last % hdr->block_size + 1) * sizeof(i64);
+        if (end <= reader->size)    break;
+        num_records = last / hdr->block_size * hdr->block_size;
+    }
+    reader->num_records = num_records;
+
+    return 0;
+}
+
+static void
+rtn_result_reader_close(rtn_result_reader *reader)
+{
+    munmap((void *)reader->data, reader->size);
+}
+
+// Value of column `col` (index in the header) of record `row`.
+static inline i64
+rtn_result_get(const rtn_result_reader *reader, u64 row, u32 col)
+{
+    const rtn_result_header *hdr = reader->hdr;
+    const i64 *block = (const i64 *)(reader->data + rtn_result_block_offset(hdr, row / hdr->block_size));
+    return block[(usize)col * hdr->block_size + row % hdr->block_size];
+}
+
+#endif // RTN_RESULT_H
@@ -0,0 +1,137 @@
+#ifndef RTN_RING_H
+#define RTN_RING_H
+
+#include "rtn_base.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # SPSC Ring
+//
+// Bounded single-producer/single-consumer ring of fixed-size records, used to
+// hand the per-packet stats from the RT loop to a low priority consumer. The
+// producer never blocks: when the ring is full the record is dropped and
+// counted. Producer and consumer indexes live on separate cache lines, each
+// side keeps a cached copy of the other index so the shared line is only read
+// when the cached view says full/empty.
+//
+// Producer:                               Consumer:
+//     rec = rtn_ring_reserve(ring);           while ((rec = rtn_ring_peek(ring))) {
+//     if (rec) {                                  ...
+//         ...                                     rtn_ring_release(ring);
+//         rtn_ring_commit(ring);              }
+//     }
+//     rtn_ring_close(ring);
+
+#define RTN_RING_CACHELINE 64
+
+typedef struct rtn_ring rtn_ring;
+struct rtn_ring
+{
+    // producer side
+    u64  head __attribute__((aligned(RTN_RING_CACHELINE)));
+    u64  cached_tail;
+    u64  num_dropped;       // records lost because the ring was full, read by the consumer
+    bool closed;            // no more records will be committed
+
+    // consumer side
+    u64  tail __attribute__((aligned(RTN_RING_CACHELINE)));
+    u64  cached_head;
+
+    // read only
+    u8  *buf __attribute__((aligned(RTN_RING_CACHELINE)));
+    u32  size;              // number of records, power of 2
+    u32  mask;
+    u32  elem_size;
+};
+
+static rtn_ring *
+rtn_ring_new(u32 size, u32 elem_size)
+{
+    if (size == 0 || (size & (size - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    rtn_ring *ring = NULL;
+    if (posix_memalign((void **)&ring, RTN_RING_CACHELINE, sizeof(rtn_ring)) != 0)  return NULL;
+    memset(ring, 0, sizeof(rtn_ring));
+
+    // page aligned (records cache line aligned when their size allows it),
+    // zeroed and prefaulted: the producer never faults on a record
+    ring->buf = os_vm_alloc((usize)size * elem_size);
+    if (ring->buf == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->size      = size;
+    ring->mask      = size - 1;
+    ring->elem_size = elem_size;
+    return ring;
+}
+
+static void
+rtn_ring_destroy(rtn_ring *ring)
+{
+    os_vm_free(ring->buf, (usize)ring->size * ring->elem_size);
+    free(ring);
+}
+
+// ## Producer
+
+// Next free record or NULL (counted as dropped) when the ring is full. The
+// record is published by `rtn_ring_commit`, until then it can be reused.
+static inline void *
+rtn_ring_reserve(rtn_ring *ring)
+{
+    if (ring->head - ring->cached_tail == ring->size) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring->head - ring->cached_tail == ring->size) {
+            __atomic_store_n(&ring->num_dropped, ring->num_dropped + 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    return ring->buf + (usize)(ring->head & ring->mask) * ring->elem_size;
+}
+
+static inline void
+rtn_ring_commit(rtn_ring *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// No more records: the consumer can stop once the ring is empty.
+static inline void
+rtn_ring_close(rtn_ring *ring)
+{
+    __atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+}
+
+// ## Consumer
+
+// Oldest published record or NULL when the ring is empty.
+static inline void *
+rtn_ring_peek(rtn_ring *ring)
+{
+    if (ring->tail == ring->cached_head) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail == ring->cached_head)    return NULL;
+    }
+
+    return ring->buf + (usize)(ring->tail & ring->mask) * ring->elem_size;
+}
+
+static inline void
+rtn_ring_release(rtn_ring *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Check it before draining the ring: all the records are visible once it is set.
+static inline bool
+rtn_ring_is_closed(rtn_ring *ring)
+{
+    return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+}
+
+#endif // RTN_RING_H
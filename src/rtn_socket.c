@@ -9,6 +9,34 @@ init_ifreq(struct ifreq *ifr, void *data, const char *ifname)
     ifr->ifr_data = data;
 }
 
+// Index of the PTP hardware clock of the interface (/dev/ptpN), -1 when it
+// has none.
+static int
+rtn_socket_phc_index(const char *ifname)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct ethtool_ts_info ts_info;
+    memset(&ts_info, 0, sizeof(ts_info));
+    ts_info.cmd = ETHTOOL_GET_TS_INFO;
+
+    struct ifreq ifr;
+    init_ifreq(&ifr, &ts_info, ifname);
+    int res = ioctl(sockfd, SIOCETHTOOL, &ifr);
+    close(sockfd);
+
+    if (res < 0) {
+        perror("ioctl(SIOCETHTOOL)");
+        return -1;
+    }
+
+    return ts_info.phc_index;
+}
+
 static int
 rtn_socket_check_timestamping(int sockfd, const char *ifname) 
 {
@@ -147,6 +175,16 @@ rtn_socket_new(const char *ifname, int port, rtn_socket_type type)
 {   
     int res = 0;
 
+    if (type == RTN_SOCK_TYPE_XDP) {
+        rtn_xdp_config cfg = { .queue_id = 0, .mode = RTN_XDP_MODE_GENERIC };
+        return rtn_socket_new_xdp(ifname, port, &cfg);
+    }
+
+    if (type == RTN_SOCK_TYPE_RAW || type == RTN_SOCK_TYPE_MMAP) {
+        rtn_raw_config cfg = { .ethertype = RTN_RAW_ETHERTYPE_DEFAULT, .vlan_id = -1 };
+        return type == RTN_SOCK_TYPE_RAW ? rtn_socket_new_raw(ifname, &cfg) : rtn_socket_new_mmap(ifname, &cfg);
+    }
+
     int socktype = s_rtn_socket_type_flags[type];
     fprintf(stderr, "[debug] Opening socket type %s\n", s_rtn_socket_type_str[type]);
 
@@ -156,19 +194,10 @@ rtn_socket_new(const char *ifname, int port, rtn_socket_type type)
         goto exit_socket_error;
     }
 
-    struct sockaddr_in addr = {
-        .sin_family      = AF_INET,
-        .sin_port        = htons(port),
-        .sin_addr.s_addr = INADDR_ANY,
-    };
-
-    res = bind(sockfd, (struct sockaddr *)&addr, sizeof(addr));
-    if (res < 0) {
-        perror("bind");
-        goto exit_cleanup;
-    }
-
-    // resuse address
+    // resuse address and bind to the device before the bind: the sockets
+    // bound to the same port with SO_REUSEPORT form a group (see
+    // rtn_socket_attach_reuseport_cpu), binding to a device later moves the
+    // socket out of it
     int optval = 1;
     res = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
     if (res < 0) {
@@ -192,10 +221,23 @@ rtn_socket_new(const char *ifname, int port, rtn_socket_type type)
         }
     }
 
-    rtn_socket *sock = malloc(sizeof(rtn_socket));
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(port),
+        .sin_addr.s_addr = INADDR_ANY,
+    };
+
+    res = bind(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+    if (res < 0) {
+        perror("bind");
+        goto exit_cleanup;
+    }
+
+    rtn_socket *sock = calloc(1, sizeof(rtn_socket));
     sock->fd     = sockfd;
     sock->port   = port;
     sock->ifname = ifname;
+    sock->type   = type;
     return sock;
 
 exit_cleanup:
@@ -204,59 +246,425 @@ exit_socket_error:
     return NULL;
 }
 
+static rtn_socket *
+rtn_socket_new_xdp(const char *ifname, int port, const rtn_xdp_config *cfg)
+{
+    fprintf(stderr, "[debug] Opening socket type %s\n", s_rtn_socket_type_str[RTN_SOCK_TYPE_XDP]);
+
+    rtn_xsk *xsk = rtn_xsk_new(ifname, port, cfg);
+    if (xsk == NULL)    return NULL;
+
+    rtn_socket *sock = calloc(1, sizeof(rtn_socket));
+    if (sock == NULL) {
+        perror("calloc");
+        rtn_xsk_destroy(xsk);
+        return NULL;
+    }
+
+    sock->fd     = xsk->fd;
+    sock->port   = port;
+    sock->ifname = ifname;
+    sock->type   = RTN_SOCK_TYPE_XDP;
+    sock->xsk    = xsk;
+    return sock;
+}
+
+// Raw layer 2 socket: frames carry a handcrafted Ethernet header (optionally
+// 802.1Q tagged) followed directly by the payload, no IP/UDP.
+static rtn_socket *
+rtn_socket_new_raw(const char *ifname, const rtn_raw_config *cfg)
+{
+    fprintf(stderr, "[debug] Opening socket type %s (ethertype 0x%04x)\n", s_rtn_socket_type_str[RTN_SOCK_TYPE_RAW], cfg->ethertype);
+
+    int ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        perror("if_nametoindex");
+        return NULL;
+    }
+
+    int sockfd = socket(AF_PACKET, SOCK_RAW, htons(cfg->ethertype));
+    if (sockfd == -1) {
+        perror("socket(AF_PACKET)");
+        return NULL;
+    }
+
+    struct sockaddr_ll addr = {
+        .sll_family   = AF_PACKET,
+        .sll_protocol = htons(cfg->ethertype),
+        .sll_ifindex  = ifindex,
+    };
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind(AF_PACKET)");
+        close(sockfd);
+        return NULL;
+    }
+
+    rtn_socket *sock = calloc(1, sizeof(rtn_socket));
+    if (sock == NULL) {
+        perror("calloc");
+        close(sockfd);
+        return NULL;
+    }
+
+    sock->fd     = sockfd;
+    sock->port   = 0;
+    sock->ifname = ifname;
+    sock->type   = RTN_SOCK_TYPE_RAW;
+    sock->raw    = *cfg;
+    return sock;
+}
+
+// Raw layer 2 socket with PACKET_MMAP (TPACKET_V3) RX and TX rings, same
+// framing of RTN_SOCK_TYPE_RAW.
+static rtn_socket *
+rtn_socket_new_mmap(const char *ifname, const rtn_raw_config *cfg)
+{
+    rtn_socket *sock = rtn_socket_new_raw(ifname, cfg);
+    if (sock == NULL)   return NULL;
+
+    fprintf(stderr, "[debug] Mapping TPACKET_V3 rings (%d blocks of %d bytes)\n", RTN_TPACKET_BLOCK_NR, RTN_TPACKET_BLOCK_SIZE);
+
+    sock->ring = rtn_tpacket_new(sock->fd);
+    if (sock->ring == NULL) {
+        rtn_socket_destroy(sock);
+        return NULL;
+    }
+
+    sock->type = RTN_SOCK_TYPE_MMAP;
+    return sock;
+}
+
+// Build the Ethernet header template and the sockaddr_ll used by sendmsg.
+// The destination MAC comes from the configuration or, when missing, from the
+// neighbour entry of the destination IP.
+static int
+rtn_socket_raw_set_dest(rtn_socket *sock, const struct sockaddr_in *daddr)
+{
+    u8 smac[ETH_ALEN], dmac[ETH_ALEN];
+    if (rtn_if_get_hwaddr(sock->fd, sock->ifname, smac) < 0)  return -1;
+
+    if (sock->raw.dst_mac) {
+        if (rtn_mac_from_str(sock->raw.dst_mac, dmac) < 0) {
+            fprintf(stderr, "Invalid destination MAC address: %s\n", sock->raw.dst_mac);
+            return -1;
+        }
+    } else if (rtn_neigh_resolve(sock->ifname, daddr->sin_addr, dmac) < 0) {
+        fprintf(stderr, "Cannot resolve the MAC address of %s, pass it explicitly\n", inet_ntoa(daddr->sin_addr));
+        return -1;
+    }
+
+    rtn_frame_tmpl_init_eth(&sock->tmpl, smac, dmac, sock->raw.ethertype, sock->raw.vlan_id, sock->raw.vlan_pcp);
+
+    struct sockaddr_ll *sll = (struct sockaddr_ll *)&sock->daddr;
+    memset(sll, 0, sizeof(*sll));
+    sll->sll_family   = AF_PACKET;
+    sll->sll_protocol = htons(sock->raw.ethertype);
+    sll->sll_ifindex  = if_nametoindex(sock->ifname);
+    sll->sll_halen    = ETH_ALEN;
+    memcpy(sll->sll_addr, dmac, ETH_ALEN);
+    sock->daddr_len = sizeof(*sll);
+
+    return 0;
+}
+
+// Remove the Ethernet header in front of a received raw frame. The kernel
+// normally strips the VLAN tag (it ends up in the packet auxdata), when it
+// does not the tag is still in front of the payload and has to be skipped.
+static inline int
+rtn_socket_raw_strip(const u8 *hdr, u8 *data, int res)
+{
+    if (res < ETH_HLEN)     return -1;
+
+    int len = res - ETH_HLEN;
+    u16 proto;
+    memcpy(&proto, hdr + 2 * ETH_ALEN, sizeof(proto));
+    if (proto == htons(ETH_P_8021Q) && len >= RTN_VLAN_HLEN) {
+        len -= RTN_VLAN_HLEN;
+        memmove(data, data + RTN_VLAN_HLEN, len);
+    }
+
+    return len;
+}
+
+static int
+rtn_socket_enable_uring(rtn_socket *sock, const rtn_uring_config *cfg)
+{
+    if (sock->type != RTN_SOCK_TYPE_UDP && sock->type != RTN_SOCK_TYPE_RAW) {
+        fprintf(stderr, "io_uring engine not available on %s sockets\n", s_rtn_socket_type_str[sock->type]);
+        return -1;
+    }
+
+    sock->uring = rtn_uring_new(sock->fd, cfg);
+    return sock->uring ? 0 : -1;
+}
+
 static void 
 rtn_socket_destroy(rtn_socket *sock)
 {
-    close(sock->fd);
+    if (sock->uring) rtn_uring_destroy(sock->uring);
+    if (sock->ring)  rtn_tpacket_destroy(sock->ring);
+
+    if (sock->xsk)  rtn_xsk_destroy(sock->xsk);
+    else            close(sock->fd);
     free(sock);
 }
 
+static rtn_socket_batch *
+rtn_socket_batch_new(usize size, usize bufsize)
+{
+    rtn_socket_batch *batch = calloc(1, sizeof(rtn_socket_batch));
+    if (batch == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    // keep every payload cache line aligned, so the `payload_t` header of
+    // each message can be written without unaligned accesses
+    batch->stride = (bufsize + 63) & ~(usize)63;
+    batch->size   = size;
+    batch->msgs   = calloc(size, sizeof(struct mmsghdr));
+    batch->iovs   = calloc(2 * size, sizeof(struct iovec));
+    batch->bufs   = aligned_alloc(64, size * batch->stride);
+    batch->control = calloc(size, RTN_SOCKET_CONTROL_SIZE);
+    batch->hdrs   = calloc(size, ETH_HLEN);
+    batch->names  = calloc(size, sizeof(struct sockaddr_storage));
+    if (batch->msgs == NULL || batch->iovs == NULL || batch->bufs == NULL || batch->control == NULL || batch->hdrs == NULL ||
+        batch->names == NULL) {
+        perror("alloc");
+        rtn_socket_batch_destroy(batch);
+        return NULL;
+    }
+
+    memset(batch->bufs, 0, size * batch->stride);
+
+    for (usize i = 0; i < size; i++) {
+        batch->iovs[2*i + 1].iov_base = rtn_socket_batch_buf(batch, i);
+        batch->iovs[2*i + 1].iov_len  = bufsize;
+
+        batch->msgs[i].msg_hdr.msg_iov    = &batch->iovs[2*i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    return batch;
+}
+
+static void
+rtn_socket_batch_destroy(rtn_socket_batch *batch)
+{
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->bufs);
+    free(batch->control);
+    free(batch->hdrs);
+    free(batch->names);
+    free(batch);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // # Receive and Send
+static void
+rtn_socket_parse_rx_timestamps(struct msghdr *mhdr, rtn_pkt_stat *pstat)
+{
+    struct scm_timestamping *scm_ts = NULL;
+    struct cmsghdr *cmsg            = NULL;
+    for (cmsg = CMSG_FIRSTHDR(mhdr); cmsg != NULL; cmsg = CMSG_NXTHDR(mhdr, cmsg)) 
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) {
+            scm_ts = (struct scm_timestamping *)CMSG_DATA(cmsg);
+
+            i64 sw = scm_ts->ts[0].tv_sec * NSEC_PER_SEC + scm_ts->ts[0].tv_nsec;
+            i64 hw = scm_ts->ts[2].tv_sec * NSEC_PER_SEC + scm_ts->ts[2].tv_nsec;
+
+            pstat->rx_tstamps.hw_ts = hw;
+            pstat->rx_tstamps.sw_ts = sw;
+        }
+    }   
+}
+
+// Attach the launch time (SCM_TXTIME, CLOCK_TAI) of the next packet, the
+// control buffer must hold at least CMSG_SPACE(sizeof(u64)) bytes.
+static inline void
+rtn_socket_put_txtime(rtn_socket *sock, struct msghdr *msg, void *control)
+{
+    msg->msg_control    = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(u64));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_TXTIME;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(u64));
+
+    memcpy(CMSG_DATA(cmsg), &sock->txtime, sizeof(u64));
+}
+
 static int
 rtn_socket_send_message(rtn_socket *sock, void *data, usize datasize, int flags)
 {
-    struct iovec iov = {
-        .iov_base = data,
-        .iov_len  = datasize,
+    return rtn_socket_send_to(sock, data, datasize, NULL, flags);
+}
+
+static int
+rtn_socket_send_to(rtn_socket *sock, void *data, usize datasize, const struct sockaddr_storage *dst, int flags)
+{
+    if (sock->type == RTN_SOCK_TYPE_XDP)    return rtn_xsk_send(sock->xsk, data, datasize, flags);
+    if (sock->type == RTN_SOCK_TYPE_MMAP)   return rtn_tpacket_send(sock->ring, &sock->tmpl, data, datasize, flags);
+
+    // only UDP sockets can reach another IPv4 address than the destination
+    const struct sockaddr_storage *daddr = &sock->daddr;
+    socklen_t daddr_len                  = sock->daddr_len;
+    if (dst && dst->ss_family == AF_INET && sock->type == RTN_SOCK_TYPE_UDP) {
+        daddr     = dst;
+        daddr_len = sizeof(struct sockaddr_in);
+    }
+
+    // raw sockets send the precomputed link layer header in front of the payload
+    struct iovec iov[2] = {
+        { .iov_base = sock->tmpl.hdr, .iov_len = sock->tmpl.hdr_len },
+        { .iov_base = data,           .iov_len = datasize           },
     };
     struct msghdr msg = {
-        .msg_name    = &sock->daddr,
-        .msg_namelen = sock->daddr_len,
-        .msg_iov     = &iov,
-        .msg_iovlen  = 1,
+        .msg_name    = (void *)daddr,
+        .msg_namelen = daddr_len,
+        .msg_iov     = iov,
+        .msg_iovlen  = 2,
     };
 
     char control[128] = {0};
-    if (sock->use_txtime) {
-        msg.msg_control    = control;
-        msg.msg_controllen = sizeof(control);
+    if (sock->use_txtime)   rtn_socket_put_txtime(sock, &msg, control);
+
+    int res;
+    if (sock->uring)    res = rtn_uring_send(sock->uring, iov, 2, daddr, daddr_len, msg.msg_control, msg.msg_controllen, flags);
+    else                res = sendmsg(sock->fd, &msg, flags);
+
+    return res > 0 ? res - (int)sock->tmpl.hdr_len : res;
+}
+
+static int
+rtn_socket_send_batch(rtn_socket *sock, rtn_socket_batch *batch, usize count, usize datasize, int flags)
+{
+    if (count > batch->size)    count = batch->size;
+
+    if (sock->type == RTN_SOCK_TYPE_XDP) {
+        // queue the whole batch in the TX ring, wake up the kernel once
+        for (usize i = 0; i < count; i++) {
+            int more = i + 1 < count ? MSG_MORE : 0;
+            if (rtn_xsk_send(sock->xsk, rtn_socket_batch_buf(batch, i), datasize, flags | more) < 0) {
+                return i > 0 ? (int)i : -1;
+            }
+        }
+        return count;
+    }
+
+    if (sock->type == RTN_SOCK_TYPE_MMAP) {
+        // fill the TX ring, a single send() flushes the whole batch
+        for (usize i = 0; i < count; i++) {
+            int more = i + 1 < count ? MSG_MORE : 0;
+            if (rtn_tpacket_send(sock->ring, &sock->tmpl, rtn_socket_batch_buf(batch, i), datasize, flags | more) < 0) {
+                if (i > 0)  send(sock->fd, NULL, 0, MSG_DONTWAIT);
+                return i > 0 ? (int)i : -1;
+            }
+        }
+        return count;
+    }
+
+    if (sock->uring) {
+        // one SENDMSG request per message, submitted together
+        for (usize i = 0; i < count; i++) {
+            int more = i + 1 < count ? MSG_MORE : 0;
+            if (rtn_socket_send_message(sock, rtn_socket_batch_buf(batch, i), datasize, flags | more) < 0) {
+                return i > 0 ? (int)i : -1;
+            }
+        }
+        return count;
+    }
+
+    for (usize i = 0; i < count; i++) {
+        struct msghdr *msg = &batch->msgs[i].msg_hdr;
+        msg->msg_name      = &sock->daddr;
+        msg->msg_namelen   = sock->daddr_len;
+        msg->msg_control    = NULL;
+        msg->msg_controllen = 0;
+        batch->iovs[2*i].iov_base     = sock->tmpl.hdr;
+        batch->iovs[2*i].iov_len      = sock->tmpl.hdr_len;
+        batch->iovs[2*i + 1].iov_len  = datasize;
+
+        // the whole burst shares the same launch time
+        if (sock->use_txtime)   rtn_socket_put_txtime(sock, msg, batch->control + i * RTN_SOCKET_CONTROL_SIZE);
+    }
+
+    // sendmmsg may stop early (e.g. the socket buffer is full), in that case
+    // push the remaining messages so that the OPT_ID sequence has no holes.
+    usize sent = 0;
+    while (sent < count) {
+        int res = sendmmsg(sock->fd, &batch->msgs[sent], count - sent, flags);
+        if (res < 0) {
+            if (errno == EINTR)     continue;
+            return sent > 0 ? (int)sent : -1;
+        }
+
+        sent += res;
+    }
+
+    return sent;
+}
 
-        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-        cmsg->cmsg_level = SOL_SOCKET;
-        cmsg->cmsg_type  = SCM_TXTIME;
-        cmsg->cmsg_len   = CMSG_LEN(sizeof(u64));
+// Copy a message received by the io_uring engine out of its provided buffer,
+// same result of the recvmsg path.
+static int
+rtn_socket_receive_uring(rtn_socket *sock, void *data, usize datasize, rtn_pkt_stat *pstat, int flags)
+{
+    rtn_uring_msg msg;
+    int res = rtn_uring_receive(sock->uring, &msg, flags);
+    if (res < 0)    return res;
 
-        *((u64 *)CMSG_DATA(cmsg)) = sock->txtime;
+    usize hlen = sock->type == RTN_SOCK_TYPE_RAW ? ETH_HLEN : 0;
+    if ((usize)msg.len < hlen) {
+        rtn_uring_release(sock->uring, &msg);
+        return -1;
     }
 
-    return sendmsg(sock->fd, &msg, flags);   
+    usize len = msg.len - hlen;
+    if (len > datasize)     len = datasize;
+    memcpy(data, msg.data + hlen, len);
+
+    res = len;
+    if (pstat)  rtn_socket_parse_rx_timestamps(&msg.hdr, pstat);
+    if (hlen)   res = rtn_socket_raw_strip(msg.data, data, hlen + len);
+
+    rtn_uring_release(sock->uring, &msg);
+    return res;
 }
 
 static int
 rtn_socket_receive_message(rtn_socket *sock, void *data, usize datasize, rtn_pkt_stat *pstat, int flags)
 {
-    struct sockaddr_in addr;
+    return rtn_socket_receive_from(sock, data, datasize, pstat, flags, NULL);
+}
+
+static int
+rtn_socket_receive_from(rtn_socket *sock, void *data, usize datasize, rtn_pkt_stat *pstat, int flags, struct sockaddr_storage *src)
+{
+    struct sockaddr_storage addr = { .ss_family = AF_UNSPEC };
     socklen_t addrlen = sizeof(addr);
-    struct iovec iov = {
-        .iov_base = data,
-        .iov_len  = datasize,
+    if (src)    *src = addr;
+
+    if (sock->type == RTN_SOCK_TYPE_XDP)    return rtn_xsk_receive(sock->xsk, data, datasize, flags);
+    if (sock->type == RTN_SOCK_TYPE_MMAP)   return rtn_tpacket_receive(sock->ring, data, datasize, pstat, flags);
+
+    if (sock->uring)                        return rtn_socket_receive_uring(sock, data, datasize, pstat, flags);
+
+    // raw sockets receive the Ethernet header in front of the payload
+    u8 hdr[ETH_HLEN];
+    bool raw = sock->type == RTN_SOCK_TYPE_RAW;
+    struct iovec iov[2] = {
+        { .iov_base = hdr,  .iov_len = raw ? ETH_HLEN : 0 },
+        { .iov_base = data, .iov_len = datasize           },
     };
     struct msghdr mhdr = {
         .msg_name    = &addr,
         .msg_namelen = addrlen,
-        .msg_iov     = &iov,
-        .msg_iovlen  = 1,
+        .msg_iov     = iov,
+        .msg_iovlen  = 2,
     };
 
     char control[128] = {0};
@@ -267,26 +675,94 @@ rtn_socket_receive_message(rtn_socket *sock, void *data, usize datasize, rtn_pkt
     }
     
     int res = recvmsg(sock->fd, &mhdr, flags);
-    if (res > 0 && pstat) {        
-        struct scm_timestamping *scm_ts = NULL;
-        struct cmsghdr *cmsg            = NULL;
-        for (cmsg = CMSG_FIRSTHDR(&mhdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&mhdr, cmsg)) 
-        {
-            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) {
-                scm_ts = (struct scm_timestamping *)CMSG_DATA(cmsg);
-
-                i64 sw = scm_ts->ts[0].tv_sec * NSEC_PER_SEC + scm_ts->ts[0].tv_nsec;
-                i64 hw = scm_ts->ts[2].tv_sec * NSEC_PER_SEC + scm_ts->ts[2].tv_nsec;
-
-                pstat->rx_tstamps.hw_ts = hw;
-                pstat->rx_tstamps.sw_ts = sw;
-            }
-        }   
+    if (res > 0 && pstat)   rtn_socket_parse_rx_timestamps(&mhdr, pstat);
+    if (res >= 0 && pstat)  pstat->flow = rtn_socket_flow_key(&addr);
+    if (res >= 0 && src)    *src = addr;
+    if (res >= 0 && raw)    res = rtn_socket_raw_strip(hdr, data, res);
+
+    return res;
+}
+
+static int
+rtn_socket_receive_batch(rtn_socket *sock, rtn_socket_batch *batch, usize count, rtn_pkt_stat *pstats, int flags)
+{
+    if (count > batch->size)    count = batch->size;
+
+    if (sock->type == RTN_SOCK_TYPE_XDP) {
+        // wait for the first frame, then take what is already in the RX ring
+        int res = 0;
+        for (usize i = 0; i < count; i++) {
+            int len = rtn_xsk_receive(sock->xsk, rtn_socket_batch_buf(batch, i), batch->stride, i > 0 ? MSG_DONTWAIT : flags);
+            if (len < 0)    break;
+
+            batch->msgs[i].msg_len = len;
+            res += 1;
+        }
+        return res > 0 ? res : -1;
+    }
+
+    if (sock->type == RTN_SOCK_TYPE_MMAP || sock->uring) {
+        // walk the current block (or the reaped completions), waiting only
+        // for the first message
+        int res = 0;
+        for (usize i = 0; i < count; i++) {
+            rtn_pkt_stat *pstat = pstats ? &pstats[i] : NULL;
+            int rx_flags = i > 0 ? MSG_DONTWAIT : flags;
+            int len = sock->uring ? rtn_socket_receive_uring(sock, rtn_socket_batch_buf(batch, i), batch->stride, pstat, rx_flags)
+                                  : rtn_tpacket_receive(sock->ring, rtn_socket_batch_buf(batch, i), batch->stride, pstat, rx_flags);
+            if (len < 0)    break;
+
+            batch->msgs[i].msg_len = len;
+            res += 1;
+        }
+        return res > 0 ? res : -1;
+    }
+
+    for (usize i = 0; i < count; i++) {
+        struct msghdr *msg = &batch->msgs[i].msg_hdr;
+        msg->msg_name       = &batch->names[i];
+        msg->msg_namelen    = sizeof(batch->names[i]);
+        msg->msg_control    = pstats ? batch->control + i * RTN_SOCKET_CONTROL_SIZE : NULL;
+        msg->msg_controllen = pstats ? RTN_SOCKET_CONTROL_SIZE : 0;
+        msg->msg_flags      = 0;
+        batch->iovs[2*i].iov_base    = batch->hdrs + i * ETH_HLEN;
+        batch->iovs[2*i].iov_len     = sock->type == RTN_SOCK_TYPE_RAW ? ETH_HLEN : 0;
+        batch->iovs[2*i + 1].iov_len = batch->stride;
+    }
+
+    // block only until the first datagram is there, then drain what is
+    // already queued without waiting for the batch to fill up
+    if (!(flags & MSG_DONTWAIT))    flags |= MSG_WAITFORONE;
+
+    int res = recvmmsg(sock->fd, batch->msgs, count, flags, NULL);
+    if (res > 0 && pstats) {
+        for (int i = 0; i < res; i++) {
+            rtn_socket_parse_rx_timestamps(&batch->msgs[i].msg_hdr, &pstats[i]);
+            pstats[i].flow = rtn_socket_flow_key(&batch->names[i]);
+        }
+    }
+
+    if (res > 0 && sock->type == RTN_SOCK_TYPE_RAW) {
+        for (int i = 0; i < res; i++) {
+            batch->msgs[i].msg_len = rtn_socket_raw_strip(batch->hdrs + i * ETH_HLEN, rtn_socket_batch_buf(batch, i), batch->msgs[i].msg_len);
+        }
     }
 
     return res;
 }
 
+static int
+rtn_socket_poll(rtn_socket *sock, i64 timeout_ns)
+{
+    // round up, a 0 ms timeout would busy-loop the callers
+    int timeout_ms = timeout_ns <= 0 ? 0 : (int)((timeout_ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+
+    if (sock->uring)    return rtn_uring_poll(sock->uring, timeout_ms);
+
+    struct pollfd pfd = { .fd = sock->fd, .events = POLLIN };
+    return poll(&pfd, 1, timeout_ms);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // # Options
 static int
@@ -305,12 +781,20 @@ rnt_socket_set_priority(rtn_socket *sock, int prio)
     return res;
 }
 
+// Enable SCM_TXTIME launch times on CLOCK_TAI (ETF qdisc). Packets dropped
+// by the qdisc (launch time in the past, invalid parameters) are reported on
+// the error queue with SO_EE_ORIGIN_TXTIME.
 static int 
 rtn_socket_opt_set_txtimestamp(rtn_socket *sock)
 {
+    if (sock->type != RTN_SOCK_TYPE_UDP && sock->type != RTN_SOCK_TYPE_RAW) {
+        fprintf(stderr, "SO_TXTIME not available on %s sockets\n", s_rtn_socket_type_str[sock->type]);
+        return -1;
+    }
+
     struct sock_txtime sk_txtime = {
         .clockid = CLOCK_TAI,
-        .flags   = 0,
+        .flags   = SOF_TXTIME_REPORT_ERRORS,
     };
 
     int res = setsockopt(sock->fd, SOL_SOCKET, SO_TXTIME, &sk_txtime, sizeof(sk_txtime));
@@ -323,14 +807,110 @@ rtn_socket_opt_set_txtimestamp(rtn_socket *sock)
     return res;
 }
 
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL     69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET     70
+#endif
+
+// Busy poll the NIC queue for up to `usecs` in the receive calls instead of
+// sleeping until the interrupt, and keep the interrupts of the queue off while
+// the application polls (SO_PREFER_BUSY_POLL, Linux 5.11). Needs
+// CAP_NET_ADMIN above net.core.busy_read.
+static int
+rtn_socket_set_busy_poll(rtn_socket *sock, int usecs)
+{
+    if (sock->type == RTN_SOCK_TYPE_XDP) {
+        fprintf(stderr, "SO_BUSY_POLL not available on %s sockets\n", s_rtn_socket_type_str[sock->type]);
+        return -1;
+    }
+
+    int res = setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+    if (res < 0) {
+        perror("setsockopt(SO_BUSY_POLL)");
+        return -1;
+    }
+
+    // optional, older kernels only busy poll
+    int opt = 1;
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_PREFER_BUSY_POLL)");
+    }
+
+    opt = 64;
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_BUSY_POLL_BUDGET)");
+    }
+
+    return 0;
+}
+
+// Receive calls fail with EAGAIN after `timeout_ns` without a packet, 0 to
+// block.
+static int
+rtn_socket_set_rcv_timeout(rtn_socket *sock, i64 timeout_ns)
+{
+    struct timeval tv = { .tv_sec = timeout_ns / NSEC_PER_SEC, .tv_usec = (timeout_ns % NSEC_PER_SEC) / 1000 };
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt(SO_RCVTIMEO)");
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF    51
+#endif
+
+// Steer the packets of a SO_REUSEPORT group by the CPU that processes them
+// (the CPU of the RX queue interrupt with RSS, or the one picked by RPS):
+// socket `i` of the group, in bind order, receives what `cpus[i]` processes,
+// the other CPUs are spread with cpu % count. Without the program the kernel
+// picks the socket with a hash of the flow, whatever the CPU.
+//
+//     ld  #cpu
+//     jeq #cpus[0], ret #0
+//     ...
+//     mod #count
+//     ret a
+static int
+rtn_socket_attach_reuseport_cpu(rtn_socket *sock, const int *cpus, int count)
+{
+    struct sock_filter code[2 * RTN_SOCKET_REUSEPORT_MAX + 3];
+    int n = 0;
+
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < count; i++) {
+        code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog prog = { .len = n, .filter = code };
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        return -1;
+    }
+
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // # Timestamping
 static int 
-rtn_socket_enable_timestamping(rtn_socket *sock, const char *ifname)
+rtn_socket_enable_timestamping(rtn_socket *sock, const char *ifname, bool tx_timestamps)
 {
     int res, opt;
     int sockfd = sock->fd;
 
+    if (!rtn_socket_has_timestamps(sock)) {
+        fprintf(stderr, "[debug] Timestamping not available on %s sockets\n", s_rtn_socket_type_str[sock->type]);
+        return -1;
+    }
+
     int ts_flags = SOF_TIMESTAMPING_RX_HARDWARE     // [GF] network adapter provides hardware timestamps at receive
                  | SOF_TIMESTAMPING_RX_SOFTWARE     // [GF] RX timestamp when data enters the kernel (just after the device driver has processed it)
                  | SOF_TIMESTAMPING_TX_HARDWARE     // [GF] network adapter provides hardware timestamps at transmit
@@ -339,7 +919,12 @@ rtn_socket_enable_timestamping(rtn_socket *sock, const char *ifname)
                  | SOF_TIMESTAMPING_SOFTWARE        // [RF] report any software timestamps
                  | SOF_TIMESTAMPING_RAW_HARDWARE    // [RF] report raw hardware timestamps
                  | SOF_TIMESTAMPING_OPT_ID          // [OF] include a unique identifier for each timestamp
-                 | SOF_TIMESTAMPING_OPT_TX_SWHW;    // [OF] report both software and hardware TX timestamps
+                 | SOF_TIMESTAMPING_OPT_TX_SWHW     // [OF] report both software and hardware TX timestamps
+                 | SOF_TIMESTAMPING_OPT_TSONLY;     // [OF] no copy of the packet in the error queue, only the timestamp
+
+    if (!tx_timestamps) {
+        ts_flags &= ~(SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_SCHED);
+    }
 
     res = setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags));
     if (res < 0) {
@@ -347,6 +932,15 @@ rtn_socket_enable_timestamping(rtn_socket *sock, const char *ifname)
         res = -1;
     }
 
+    // POLLPRI when a timestamp is queued, before the hardware timestamping
+    // that is not available on every interface
+    opt = 1;
+    res = setsockopt(sockfd, SOL_SOCKET, SO_SELECT_ERR_QUEUE, &opt, sizeof(opt));
+    if (res < 0) {
+        perror("setsockopt(SO_SELECT_ERR_QUEUE)");
+        return -1;
+    }
+
     int tx_type                   = HWTSTAMP_TX_ON;
     int rx_filter                 = HWTSTAMP_FILTER_ALL;
     struct hwtstamp_config config = { .tx_type = tx_type, .rx_filter = rx_filter };
@@ -359,13 +953,6 @@ rtn_socket_enable_timestamping(rtn_socket *sock, const char *ifname)
         return -1;
     }
 
-    opt = 1;
-    res = setsockopt(sockfd, SOL_SOCKET, SO_SELECT_ERR_QUEUE, &opt, sizeof(opt));
-    if (res < 0) {
-        perror("setsockopt(SO_SELECT_ERR_QUEUE)");
-        return -1;
-    }
-
     // check timestamping
     socklen_t optlen = sizeof(ts_flags);
     res = getsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, &optlen);
@@ -2,6 +2,10 @@
 #define RTN_SOCKET_H
 
 #include "rtn_base.h"
+#include "rtn_frame.h"
+#include "rtn_xdp.h"
+#include "rtn_tpacket.h"
+#include "rtn_uring.h"
 
 typedef struct rtn_pkt_stat rtn_pkt_stat;
 
@@ -10,57 +14,182 @@ typedef enum
     RTN_SOCK_TYPE_UDP,
     RTN_SOCK_TYPE_TCP,
     RTN_SOCK_TYPE_RAW,
+    RTN_SOCK_TYPE_XDP,
+    RTN_SOCK_TYPE_MMAP,
 } rtn_socket_type;
 
+// Raw Ethernet (AF_PACKET) configuration
+#define RTN_RAW_ETHERTYPE_DEFAULT   0x88b5  // IEEE 802 local experimental
+
+typedef struct rtn_raw_config rtn_raw_config;
+struct rtn_raw_config
+{
+    u16           ethertype;
+    int           vlan_id;      // -1: untagged
+    int           vlan_pcp;
+    const char   *dst_mac;      // NULL: resolve the destination IP from the neighbour table
+};
+
 static const char *s_rtn_socket_type_str[] = {
     [RTN_SOCK_TYPE_UDP] = "UDP",
     [RTN_SOCK_TYPE_TCP] = "TCP",
     [RTN_SOCK_TYPE_RAW] = "RAW",
+    [RTN_SOCK_TYPE_XDP] = "XDP",
+    [RTN_SOCK_TYPE_MMAP] = "MMAP",
 };
 
 static const int s_rtn_socket_type_flags[] = {
     [RTN_SOCK_TYPE_UDP] = SOCK_DGRAM,
     [RTN_SOCK_TYPE_TCP] = SOCK_STREAM,
     [RTN_SOCK_TYPE_RAW] = SOCK_RAW,
+    [RTN_SOCK_TYPE_XDP] = SOCK_RAW,
+    [RTN_SOCK_TYPE_MMAP] = SOCK_RAW,
 };
 
+static inline int
+rtn_socket_type_from_str(const char *str)
+{
+    for (usize i = 0; i < array_size(s_rtn_socket_type_str); i++) {
+        if (strcasecmp(str, s_rtn_socket_type_str[i]) == 0)  return i;
+    }
+
+    return -1;
+}
+
 typedef struct rtn_socket rtn_socket;
 struct rtn_socket
 {
     int fd;
     int port;
     const char *ifname;
+    rtn_socket_type type;
+
+    rtn_xsk     *xsk;       // only for RTN_SOCK_TYPE_XDP
+    rtn_tpacket *ring;      // only for RTN_SOCK_TYPE_MMAP
+    rtn_uring   *uring;     // io_uring engine, NULL for plain syscalls
 
-    struct sockaddr daddr;
-    socklen_t       daddr_len;
+    // only for RTN_SOCK_TYPE_RAW/MMAP: link layer header prepended to every payload
+    rtn_raw_config  raw;
+    rtn_frame_tmpl  tmpl;
 
-    // TxTime support
+    struct sockaddr_storage daddr;
+    socklen_t               daddr_len;
+
+    // TxTime support: launch time (CLOCK_TAI) of the next packet
     bool use_txtime;
     u64  txtime;
 };
 
+// A preallocated set of messages sent or received with a single syscall
+// (sendmmsg/recvmmsg). Each message owns a payload buffer of `stride` bytes,
+// a control buffer used for the receive timestamps and two iovecs: the link
+// layer header (only used by raw sockets) and the payload.
+#define RTN_SOCKET_CONTROL_SIZE 128
+
+typedef struct rtn_socket_batch rtn_socket_batch;
+struct rtn_socket_batch
+{
+    struct mmsghdr *msgs;
+    struct iovec   *iovs;
+    u8             *bufs;
+    u8             *control;
+    u8             *hdrs;       // received link layer headers
+    struct sockaddr_storage *names;     // source addresses of the received messages
+    usize           stride;     // distance between two payload buffers
+    usize           size;       // number of messages
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // # Create and Destroy
 static rtn_socket *rtn_socket_new     (const char *ifname, int port, rtn_socket_type type);
+static rtn_socket *rtn_socket_new_xdp (const char *ifname, int port, const rtn_xdp_config *cfg);
+static rtn_socket *rtn_socket_new_raw (const char *ifname, const rtn_raw_config *cfg);
+static rtn_socket *rtn_socket_new_mmap(const char *ifname, const rtn_raw_config *cfg);
 static void        rtn_socket_destroy (rtn_socket *sock);
 
+// Route the I/O of a kernel socket (UDP, raw) through an io_uring instance.
+static int         rtn_socket_enable_uring (rtn_socket *sock, const rtn_uring_config *cfg);
+
+static rtn_socket_batch *rtn_socket_batch_new     (usize size, usize bufsize);
+static void              rtn_socket_batch_destroy (rtn_socket_batch *batch);
+
+static inline u8 *rtn_socket_batch_buf (rtn_socket_batch *batch, usize i) { return batch->bufs + i * batch->stride; }
+
 ////////////////////////////////////////////////////////////////////////////////
 // # Other
+static int rtn_socket_raw_set_dest (rtn_socket *sock, const struct sockaddr_in *daddr);
+
 static inline int 
 rtn_socket_set_dest_addr (rtn_socket *sock, struct sockaddr *daddr, socklen_t daddr_len) 
 {
+    if (sock->type == RTN_SOCK_TYPE_XDP)    return rtn_xsk_set_dest(sock->xsk, (struct sockaddr_in *)daddr);
+    if (sock->type == RTN_SOCK_TYPE_RAW)    return rtn_socket_raw_set_dest(sock, (struct sockaddr_in *)daddr);
+    if (sock->type == RTN_SOCK_TYPE_MMAP)   return rtn_socket_raw_set_dest(sock, (struct sockaddr_in *)daddr);
+
     memcpy(&sock->daddr, daddr, daddr_len);
     sock->daddr_len = daddr_len;
     return 0;
 }
 
+// Kernel timestamps (SO_TIMESTAMPING) are not available for kernel-bypass sockets.
+static inline bool rtn_socket_has_timestamps (rtn_socket *sock) { return sock->type != RTN_SOCK_TYPE_XDP; }
+
 ////////////////////////////////////////////////////////////////////////////////
 // # Receive and Send
 static int rtn_socket_send_message    (rtn_socket *sock, void *data, usize datasize, int flags);
 static int rtn_socket_receive_message (rtn_socket *sock, void *data, usize datasize, rtn_pkt_stat *pstat, int flags);
 
-static int rtn_socket_enable_timestamping (rtn_socket *sock, const char *ifname);
+// The same with the address of the peer: the source of the datagram in `src`
+// (AF_UNSPEC when unknown: XDP, mmap, io_uring), `dst` NULL or not an IPv4
+// address for the destination of the socket.
+static int rtn_socket_receive_from    (rtn_socket *sock, void *data, usize datasize, rtn_pkt_stat *pstat, int flags, struct sockaddr_storage *src);
+static int rtn_socket_send_to         (rtn_socket *sock, void *data, usize datasize, const struct sockaddr_storage *dst, int flags);
+
+static int rtn_socket_send_batch      (rtn_socket *sock, rtn_socket_batch *batch, usize count, usize datasize, int flags);
+static int rtn_socket_receive_batch   (rtn_socket *sock, rtn_socket_batch *batch, usize count, rtn_pkt_stat *pstats, int flags);
+
+// Wait up to `timeout_ns` for the socket to become readable: > 0 when a
+// message can be received, 0 on timeout.
+static int rtn_socket_poll (rtn_socket *sock, i64 timeout_ns);
+
+// TX timestamps are queued in the socket error queue and take space of the
+// receive buffer: request them only when somebody reads the error queue.
+static int rtn_socket_enable_timestamping (rtn_socket *sock, const char *ifname, bool tx_timestamps);
+static int rtn_socket_phc_index           (const char *ifname);
+
+static inline int rtn_socket_enable_txtime (rtn_socket *sock, bool value) { sock->use_txtime = value; return 0; }
+
+static int rtn_socket_set_rcv_timeout (rtn_socket *sock, i64 timeout_ns);
+
+////////////////////////////////////////////////////////////////////////////////
+// # Reuseport Group
+//
+// Several UDP sockets bound to the same port, one receiver thread each. The
+// flow of a packet is its source (IPv4 address and port), the key is
+// 0 when unknown (raw, XDP, io_uring).
+#define RTN_SOCKET_REUSEPORT_MAX    32
 
-static inline int rtn_socket_enable_txtime (rtn_socket *sock, bool value) { sock->use_txtime = value; }
+static int rtn_socket_attach_reuseport_cpu (rtn_socket *sock, const int *cpus, int count);
+
+static inline u64
+rtn_socket_flow_key(const struct sockaddr_storage *addr)
+{
+    if (addr->ss_family != AF_INET)     return 0;
+
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    return (u64)ntohl(in->sin_addr.s_addr) << 16 | ntohs(in->sin_port);
+}
+
+static inline void
+rtn_socket_flow_str(u64 key, char *buf, usize size)
+{
+    if (key == 0) {
+        snprintf(buf, size, "unknown");
+        return;
+    }
+
+    u32 ip = key >> 16;
+    snprintf(buf, size, "%u.%u.%u.%u:%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, (u32)(key & 0xffff));
+}
 
 #endif // RTN_SOCKET_H
\ No newline at end of file
@@ -2,7 +2,12 @@
 #define RTN_STATS_H
 
 #include "rtn_base.h"
+#include "rtn_hist.h"
+#include "rtn_phc.h"
+#include "rtn_result.h"
+#include "rtn_ring.h"
 #include "rtn_socket.h"
+#include "rtn_telemetry.h"
 
 typedef enum
 {
@@ -39,6 +44,7 @@ struct rtn_pkt_stat {
         i64     tx_ts;
         i64     rx_ts;
     } app_tstamps;
+    u64 flow;           // rx: source of the packet, see rtn_socket_flow_key
 
     char __pad[40] __attribute__((aligned(64)));
     
@@ -51,27 +57,473 @@ struct rtn_pkt_stat {
         i64     hw_ts;
         i64     sw_ts;
     } rx_tstamps;    
+    struct {
+        i64     deadline;   // SCM_TXTIME launch time (CLOCK_REALTIME), 0 when not used
+        i32     error;      // SO_EE_CODE_TXTIME_* when the qdisc dropped the packet
+    } txtime;
 };
 
-typedef struct rtn_pkt_stat_array rtn_pkt_stat_array;
-struct rtn_pkt_stat_array {
-    rtn_pkt_stat *stats;
-    usize         num_stats;
+////////////////////////////////////////////////////////////////////////////////
+// # Stats Thread
+//
+// The RT loop pushes one record per packet in an SPSC ring, the stats thread
+// (low priority) pops them and streams them to the results file, so memory
+// does not grow with the number of packets. For the tx role it also reads the
+// TX timestamps from the error queue: the records wait in a window indexed by
+// packet id until their timestamps are merged, a record leaves the window
+// (in id order) when a packet `RTN_STATS_WINDOW` ids newer shows up.
+//
+// The thread sleeps in epoll on the error queue of the socket (EPOLLERR, and
+// EPOLLPRI with SO_SELECT_ERR_QUEUE), so it wakes up as soon as a timestamp is
+// queued and drains the queue in batches of recvmmsg before it can fill the
+// socket receive buffer. The ring is checked at every wakeup and at least
+// every millisecond. Once the RT loop is done the thread stops when every
+// packet has all the timestamp types seen so far, or after a grace period
+// without any new timestamp.
+
+#define RTN_STATS_RING_SIZE     (1 << 16)   // records, about 10 ms at 6.5M pkt/s
+#define RTN_STATS_WINDOW        4096        // tx records waiting for their timestamps
+#define RTN_STATS_ERRQ_BATCH    64          // error queue messages per recvmmsg
+#define RTN_STATS_ERRQ_CONTROL  512         // control buffer of a message
+#define RTN_STATS_TS_GRACE      (100 * NSEC_PER_MSEC)
+#define RTN_STATS_MAX_FLOWS     32          // rx: sources with their own latency histogram
+
+typedef enum
+{
+    RTN_STATS_FMT_TX,
+    RTN_STATS_FMT_TX_TXTIME,
+    RTN_STATS_FMT_RX,
+    RTN_STATS_FMT_E2E,          // tx with --control: the records of both hosts
+} rtn_stats_fmt;
+
+// The timestamps of a packet on both hosts, kept in memory by id for the
+// control channel (rtn_control.h): each side fills its own half, the
+// receiver sends its half to the sender at the end of the test.
+typedef struct stats_record stats_record;
+struct stats_record {
+    u64     id;
+    i64     tx_app;
+    i64     tx_sched;
+    i64     tx_sw;
+    i64     tx_hw;
+    i64     rx_app;
+    i64     rx_sw;
+    i64     rx_hw;
 };
 
-static rtn_pkt_stat_array g_pkt_stats                = {0};
-static bool               g_finished_to_gather_stats = false;
+// rx: the latency of one source (rtn_pkt_stat.flow), the receivers of a
+// reuseport group merge them per flow at the end.
+typedef struct stats_flow stats_flow;
+struct stats_flow {
+    u64          key;
+    u64          num_packets;
+    rtn_hist    *latency;
+};
+
+typedef struct stats_slot stats_slot;
+struct stats_slot {
+    rtn_pkt_stat stat;
+    bool         used;
+    bool         has_app;       // the record of the RT loop arrived
+};
+
+// Buffers of a recvmmsg batch on the error queue. With
+// SOF_TIMESTAMPING_OPT_TSONLY the messages carry no payload.
+typedef struct stats_errq stats_errq;
+struct stats_errq {
+    struct mmsghdr  msgs[RTN_STATS_ERRQ_BATCH];
+    struct iovec    iovs[RTN_STATS_ERRQ_BATCH];
+    char            data[RTN_STATS_ERRQ_BATCH][64];
+    char            control[RTN_STATS_ERRQ_BATCH][RTN_STATS_ERRQ_CONTROL];
+};
 
 typedef struct stats_thread_args stats_thread_args;
 struct stats_thread_args {
-    uint                num_packets;
+    u64                 num_packets;
     uint                num_throttles;
     rtn_socket         *sock;
+    rtn_ring           *ring;
     os_sem             *sem_start;
+    bool                errqueue;       // tx: merge the timestamps of the error queue
+    bool                tsc;            // rx: the app rx_ts are raw TSC cycles (--clock tsc)
+    rtn_phc            *phc;            // convert the hardware timestamps to CLOCK_REALTIME, NULL to keep them
+
+    // results
+    FILE               *out;            // CSV
+    rtn_result         *result;         // binary, replaces `out` when set
+    rtn_stats_fmt       fmt;
+    u64                 num_written;
+    rtn_hist           *latency;        // rx: one-way latency rx_app - tx_app, NULL to skip
+    stats_flow         *flows;          // rx: latency per source, RTN_STATS_MAX_FLOWS with their histograms, NULL to skip
+    u32                 num_flows;
+    stats_record       *records;        // --control: every record by id, `num_packets`, NULL to skip
+
+    // telemetry, NULL when off
+    rtn_tm_source      *tm;
+    rtn_hist           *jitter;         // tx: wakeup jitter, rx: delay variation of consecutive packets
+    u64                 num_drained;    // records read from the ring
+    u64                 rx_expected;    // rx: highest id + 1
+    u64                 prev_id;
+    i64                 prev_ts;
+
+    // tx window
+    stats_slot         *window;
+    u64                 emit_id;        // next id to leave the window
+    u64                 max_id;
+    stats_errq         *errq;
+
+    // tx timestamps per rtn_pkt_ts_type: a type is expected for every packet
+    // once it has been seen, the packets written without it are missing
+    u32                 ts_seen;        // mask of 1 << rtn_pkt_ts_type
+    u64                 ts_received[RTN_PKT_TS_TYPE_MAX];
+    u64                 ts_missing[RTN_PKT_TS_TYPE_MAX];
+    u64                 ts_late[RTN_PKT_TS_TYPE_MAX];    // arrived after their packet was written
+
+    // launch time mode: map the drop reports back to the packets
+    i64                 txtime_offset;  // CLOCK_TAI - CLOCK_REALTIME
+    i64                 first_deadline;
+    u64                 cycle_time;
+    int                 burst_size;
+    uint                num_txtime_drops;
 };
 
-static void 
-parse_cmsg_timestamps(struct msghdr *msg, rtn_pkt_stat *pkt_stat, uint *out_ts_id)
+// Record slot for the RT loop, `scratch` when the ring is full (the record is
+// then lost, see `rtn_ring.num_dropped`).
+static inline rtn_pkt_stat *
+stats_reserve(rtn_ring *ring, rtn_pkt_stat *scratch)
+{
+    rtn_pkt_stat *stat = rtn_ring_reserve(ring);
+    return stat ? stat : scratch;
+}
+
+static inline void
+stats_commit(rtn_ring *ring, rtn_pkt_stat *stat, rtn_pkt_stat *scratch)
+{
+    if (stat != scratch)    rtn_ring_commit(ring);
+}
+
+// Columns of the binary results, the rx records also keep the TX time of the
+// sender.
+static u32
+stats_result_columns(rtn_stats_fmt fmt, u32 *columns)
+{
+    static const u32 tx[]        = { RTN_COL_ID, RTN_COL_TX_APP, RTN_COL_TX_SCHED, RTN_COL_TX_SW, RTN_COL_TX_HW };
+    static const u32 tx_txtime[] = { RTN_COL_ID, RTN_COL_TX_APP, RTN_COL_TX_SCHED, RTN_COL_TX_SW, RTN_COL_TX_HW,
+                                     RTN_COL_TX_TXTIME, RTN_COL_TX_TXTIME_ERR };
+    static const u32 rx[]        = { RTN_COL_ID, RTN_COL_TX_APP, RTN_COL_RX_APP, RTN_COL_RX_SW, RTN_COL_RX_HW };
+    static const u32 e2e[]       = { RTN_COL_ID, RTN_COL_TX_APP, RTN_COL_TX_SCHED, RTN_COL_TX_SW, RTN_COL_TX_HW,
+                                     RTN_COL_RX_APP, RTN_COL_RX_SW, RTN_COL_RX_HW };
+
+    const u32 *cols = NULL;
+    u32 count       = 0;
+    switch (fmt) {
+        case RTN_STATS_FMT_TX:          cols = tx;        count = array_size(tx);        break;
+        case RTN_STATS_FMT_TX_TXTIME:   cols = tx_txtime; count = array_size(tx_txtime); break;
+        case RTN_STATS_FMT_RX:          cols = rx;        count = array_size(rx);        break;
+        case RTN_STATS_FMT_E2E:         cols = e2e;       count = array_size(e2e);       break;
+    }
+
+    memcpy(columns, cols, count * sizeof(u32));
+    return count;
+}
+
+static void
+stats_write_result(stats_thread_args *args, const rtn_pkt_stat *pstat)
+{
+    i64 values[RTN_RESULT_MAX_COLUMNS];
+    u32 n = 0;
+
+    values[n++] = pstat->id;
+    switch (args->fmt) {
+        case RTN_STATS_FMT_TX:
+        case RTN_STATS_FMT_TX_TXTIME:
+        case RTN_STATS_FMT_E2E: {
+            values[n++] = pstat->app_tstamps.tx_ts;
+            values[n++] = pstat->tx_tstamps.sched_ts;
+            values[n++] = pstat->tx_tstamps.sw_ts;
+            values[n++] = pstat->tx_tstamps.hw_ts;
+            if (args->fmt == RTN_STATS_FMT_TX_TXTIME) {
+                values[n++] = pstat->txtime.deadline;
+                values[n++] = pstat->txtime.error;
+            }
+            if (args->fmt == RTN_STATS_FMT_E2E) {
+                values[n++] = pstat->app_tstamps.rx_ts;
+                values[n++] = pstat->rx_tstamps.sw_ts;
+                values[n++] = pstat->rx_tstamps.hw_ts;
+            }
+        } break;
+        case RTN_STATS_FMT_RX: {
+            values[n++] = pstat->app_tstamps.tx_ts;
+            values[n++] = pstat->app_tstamps.rx_ts;
+            values[n++] = pstat->rx_tstamps.sw_ts;
+            values[n++] = pstat->rx_tstamps.hw_ts;
+        } break;
+    }
+
+    if (rtn_result_append(args->result, values) < 0) {
+        error("Failed to write the results\n");
+        exit(1);
+    }
+}
+
+static void
+stats_write_header(stats_thread_args *args)
+{
+    if (args->result)   return;
+
+    switch (args->fmt) {
+        // tx_txtime is the launch time requested to the qdisc, tx_txtime_err
+        // the SO_EE_CODE_TXTIME_* code when the packet was dropped
+        case RTN_STATS_FMT_TX_TXTIME:   fprintf(args->out, "id, tx_app, tx_sched, tx_sw, tx_hw, tx_txtime, tx_txtime_err\n"); break;
+        case RTN_STATS_FMT_TX:          fprintf(args->out, "id, tx_app, tx_sched, tx_sw, tx_hw\n");  break;
+        case RTN_STATS_FMT_RX:          fprintf(args->out, "id, tx_app, rx_app, rx_sw, rx_hw\n");  break;
+        // a lost packet has no rx timestamps (0)
+        case RTN_STATS_FMT_E2E:         fprintf(args->out, "id, tx_app, tx_sched, tx_sw, tx_hw, rx_app, rx_sw, rx_hw\n"); break;
+    }
+}
+
+static void
+stats_write_csv(stats_thread_args *args, const rtn_pkt_stat *pstat)
+{
+    switch (args->fmt) {
+        case RTN_STATS_FMT_TX_TXTIME: {
+            fprintf(args->out, 
+                    "%ld, %ld, %ld, %ld, %ld, %ld, %d\n", 
+                    pstat->id, pstat->app_tstamps.tx_ts, pstat->tx_tstamps.sched_ts, 
+                    pstat->tx_tstamps.sw_ts, pstat->tx_tstamps.hw_ts,
+                    pstat->txtime.deadline, pstat->txtime.error);
+        } break;
+        case RTN_STATS_FMT_TX: {
+            fprintf(args->out, 
+                    "%ld, %ld, %ld, %ld, %ld\n", 
+                    pstat->id, pstat->app_tstamps.tx_ts, pstat->tx_tstamps.sched_ts, 
+                    pstat->tx_tstamps.sw_ts, pstat->tx_tstamps.hw_ts);
+        } break;
+        case RTN_STATS_FMT_RX: {
+            fprintf(args->out,
+                    "%ld, %ld, %ld, %ld, %ld\n", 
+                    pstat->id, pstat->app_tstamps.tx_ts, pstat->app_tstamps.rx_ts,
+                    pstat->rx_tstamps.sw_ts, pstat->rx_tstamps.hw_ts);
+        } break;
+        case RTN_STATS_FMT_E2E: {
+            fprintf(args->out,
+                    "%ld, %ld, %ld, %ld, %ld, %ld, %ld, %ld\n",
+                    pstat->id, pstat->app_tstamps.tx_ts, pstat->tx_tstamps.sched_ts,
+                    pstat->tx_tstamps.sw_ts, pstat->tx_tstamps.hw_ts,
+                    pstat->app_tstamps.rx_ts, pstat->rx_tstamps.sw_ts, pstat->rx_tstamps.hw_ts);
+        } break;
+    }
+}
+
+// tx: deviation of the wakeup (first packet of a burst) from the cycle. rx:
+// variation of the one-way latency between consecutive packets (IPDV), it
+// does not depend on the offset of the clocks nor on the cycle of the sender.
+static void
+stats_record_jitter(stats_thread_args *args, const rtn_pkt_stat *pstat)
+{
+    i64 jitter;
+    if (args->fmt == RTN_STATS_FMT_RX) {
+        i64 latency = pstat->app_tstamps.rx_ts - pstat->app_tstamps.tx_ts;
+        jitter      = latency - args->prev_ts;
+        if (args->num_written > 1 && pstat->id == args->prev_id + 1)   rtn_hist_record(args->jitter, jitter < 0 ? -jitter : jitter);
+
+        args->prev_ts = latency;
+        args->prev_id = pstat->id;
+        return;
+    }
+
+    if (pstat->id % args->burst_size != 0)  return;
+
+    jitter = pstat->app_tstamps.tx_ts - args->prev_ts - (i64)args->cycle_time;
+    if (args->prev_ts && pstat->id == args->prev_id + args->burst_size)   rtn_hist_record(args->jitter, jitter < 0 ? -jitter : jitter);
+
+    args->prev_ts = pstat->app_tstamps.tx_ts;
+    args->prev_id = pstat->id;
+}
+
+// The sources past RTN_STATS_MAX_FLOWS only count in the totals.
+static void
+stats_record_flow(stats_thread_args *args, const rtn_pkt_stat *pstat)
+{
+    stats_flow *flow = NULL;
+    for (u32 i = 0; i < args->num_flows && flow == NULL; i++) {
+        if (args->flows[i].key == pstat->flow)  flow = &args->flows[i];
+    }
+
+    if (flow == NULL) {
+        if (args->num_flows == RTN_STATS_MAX_FLOWS)     return;
+
+        flow      = &args->flows[args->num_flows++];
+        flow->key = pstat->flow;
+    }
+
+    flow->num_packets += 1;
+    rtn_hist_record(flow->latency, pstat->app_tstamps.rx_ts - pstat->app_tstamps.tx_ts);
+}
+
+// Each side only has its own timestamps, the others are 0. A duplicate
+// replaces the first copy.
+static void
+stats_keep_record(stats_thread_args *args, const rtn_pkt_stat *pstat)
+{
+    if (pstat->id >= args->num_packets)     return;
+
+    args->records[pstat->id] = (stats_record) {
+        .id       = pstat->id,
+        .tx_app   = pstat->app_tstamps.tx_ts,
+        .tx_sched = pstat->tx_tstamps.sched_ts,
+        .tx_sw    = pstat->tx_tstamps.sw_ts,
+        .tx_hw    = pstat->tx_tstamps.hw_ts,
+        .rx_app   = pstat->app_tstamps.rx_ts,
+        .rx_sw    = pstat->rx_tstamps.sw_ts,
+        .rx_hw    = pstat->rx_tstamps.hw_ts,
+    };
+}
+
+static void
+stats_write_record(stats_thread_args *args, const rtn_pkt_stat *pstat)
+{
+    rtn_pkt_stat conv;
+    if (args->phc) {
+        conv                     = *pstat;
+        conv.tx_tstamps.hw_ts    = rtn_phc_to_rt_ns(args->phc, pstat->tx_tstamps.hw_ts);
+        conv.rx_tstamps.hw_ts    = rtn_phc_to_rt_ns(args->phc, pstat->rx_tstamps.hw_ts);
+        pstat                    = &conv;
+    }
+
+    if (args->result)   stats_write_result(args, pstat);
+    else                stats_write_csv(args, pstat);
+
+    args->num_written += 1;
+
+    if (args->latency && args->fmt == RTN_STATS_FMT_RX) {
+        rtn_hist_record(args->latency, pstat->app_tstamps.rx_ts - pstat->app_tstamps.tx_ts);
+    }
+
+    if (args->flows && args->fmt == RTN_STATS_FMT_RX)   stats_record_flow(args, pstat);
+    if (args->jitter)   stats_record_jitter(args, pstat);
+    if (args->records)  stats_keep_record(args, pstat);
+}
+
+// ## Window
+
+static inline stats_slot *
+stats_window_slot(stats_thread_args *args, u64 id) { return &args->window[id % RTN_STATS_WINDOW]; }
+
+static const rtn_pkt_ts_type s_stats_tx_ts_types[] = { RTN_PKT_TS_TYPE_TX_SCHED, RTN_PKT_TS_TYPE_TX_SW, RTN_PKT_TS_TYPE_TX_HW };
+
+static inline i64
+stats_tx_tstamp(const rtn_pkt_stat *stat, rtn_pkt_ts_type type)
+{
+    switch (type) {
+        case RTN_PKT_TS_TYPE_TX_SCHED:  return stat->tx_tstamps.sched_ts;
+        case RTN_PKT_TS_TYPE_TX_SW:     return stat->tx_tstamps.sw_ts;
+        case RTN_PKT_TS_TYPE_TX_HW:     return stat->tx_tstamps.hw_ts;
+        default:                        return 0;
+    }
+}
+
+// Mask of the expected timestamp types the packet does not have yet. A packet
+// dropped by the launch time qdisc was never sent and expects none.
+static u32
+stats_missing_tstamps(stats_thread_args *args, const rtn_pkt_stat *stat)
+{
+    if (stat->txtime.error != 0)    return 0;
+
+    u32 missing = 0;
+    for (usize i = 0; i < array_size(s_stats_tx_ts_types); i++) {
+        rtn_pkt_ts_type type = s_stats_tx_ts_types[i];
+        if ((args->ts_seen & (1u << type)) && stats_tx_tstamp(stat, type) == 0)     missing |= 1u << type;
+    }
+
+    return missing;
+}
+
+static void
+stats_window_emit(stats_thread_args *args, u64 until_id)
+{
+    for (; args->emit_id < until_id; args->emit_id++) {
+        stats_slot *slot = stats_window_slot(args, args->emit_id);
+        if (slot->used && slot->has_app) {
+            u32 missing = stats_missing_tstamps(args, &slot->stat);
+            for (int type = 0; missing != 0; type++, missing >>= 1) {
+                if (missing & 1)    args->ts_missing[type] += 1;
+            }
+
+            stats_write_record(args, &slot->stat);
+        }
+        slot->used = false;
+    }
+}
+
+// All the packets in the window have their record and expected timestamps.
+static bool
+stats_window_complete(stats_thread_args *args)
+{
+    for (u64 id = args->emit_id; id <= args->max_id; id++) {
+        stats_slot *slot = stats_window_slot(args, id);
+        if (!slot->used)    continue;
+        if (!slot->has_app || stats_missing_tstamps(args, &slot->stat) != 0)    return false;
+    }
+
+    return true;
+}
+
+// Slot of packet `id`, NULL when the packet already left the window.
+static stats_slot *
+stats_window_get(stats_thread_args *args, u64 id)
+{
+    if (id < args->emit_id)     return NULL;
+
+    if (id >= args->emit_id + RTN_STATS_WINDOW)     stats_window_emit(args, id - RTN_STATS_WINDOW + 1);
+    if (id > args->max_id)                          args->max_id = id;
+
+    stats_slot *slot = stats_window_slot(args, id);
+    if (!slot->used) {
+        memset(slot, 0, sizeof(*slot));
+        slot->used    = true;
+        slot->stat.id = id;
+    }
+    return slot;
+}
+
+static void
+stats_merge_app(stats_thread_args *args, const rtn_pkt_stat *rec)
+{
+    if (args->first_deadline == 0 && rec->txtime.deadline != 0)  args->first_deadline = rec->txtime.deadline;
+
+    stats_slot *slot = stats_window_get(args, rec->id);
+    if (slot == NULL)   return;
+
+    slot->has_app              = true;
+    slot->stat.app_tstamps     = rec->app_tstamps;
+    slot->stat.txtime.deadline = rec->txtime.deadline;
+}
+
+static void
+stats_merge_tx_tstamps(stats_thread_args *args, u64 id, rtn_pkt_ts_type type, const rtn_pkt_stat *tmp)
+{
+    if (type == RTN_PKT_TS_TYPE_UNKNOWN)    return;
+
+    args->ts_seen           |= 1u << type;
+    args->ts_received[type] += 1;
+
+    stats_slot *slot = stats_window_get(args, id);
+    if (slot == NULL) {
+        args->ts_late[type] += 1;
+        return;
+    }
+
+    if (tmp->tx_tstamps.sched_ts)   slot->stat.tx_tstamps.sched_ts = tmp->tx_tstamps.sched_ts;
+    if (tmp->tx_tstamps.sw_ts)      slot->stat.tx_tstamps.sw_ts    = tmp->tx_tstamps.sw_ts;
+    if (tmp->tx_tstamps.hw_ts)      slot->stat.tx_tstamps.hw_ts    = tmp->tx_tstamps.hw_ts;
+}
+
+// Returns the type of the timestamp. A SO_EE_ORIGIN_TXTIME report carries no
+// timestamp: the launch time of the dropped packet is returned in
+// `out_txtime` and the reason in `out_txtime_err`.
+static rtn_pkt_ts_type
+parse_cmsg_timestamps(struct msghdr *msg, rtn_pkt_stat *pkt_stat, uint *out_ts_id, i64 *out_txtime, i32 *out_txtime_err)
     // uint *out_ts_type, uint *out_snd_count)
 {
     uint ts_type = 0;
@@ -90,8 +542,9 @@ parse_cmsg_timestamps(struct msghdr *msg, rtn_pkt_stat *pkt_stat, uint *out_ts_i
 
         written += snprintf(printbuf + written, sizeof(printbuf) - written,
                             "cmsg_level: %s, cmsg_type: %s\n", 
-                            cmsg_level == SOL_SOCKET ? "SOL_SOCKET" : "SOL_IP", 
-                            cmsg_type  == SO_TIMESTAMPING ? "SO_TIMESTAMPING" : "IP_RECVERR");
+                            cmsg_level == SOL_SOCKET ? "SOL_SOCKET" : cmsg_level == SOL_PACKET ? "SOL_PACKET" : "SOL_IP", 
+                            cmsg_type  == SO_TIMESTAMPING ? "SO_TIMESTAMPING" : 
+                            cmsg_level == SOL_PACKET ? "PACKET_TX_TIMESTAMP" : "IP_RECVERR");
 
         if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) 
         {
@@ -100,13 +553,17 @@ parse_cmsg_timestamps(struct msghdr *msg, rtn_pkt_stat *pkt_stat, uint *out_ts_i
             hw = scm_ts->ts[2].tv_sec * NSEC_PER_SEC + scm_ts->ts[2].tv_nsec;      
         }
         else if ((cmsg_level == SOL_IP     && cmsg_type == IP_RECVERR) ||
-                (cmsg_type   == SOL_PACKET && cmsg_type == PACKET_TX_TIMESTAMP)) 
+                (cmsg_level  == SOL_PACKET && cmsg_type == PACKET_TX_TIMESTAMP)) 
         {
             serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
             if (serr && serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
                 *out_ts_id = serr->ee_data;
                 ts_type    = serr->ee_info;
-            }                
+            } else if (serr && serr->ee_origin == SO_EE_ORIGIN_TXTIME) {
+                *out_txtime     = (i64)(((u64)serr->ee_info << 32) | serr->ee_data);
+                *out_txtime_err = serr->ee_code;
+                return RTN_PKT_TS_TYPE_UNKNOWN;
+            }
         }
     }
 
@@ -126,6 +583,169 @@ parse_cmsg_timestamps(struct msghdr *msg, rtn_pkt_stat *pkt_stat, uint *out_ts_i
         case RTN_PKT_TS_TYPE_TX_HW:     pkt_stat->tx_tstamps.hw_ts    = hw; break;
         default:                        printf("Unknown pkt_ts_type\n"); break;
     }
+
+    return pkt_ts_type;
+}
+
+// Read one message of the error queue without waiting, for the roles that
+// match the TX timestamps to their packets themselves (ping and pong). The
+// timestamp is returned in `pstat->tx_tstamps` and the number of the send on
+// the socket (SOF_TIMESTAMPING_OPT_ID) in `ts_id`. Returns the type of the
+// timestamp, or -1 when the queue is empty.
+static int
+stats_read_tx_tstamp(rtn_socket *sock, uint *ts_id, rtn_pkt_stat *pstat)
+{
+    char data[64];
+    char control[RTN_STATS_ERRQ_CONTROL];
+    struct iovec iov  = { .iov_base = data, .iov_len = sizeof(data) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+    if (recvmsg(sock->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        if (errno != EAGAIN)    error("recvmsg: %s\n", strerror(errno));
+        return -1;
+    }
+
+    i64 txtime     = 0;
+    i32 txtime_err = 0;
+    return parse_cmsg_timestamps(&msg, pstat, ts_id, &txtime, &txtime_err);
+}
+
+// The deadlines grow by one cycle every `burst_size` packets, so the dropped
+// packet is found from the cycle of its launch time. The packets of a burst
+// share the deadline, the first one not marked yet gets the report.
+static void
+stats_mark_txtime_drop(stats_thread_args *args, i64 txtime, i32 err)
+{
+    static const char *reasons[] = {
+        [SO_EE_CODE_TXTIME_INVALID_PARAM] = "invalid parameters",
+        [SO_EE_CODE_TXTIME_MISSED]        = "deadline missed",
+    };
+
+    args->num_txtime_drops += 1;
+
+    i64 deadline = txtime - args->txtime_offset;
+    i64 first    = args->first_deadline;
+    if (first == 0 || deadline < first || args->cycle_time == 0)    return;
+
+    u64 idx = (u64)(deadline - first + (i64)args->cycle_time / 2) / args->cycle_time * args->burst_size;
+    for (int i = 0; i < args->burst_size && idx + i < args->num_packets; i++) {
+        stats_slot *slot = stats_window_get(args, idx + i);
+        if (slot == NULL || slot->stat.txtime.error != 0)   continue;
+
+        slot->stat.txtime.error = err;
+        debug("Packet %ld dropped by the qdisc: %s\n", idx + i,
+              err < (i32)array_size(reasons) && reasons[err] ? reasons[err] : "unknown");
+        break;
+    }
+}
+
+// Move the records of the RT loop out of the ring, returns how many.
+static uint
+stats_drain_ring(stats_thread_args *args)
+{
+    uint n = 0;
+    rtn_pkt_stat *rec;
+    while ((rec = rtn_ring_peek(args->ring)) != NULL) {
+        if (args->fmt == RTN_STATS_FMT_RX && rec->id >= args->rx_expected)    args->rx_expected = rec->id + 1;
+        if (args->tsc)  rec->app_tstamps.rx_ts = os_time_stamp_to_ns(true, rec->app_tstamps.rx_ts);
+
+        if (args->errqueue)     stats_merge_app(args, rec);
+        else                    stats_write_record(args, rec);
+
+        rtn_ring_release(args->ring);
+        n += 1;
+    }
+
+    args->num_drained += n;
+    return n;
+}
+
+// Telemetry counters: the packets handled by the RT loop, and the records
+// lost in the ring, the packets dropped by the launch time qdisc (tx) or
+// missing ids (rx).
+static void
+stats_update_telemetry(stats_thread_args *args)
+{
+    if (args->tm == NULL)   return;
+
+    u64 dropped = __atomic_load_n(&args->ring->num_dropped, __ATOMIC_RELAXED);
+    u64 packets = args->num_drained + dropped;
+    u64 drops   = dropped + args->num_txtime_drops;
+    if (args->fmt == RTN_STATS_FMT_RX && args->rx_expected > packets)   drops = args->rx_expected - args->num_drained;
+
+    rtn_tm_set(&args->tm->packets, packets);
+    rtn_tm_set(&args->tm->drops, drops);
+}
+
+// Read the pending messages of the error queue in batches, returns how many.
+// The ring is drained between the batches.
+static uint
+stats_drain_errqueue(stats_thread_args *args)
+{
+    stats_errq *q = args->errq;
+    uint n        = 0;
+    for (;;) {
+        for (int i = 0; i < RTN_STATS_ERRQ_BATCH; i++) {
+            struct msghdr *msg  = &q->msgs[i].msg_hdr;
+            q->iovs[i].iov_base = q->data[i];
+            q->iovs[i].iov_len  = sizeof(q->data[i]);
+            msg->msg_iov        = &q->iovs[i];
+            msg->msg_iovlen     = 1;
+            msg->msg_control    = q->control[i];
+            msg->msg_controllen = sizeof(q->control[i]);
+            msg->msg_flags      = 0;
+        }
+
+        int res = recvmmsg(args->sock->fd, q->msgs, RTN_STATS_ERRQ_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if (res < 0) {
+            if (errno != EAGAIN)    error("recvmmsg: %s\n", strerror(errno));
+            return n;
+        }
+
+        // the records of the RT loop first: the timestamps must not get a
+        // window ahead of them
+        stats_drain_ring(args);
+
+        for (int i = 0; i < res; i++) {
+            uint ts_id            = 0;
+            i64 txtime            = 0;
+            i32 txtime_err        = 0;
+            rtn_pkt_stat tmp_stat = {0};
+            rtn_pkt_ts_type type  = parse_cmsg_timestamps(&q->msgs[i].msg_hdr, &tmp_stat, &ts_id, &txtime, &txtime_err);
+
+            if (txtime != 0) {
+                stats_mark_txtime_drop(args, txtime, txtime_err);
+                continue;
+            }
+
+            stats_merge_tx_tstamps(args, ts_id, type, &tmp_stat);
+        }
+
+        n += res;
+        if (res < RTN_STATS_ERRQ_BATCH)     return n;
+    }
+}
+
+static void
+stats_report_tstamps(stats_thread_args *args)
+{
+    for (usize i = 0; i < array_size(s_stats_tx_ts_types); i++) {
+        rtn_pkt_ts_type type = s_stats_tx_ts_types[i];
+        if (!(args->ts_seen & (1u << type)))    continue;
+
+        u64 received = args->ts_received[type] - args->ts_late[type];
+        u64 expected = received + args->ts_missing[type];
+        info("%-8s timestamps: %ld/%ld (%.3f%%), %ld missing, %ld late\n", g_pkt_ts_type_str[type],
+             received, expected, expected ? 100.0 * received / expected : 100.0,
+             args->ts_missing[type], args->ts_late[type]);
+
+        if (args->ts_missing[type] > 0) {
+            warn("%ld packets without their %s timestamp\n", args->ts_missing[type], g_pkt_ts_type_str[type]);
+        }
+        if (args->ts_late[type] > 0) {
+            warn("%ld %s timestamps arrived after their packet was written\n", args->ts_late[type], g_pkt_ts_type_str[type]);
+        }
+    }
 }
 
 static void *
@@ -133,48 +753,92 @@ stats_thread_fn(void *arg)
 {
     stats_thread_args *args = (stats_thread_args *)arg;
 
-    info("Starting stats thread, expecting %d packets\n", args->num_packets);
+    info("Starting stats thread, expecting %ld packets\n", args->num_packets);
+
+    int epfd = -1;
+    if (args->errqueue) {
+        args->window = calloc(RTN_STATS_WINDOW, sizeof(stats_slot));
+        args->errq   = calloc(1, sizeof(stats_errq));
+        if (args->window == NULL || args->errq == NULL) {
+            error("Failed to allocate the stats window\n");
+            exit(1);
+        }
+
+        // EPOLLERR is always reported, EPOLLPRI with SO_SELECT_ERR_QUEUE
+        struct epoll_event ev = { .events = EPOLLPRI };
+        epfd = epoll_create1(0);
+        if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, args->sock->fd, &ev) < 0) {
+            perror("epoll");
+            exit(1);
+        }
+    }
 
-    rtn_pkt_stat_array *pkt_stats_array = &g_pkt_stats;
+    stats_write_header(args);
 
     debug("Waiting for the start signal...\n");
     os_sem_wait(args->sem_start);
 
-    int retry             = 10;
-    uint ts_id            = 0;
-    uint idx              = 0;
-    rtn_pkt_stat tmp_stat = {0};
-    while ((idx < args->num_packets - 1) || retry > 0)
+    // after the last record, wait for the last timestamps: until every packet
+    // has the timestamps seen so far, or `RTN_STATS_TS_GRACE` after the last
+    // one
+    i64 last_ts_time = 0;
+    i64 closed_time  = 0;
+    for (;;)
     {
-        char buffer[1024]  = {0};
-        char control[1024] = {0};
-        struct iovec iov   = { .iov_base = buffer, .iov_len = sizeof(buffer) };
-        struct msghdr msg  = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        bool closed = rtn_ring_is_closed(args->ring);
 
-        // Receive message from error queue
-        int res = recvmsg(args->sock->fd, &msg, MSG_ERRQUEUE);
-        if (res < 0) {
-            if (errno == EAGAIN) {
-                if (idx >= args->num_packets - 1)  {
-                    debug("Received all packets, check if there are any more packets in the queue (retry=%d)\n", retry);   
-                    retry -= 1;
-                }
+        uint n = stats_drain_ring(args);
+        uint t = args->errqueue ? stats_drain_errqueue(args) : 0;
+        if (n + t > 0)  stats_update_telemetry(args);
+
+        if (closed) {
+            if (!args->errqueue)    break;
+
+            i64 now = os_time_get_ns();
+            if (closed_time == 0)   closed_time = now;
+            if (t > 0)              last_ts_time = now;
 
-                usleep(1000 * 10); 
-                continue; 
-            }   
+            i64 last = last_ts_time > closed_time ? last_ts_time : closed_time;
+            if (stats_window_complete(args) && (args->ts_seen != 0 || now - closed_time >= RTN_STATS_TS_GRACE))    break;
+            if (now - last >= RTN_STATS_TS_GRACE) {
+                debug("No timestamp for %ld ms, stop waiting\n", RTN_STATS_TS_GRACE / NSEC_PER_MSEC);
+                break;
+            }
+        }
+
+        if (n + t > 0)  continue;
 
-            error("recvmsg: %s\n", strerror(errno));         
+        if (args->errqueue) {
+            // wake up as soon as a timestamp is queued, the error queue is
+            // bounded by the socket receive buffer and must not overflow
+            struct epoll_event ev;
+            epoll_wait(epfd, &ev, 1, 1);
+        } else {
+            usleep(1000);
         }
+    }
+
+    if (args->errqueue) {
+        stats_window_emit(args, args->max_id + 1);
+        close(epfd);
+        free(args->errq);
+        free(args->window);
+    }
 
-        parse_cmsg_timestamps(&msg, &tmp_stat, &ts_id);
+    stats_update_telemetry(args);
 
-        idx                                    = ts_id;
-        pkt_stats_array->stats[idx].tx_tstamps = tmp_stat.tx_tstamps;
+    if (args->out)  fflush(args->out);
+
+    if (args->ring->num_dropped > 0) {
+        warn("%ld records lost, the stats ring was full\n", args->ring->num_dropped);
+    }
+
+    if (args->errqueue)     stats_report_tstamps(args);
+
+    if (args->num_txtime_drops > 0) {
+        warn("%d packets dropped by the launch time qdisc\n", args->num_txtime_drops);
     }
 
-    g_finished_to_gather_stats = true;
-    
     pthread_exit(NULL);
 }
 
@@ -0,0 +1,97 @@
+#ifndef RTN_STREAM_H
+#define RTN_STREAM_H
+
+#include "rtn_base.h"
+
+#include "rtn_log.h"
+#include "rtn_options.h"
+#include "rtn_socket.h"
+#include "rtn_stats.h"
+#include "rtn_ping.h"
+#include "rtn_txrx.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Multi-Stream Mode
+//
+// Several periodic streams run in the same process, e.g. the cyclic tasks of
+// a PLC. Every stream has its own RT thread pinned to its CPU, its own socket
+// (UDP port), stats thread and results file. All the tx streams share the
+// same start time so their cycles are aligned. The role (tx or rx) is the
+// same for all the streams.
+//
+// A reuseport group (--rx-queues) runs as a set of rx or pong streams on the
+// same port, one per CPU of -c: the sockets form a SO_REUSEPORT group and a
+// CBPF program gives every packet to the socket of the CPU that processed it,
+// so with the RX queue interrupts pinned to the same CPUs each receiver only
+// sees the packets of its queue. The latency is merged per flow at the end.
+
+typedef struct rtn_stream rtn_stream;
+struct rtn_stream
+{
+    int                 id;
+    options_t           opts;           // global options with the stream parameters
+    char                cpus[16];
+    rtn_socket         *sock;
+    int                 pkt_count;
+    bool                stats_on;
+
+    pthread_t           thread;
+    pthread_t           stats_thread;
+    stats_thread_args   stats_args;
+};
+
+static void
+rtn_stream_init(rtn_stream *stream, int id, const options_t *opts, const stream_spec_t *spec)
+{
+    memset(stream, 0, sizeof(*stream));
+
+    stream->id               = id;
+    stream->opts             = *opts;
+    stream->opts.rx_queue    = id;
+    stream->opts.port        = spec->port;
+    stream->opts.cycle_time  = spec->cycle_time;
+    stream->opts.packet_size = spec->packet_size;
+    stream->opts.sched_prio  = spec->sched_prio;
+
+    snprintf(stream->cpus, sizeof(stream->cpus), "%d", spec->cpu);
+    stream->opts.cpus = stream->cpus;
+}
+
+static void *
+stream_thread_fn(void *arg)
+{
+    rtn_stream *stream = (rtn_stream *)arg;
+    options_t  *opts   = &stream->opts;
+
+    char name[16], stream_name[8];
+    options_stream_name(opts, stream_name, sizeof(stream_name));
+    snprintf(name, sizeof(name), "rtn-%s-%s", opts->role_name, stream_name);
+    os_thread_set_name(os_thread_self(), name);
+
+    int cpu = atoi(stream->cpus);
+    if (os_thread_set_affinity(os_thread_self(), &cpu, 1) != 0) {
+        error("Stream %d: failed to set CPU affinity to %d\n", stream->id, cpu);
+        exit(1);
+    }
+
+    if (os_thread_set_priority(os_thread_self(), sched_policy_name_to_id(opts->sched_policy), opts->sched_prio) != 0) {
+        error("Stream %d: failed to set thread priority %d\n", stream->id, opts->sched_prio);
+        exit(1);
+    }
+
+    info("Stream %d: port=%d, cycle=%ld, size=%d, prio=%d, cpu=%d\n",
+         stream->id, opts->port, opts->cycle_time, opts->packet_size, opts->sched_prio, cpu);
+
+    os_stack_prefault();
+
+    switch (opts->role_id) {
+        case ROLE_TX:   stream->pkt_count = do_tx(opts, stream->sock, stream->stats_args.ring); break;
+        case ROLE_RX:   stream->pkt_count = do_rx(opts, stream->sock, stream->stats_args.ring); break;
+        case ROLE_PONG: stream->pkt_count = do_pong(opts, stream->sock); break;
+        default:        error("Stream %d: invalid role %s\n", stream->id, opts->role_name); break;
+    }
+
+    return NULL;
+}
+
+#endif // RTN_STREAM_H
@@ -0,0 +1,407 @@
+#ifndef RTN_TELEMETRY_H
+#define RTN_TELEMETRY_H
+
+#include "rtn_base.h"
+#include "rtn_hist.h"
+#include "rtn_log.h"
+#include "rtn_options.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Telemetry
+//
+// Live view of a running test. The threads that already see every packet
+// (stats thread, ping receiver) keep cumulative counters and histograms in a
+// `rtn_tm_source`, each source has a single writer that only does relaxed
+// stores. A SCHED_OTHER thread snapshots the sources every interval, computes
+// the interval stats (rates, latency percentiles, max jitter) and publishes
+// them in the POSIX shared memory segment `/rtn-<name>`, read by `rtn-top`.
+// The RT threads never block or format text for it.
+//
+// The segment is protected by a seqlock: the writer makes `seq` odd while it
+// updates the stats, a reader retries until it copied the segment with the
+// same even `seq` before and after.
+
+#define RTN_TM_MAGIC            0x52544e54  // "RTNT"
+#define RTN_TM_VERSION          1
+#define RTN_TM_MAX_SOURCES      (MAX_NUM_STREAMS + 1)
+
+// Published stats of a source, the interval values cover the last update.
+typedef struct rtn_tm_stats rtn_tm_stats;
+struct rtn_tm_stats
+{
+    char    name[32];
+    u64     packets;            // cumulative
+    u64     drops;              // cumulative: lost packets, records or timestamps
+    u64     interval_packets;
+    u64     interval_drops;
+    f64     rate;               // packets/s over the interval
+
+    u64     latency_count;      // samples in the interval, 0 when the source has no latency
+    i64     latency_p50;
+    i64     latency_p99;
+    i64     latency_p999;
+    i64     latency_max;        // upper bound of the bucket of the largest sample
+
+    u64     jitter_count;
+    i64     jitter_p99;
+    i64     jitter_max;
+};
+
+typedef struct rtn_tm_segment rtn_tm_segment;
+struct rtn_tm_segment
+{
+    u32             magic;
+    u32             version;
+    u32             seq;            // seqlock, odd while the stats are updated
+    i32             pid;
+    bool            done;           // the test is over, no more updates
+    char            role[8];
+    char            cfg[1024];
+    i64             interval;       // ns
+    i64             start_time;     // CLOCK_REALTIME
+    i64             update_time;
+    u64             num_updates;
+    u32             num_sources;
+    rtn_tm_stats    stats[RTN_TM_MAX_SOURCES];
+};
+
+// Counters of one packet flow. The owner thread updates them with
+// `rtn_tm_add`, the histograms (`rtn_hist_record` is single writer) stay
+// owned by the thread that records them.
+typedef struct rtn_tm_source rtn_tm_source;
+struct rtn_tm_source
+{
+    char        name[32];
+    u64         packets;
+    u64         drops;
+    rtn_hist   *latency;        // NULL when not measured
+    rtn_hist   *jitter;
+
+    // publisher only: values at the previous update
+    u64         last_packets;
+    u64         last_drops;
+    rtn_hist   *last_latency;
+    rtn_hist   *last_jitter;
+};
+
+static inline void rtn_tm_add (u64 *counter, u64 n) { __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED); }
+static inline void rtn_tm_set (u64 *counter, u64 n) { __atomic_store_n(counter, n, __ATOMIC_RELAXED); }
+
+typedef struct rtn_telemetry rtn_telemetry;
+struct rtn_telemetry
+{
+    char            path[64];       // shared memory name
+    rtn_tm_segment *seg;
+    i64             interval;
+
+    os_mutex        lock;           // sources and publication, never taken by an RT thread
+    rtn_tm_source   sources[RTN_TM_MAX_SOURCES];
+    u32             num_sources;
+
+    pthread_t       thread;
+    bool            stop;
+    i64             last_time;      // CLOCK_MONOTONIC of the previous update
+    rtn_hist       *cur;            // scratch: snapshot of a source
+    rtn_hist       *diff;           // scratch: interval histogram
+};
+
+static inline void
+rtn_tm_segment_path(char *path, usize len, const char *name)
+{
+    snprintf(path, len, "/rtn-%s", name);
+}
+
+// ## Histogram Snapshots
+
+// Copy of a histogram written by another thread. The copy is not atomic as a
+// whole but every counter is, which is enough for the interval stats.
+static void
+rtn_hist_snapshot(rtn_hist *dst, const rtn_hist *src)
+{
+    for (u32 i = 0; i < RTN_HIST_NUM_BUCKETS; i++)  dst->counts[i] = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    dst->total = __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+}
+
+// Samples recorded between the snapshots `prev` and `cur`, min and max are
+// the bounds of the first and last non-empty buckets.
+static void
+rtn_hist_diff(rtn_hist *dst, const rtn_hist *cur, const rtn_hist *prev)
+{
+    rtn_hist_init(dst);
+    for (u32 i = 0; i < RTN_HIST_NUM_BUCKETS; i++) {
+        u64 n = cur->counts[i] - prev->counts[i];
+        if (n == 0)     continue;
+
+        i64 value       = rtn_hist_bucket_value(i);
+        dst->counts[i]  = n;
+        dst->total     += n;
+        dst->sum       += (f64)value * n;
+        if (value < dst->min)   dst->min = value;
+        if (value > dst->max)   dst->max = value;
+    }
+}
+
+// ## Publisher
+
+static rtn_telemetry *
+rtn_telemetry_new(const char *name, i64 interval, const options_t *opts)
+{
+    rtn_telemetry *tm = calloc(1, sizeof(rtn_telemetry));
+    if (tm == NULL)     return NULL;
+
+    rtn_tm_segment_path(tm->path, sizeof(tm->path), name);
+    tm->interval = interval;
+    tm->cur      = malloc(sizeof(rtn_hist));
+    tm->diff     = malloc(sizeof(rtn_hist));
+    if (tm->cur == NULL || tm->diff == NULL) {
+        fprintf(stderr, "Failed to allocate the telemetry histograms\n");
+        free(tm->cur);
+        free(tm->diff);
+        free(tm);
+        return NULL;
+    }
+
+    os_mutex_init(&tm->lock);
+
+    int fd = shm_open(tm->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create the shared memory %s: %s\n", tm->path, strerror(errno));
+        free(tm->cur);
+        free(tm->diff);
+        free(tm);
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(rtn_tm_segment)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(tm->path);
+        free(tm->cur);
+        free(tm->diff);
+        free(tm);
+        return NULL;
+    }
+
+    tm->seg = mmap(NULL, sizeof(rtn_tm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (tm->seg == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(tm->path);
+        free(tm->cur);
+        free(tm->diff);
+        free(tm);
+        return NULL;
+    }
+
+    rtn_tm_segment *seg = tm->seg;
+    seg->magic      = RTN_TM_MAGIC;
+    seg->version    = RTN_TM_VERSION;
+    seg->pid        = getpid();
+    seg->interval   = interval;
+    seg->start_time = os_time_get_rt_ns();
+    snprintf(seg->role, sizeof(seg->role), "%s", opts->role_name);
+    options_to_str(opts, seg->cfg, sizeof(seg->cfg));
+
+    return tm;
+}
+
+// Register a source, the histograms (NULL when not measured) must stay valid
+// until `rtn_telemetry_detach` or `rtn_telemetry_stop`. Returns NULL when
+// telemetry is off (`tm` is NULL) or the source cannot be added, so the owner
+// can skip its counters.
+static rtn_tm_source *
+rtn_telemetry_add(rtn_telemetry *tm, const char *name, rtn_hist *latency, rtn_hist *jitter)
+{
+    if (tm == NULL)     return NULL;
+
+    rtn_hist *last_latency = latency ? malloc(sizeof(rtn_hist)) : NULL;
+    rtn_hist *last_jitter  = jitter  ? malloc(sizeof(rtn_hist)) : NULL;
+    if ((latency && last_latency == NULL) || (jitter && last_jitter == NULL)) {
+        fprintf(stderr, "Failed to allocate the telemetry source %s\n", name);
+        free(last_latency);
+        free(last_jitter);
+        return NULL;
+    }
+
+    if (last_latency)   rtn_hist_init(last_latency);
+    if (last_jitter)    rtn_hist_init(last_jitter);
+
+    os_mutex_lock(&tm->lock);
+    if (tm->num_sources == RTN_TM_MAX_SOURCES) {
+        os_mutex_unlock(&tm->lock);
+        free(last_latency);
+        free(last_jitter);
+        return NULL;
+    }
+
+    rtn_tm_source *src = &tm->sources[tm->num_sources++];
+    snprintf(src->name, sizeof(src->name), "%s", name);
+    src->latency      = latency;
+    src->jitter       = jitter;
+    src->last_latency = last_latency;
+    src->last_jitter  = last_jitter;
+
+    os_mutex_unlock(&tm->lock);
+    return src;
+}
+
+// Samples of `hist` since the previous update (in `tm->diff`), `last` is
+// replaced by the current snapshot.
+static const rtn_hist *
+rtn_tm_interval_hist(rtn_telemetry *tm, const rtn_hist *hist, rtn_hist *last)
+{
+    rtn_hist_snapshot(tm->cur, hist);
+    rtn_hist_diff(tm->diff, tm->cur, last);
+    memcpy(last->counts, tm->cur->counts, sizeof(last->counts));
+    return tm->diff;
+}
+
+static void
+rtn_tm_update_source(rtn_telemetry *tm, rtn_tm_source *src, rtn_tm_stats *stats, f64 elapsed)
+{
+    u64 packets = __atomic_load_n(&src->packets, __ATOMIC_RELAXED);
+    u64 drops   = __atomic_load_n(&src->drops, __ATOMIC_RELAXED);
+
+    snprintf(stats->name, sizeof(stats->name), "%s", src->name);
+    stats->packets          = packets;
+    stats->drops            = drops;
+    stats->interval_packets = packets - src->last_packets;
+    stats->interval_drops   = drops - src->last_drops;
+    stats->rate             = elapsed > 0 ? stats->interval_packets / elapsed : 0;
+
+    src->last_packets = packets;
+    src->last_drops   = drops;
+
+    if (src->latency) {
+        const rtn_hist *h    = rtn_tm_interval_hist(tm, src->latency, src->last_latency);
+        stats->latency_count = h->total;
+        stats->latency_p50   = rtn_hist_percentile(h, 50.0);
+        stats->latency_p99   = rtn_hist_percentile(h, 99.0);
+        stats->latency_p999  = rtn_hist_percentile(h, 99.9);
+        stats->latency_max   = h->total ? h->max : 0;
+    }
+
+    if (src->jitter) {
+        const rtn_hist *h   = rtn_tm_interval_hist(tm, src->jitter, src->last_jitter);
+        stats->jitter_count = h->total;
+        stats->jitter_p99   = rtn_hist_percentile(h, 99.0);
+        stats->jitter_max   = h->total ? h->max : 0;
+    }
+}
+
+// Called with the lock held.
+static void
+rtn_telemetry_publish(rtn_telemetry *tm, bool done)
+{
+    rtn_tm_segment *seg = tm->seg;
+    rtn_tm_stats stats[RTN_TM_MAX_SOURCES];
+    memset(stats, 0, sizeof(stats));
+
+    i64 now       = os_time_get_ns();
+    f64 elapsed   = (f64)(now - tm->last_time) / NSEC_PER_SEC;
+    tm->last_time = now;
+
+    for (u32 i = 0; i < tm->num_sources; i++)   rtn_tm_update_source(tm, &tm->sources[i], &stats[i], elapsed);
+
+    // seqlock write
+    __atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(seg->stats, stats, sizeof(stats));
+    seg->num_sources  = tm->num_sources;
+    seg->update_time  = os_time_get_rt_ns();
+    seg->num_updates += 1;
+    seg->done         = done;
+
+    __atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Publish the last stats of `src` and stop reading its histograms, they can
+// be freed once it returns. The counters of the source stay published.
+static void
+rtn_telemetry_detach(rtn_telemetry *tm, rtn_tm_source *src)
+{
+    if (tm == NULL || src == NULL)  return;
+
+    os_mutex_lock(&tm->lock);
+    rtn_telemetry_publish(tm, false);
+    src->latency = NULL;
+    src->jitter  = NULL;
+    os_mutex_unlock(&tm->lock);
+}
+
+static void *
+rtn_telemetry_thread_fn(void *arg)
+{
+    rtn_telemetry *tm = (rtn_telemetry *)arg;
+    os_thread_set_name(os_thread_self(), "rtn-telemetry");
+
+    i64 wakeup = tm->last_time + tm->interval;
+    while (!__atomic_load_n(&tm->stop, __ATOMIC_ACQUIRE)) {
+        struct timespec ts = { .tv_sec = wakeup / NSEC_PER_SEC, .tv_nsec = wakeup % NSEC_PER_SEC };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        wakeup += tm->interval;
+
+        os_mutex_lock(&tm->lock);
+        rtn_telemetry_publish(tm, false);
+        os_mutex_unlock(&tm->lock);
+    }
+
+    os_mutex_lock(&tm->lock);
+    rtn_telemetry_publish(tm, true);
+    os_mutex_unlock(&tm->lock);
+    return NULL;
+}
+
+// The publisher runs with SCHED_OTHER on any CPU, it must never delay the RT
+// threads.
+static int
+rtn_telemetry_start(rtn_telemetry *tm)
+{
+    tm->last_time = os_time_get_ns();
+    if (pthread_create(&tm->thread, NULL, rtn_telemetry_thread_fn, tm) != 0)   return -1;
+
+    os_thread_set_priority(tm->thread, OS_SCHED_OTHER, 0);
+    return 0;
+}
+
+// Publish the last stats and remove the segment: a viewer keeps its mapping
+// and shows the final state.
+static void
+rtn_telemetry_stop(rtn_telemetry *tm)
+{
+    __atomic_store_n(&tm->stop, true, __ATOMIC_RELEASE);
+    pthread_join(tm->thread, NULL);
+
+    munmap(tm->seg, sizeof(rtn_tm_segment));
+    shm_unlink(tm->path);
+
+    for (u32 i = 0; i < tm->num_sources; i++) {
+        free(tm->sources[i].last_latency);
+        free(tm->sources[i].last_jitter);
+    }
+    free(tm->cur);
+    free(tm->diff);
+    free(tm);
+}
+
+// ## Reader
+
+// Consistent copy of the segment, returns -1 when the writer keeps updating it.
+static int
+rtn_tm_segment_read(const rtn_tm_segment *seg, rtn_tm_segment *out)
+{
+    for (int retry = 0; retry < 1000; retry++) {
+        u32 seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)    continue;
+
+        memcpy(out, (const void *)seg, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq)    return 0;
+    }
+
+    return -1;
+}
+
+#endif // RTN_TELEMETRY_H
@@ -0,0 +1,132 @@
+////////////////////////////////////////////////////////////////////////////////
+// # RTN Telemetry Viewer
+//
+// Shows the live stats that `rtn --telemetry <name>` publishes in the shared
+// memory segment /rtn-<name> (see rtn_telemetry.h). The segment is only read:
+// the viewer never slows down the test.
+
+////////////////////////////////////////////////////////////////////////////////
+// # Includes
+#include "rtn_base.h"
+#include "rtn_telemetry.h"
+
+static char *usage_str =
+    "Usage: %s [-b] [-r ms] [name]\n"
+    "  name             telemetry name given to rtn --telemetry (default: rtn)\n"
+    "  -b, --batch      append the updates instead of refreshing the screen\n"
+    "  -r, --refresh    how often to check for updates, in ms (default: 100)\n";
+
+static struct option long_opts[] = {
+    { "batch",   no_argument,       NULL, 'b' },
+    { "refresh", required_argument, NULL, 'r' },
+    { "help",    no_argument,       NULL, 'h' },
+    { 0 },
+};
+
+// Nanoseconds as microseconds, "-" without samples.
+static void
+print_us(u64 count, i64 ns)
+{
+    if (count == 0)     printf(" %9s", "-");
+    else                printf(" %9.1f", ns / 1000.0);
+}
+
+static void
+print_segment(const rtn_tm_segment *seg, const char *path, const char *state)
+{
+    printf("%s: role=%s pid=%d update=%ld interval=%ldms elapsed=%.1fs [%s]\n",
+           path, seg->role, seg->pid, seg->num_updates, seg->interval / NSEC_PER_MSEC,
+           (seg->update_time - seg->start_time) / 1e9, state);
+    printf("cfg: %s\n\n", seg->cfg);
+
+    printf("%-16s %12s %10s %10s %8s %9s %9s %9s %9s %9s %9s\n",
+           "source", "packets", "rate/s", "drops", "+drops",
+           "lat p50", "lat p99", "p99.9", "lat max", "jit p99", "jit max");
+    for (u32 i = 0; i < seg->num_sources && i < RTN_TM_MAX_SOURCES; i++) {
+        const rtn_tm_stats *st = &seg->stats[i];
+        printf("%-16s %12ld %10.0f %10ld %8ld", st->name, st->packets, st->rate, st->drops, st->interval_drops);
+        print_us(st->latency_count, st->latency_p50);
+        print_us(st->latency_count, st->latency_p99);
+        print_us(st->latency_count, st->latency_p999);
+        print_us(st->latency_count, st->latency_max);
+        print_us(st->jitter_count, st->jitter_p99);
+        print_us(st->jitter_count, st->jitter_max);
+        printf("\n");
+    }
+    printf("(latency and jitter in us, over the last interval)\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Main
+int
+main(int argc, char *argv[])
+{
+    bool batch      = false;
+    i64  refresh_ms = 100;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "br:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'b': batch      = true;         break;
+            case 'r': refresh_ms = atoll(optarg); break;
+            case 'h':
+            default:
+                fprintf(stderr, usage_str, argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind < argc - 1 || refresh_ms <= 0) {
+        fprintf(stderr, usage_str, argv[0]);
+        exit(1);
+    }
+
+    char path[64];
+    rtn_tm_segment_path(path, sizeof(path), optind < argc ? argv[optind] : "rtn");
+
+    // wait for the test to start
+    int fd = -1;
+    for (bool waiting = false; (fd = shm_open(path, O_RDONLY, 0)) < 0; waiting = true) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        if (!waiting)   fprintf(stderr, "Waiting for %s...\n", path);
+        usleep(refresh_ms * 1000);
+    }
+
+    const rtn_tm_segment *seg = mmap(NULL, sizeof(rtn_tm_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    rtn_tm_segment *copy = malloc(sizeof(rtn_tm_segment));
+    u64 last_update      = 0;
+    for (;;) {
+        if (rtn_tm_segment_read(seg, copy) < 0 || copy->magic != RTN_TM_MAGIC || copy->version != RTN_TM_VERSION) {
+            usleep(refresh_ms * 1000);
+            continue;
+        }
+
+        // the publisher may die without its last update
+        bool alive = kill(copy->pid, 0) == 0 || errno != ESRCH;
+        if (copy->num_updates != last_update || copy->done || !alive) {
+            const char *state = copy->done ? "done" : alive ? "running" : "exited";
+            if (!batch)     printf("\x1b[H\x1b[2J");
+            print_segment(copy, path, state);
+            if (batch)      printf("\n");
+            fflush(stdout);
+
+            last_update = copy->num_updates;
+            if (copy->done || !alive)   break;
+        }
+
+        usleep(refresh_ms * 1000);
+    }
+
+    free(copy);
+    munmap((void *)seg, sizeof(rtn_tm_segment));
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "rtn_tpacket.h"
+#include "rtn_stats.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Create and Destroy
+static rtn_tpacket *
+rtn_tpacket_new(int fd)
+{
+    rtn_tpacket *ring = calloc(1, sizeof(rtn_tpacket));
+    if (ring == NULL) {
+        perror("calloc(tpacket)");
+        return NULL;
+    }
+
+    ring->fd = fd;
+
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("setsockopt(PACKET_VERSION)");
+        goto exit_error;
+    }
+
+    // frame timestamps: raw hardware when the NIC provides them, the kernel
+    // falls back to software timestamps otherwise
+    int ts = SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TIMESTAMP, &ts, sizeof(ts)) < 0) {
+        perror("setsockopt(PACKET_TIMESTAMP)");
+    }
+
+    struct tpacket_req3 req = {
+        .tp_block_size       = RTN_TPACKET_BLOCK_SIZE,
+        .tp_block_nr         = RTN_TPACKET_BLOCK_NR,
+        .tp_frame_size       = RTN_TPACKET_FRAME_SIZE,
+        .tp_frame_nr         = RTN_TPACKET_BLOCK_SIZE / RTN_TPACKET_FRAME_SIZE * RTN_TPACKET_BLOCK_NR,
+        .tp_retire_blk_tov   = RTN_TPACKET_RETIRE_TOV,
+        .tp_feature_req_word = 0,
+    };
+
+    ring->rx_req = req;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &ring->rx_req, sizeof(ring->rx_req)) < 0) {
+        perror("setsockopt(PACKET_RX_RING)");
+        goto exit_error;
+    }
+
+    // TX frames have a fixed size, the retire timeout does not apply
+    ring->tx_req = req;
+    ring->tx_req.tp_retire_blk_tov = 0;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &ring->tx_req, sizeof(ring->tx_req)) < 0) {
+        perror("setsockopt(PACKET_TX_RING)");
+        goto exit_error;
+    }
+
+    // both rings share one mapping, RX first
+    usize rx_len  = (usize)req.tp_block_size * req.tp_block_nr;
+    usize tx_len  = (usize)req.tp_block_size * req.tp_block_nr;
+    ring->map_len = rx_len + tx_len;
+    ring->map     = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, fd, 0);
+    if (ring->map == MAP_FAILED) {
+        perror("mmap(PACKET_MMAP)");
+        ring->map = NULL;
+        goto exit_error;
+    }
+
+    ring->rx_ring = ring->map;
+    ring->tx_ring = ring->map + rx_len;
+    return ring;
+
+exit_error:
+    rtn_tpacket_destroy(ring);
+    return NULL;
+}
+
+static void
+rtn_tpacket_destroy(rtn_tpacket *ring)
+{
+    if (ring->map)  munmap(ring->map, ring->map_len);
+    free(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Receive and Send
+static inline u32  rtn_tpacket_load_status  (volatile u32 *status)          { return __atomic_load_n(status, __ATOMIC_ACQUIRE); }
+static inline void rtn_tpacket_store_status (volatile u32 *status, u32 val) { __atomic_store_n(status, val, __ATOMIC_RELEASE); }
+
+static int
+rtn_tpacket_send(rtn_tpacket *ring, const rtn_frame_tmpl *tmpl, const void *data, usize datasize, int flags)
+{
+    // the data follows the (aligned) frame header, see TPACKET3_HDRLEN
+    usize data_off = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+    if (data_off + tmpl->hdr_len + datasize > ring->tx_req.tp_frame_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    u8 *frame = ring->tx_ring + (usize)ring->tx_frame * ring->tx_req.tp_frame_size;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)frame;
+
+    // wait for the kernel to release the slot (ring full)
+    for (;;) {
+        u32 status = rtn_tpacket_load_status(&hdr->tp_status);
+        if (status == TP_STATUS_AVAILABLE)      break;
+        if (status & TP_STATUS_WRONG_FORMAT) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        send(ring->fd, NULL, 0, MSG_DONTWAIT);
+    }
+
+    hdr->tp_len         = rtn_frame_build(tmpl, frame + data_off, data, datasize);
+    hdr->tp_next_offset = 0;
+    rtn_tpacket_store_status(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+
+    ring->tx_frame = (ring->tx_frame + 1) % ring->tx_req.tp_frame_nr;
+
+    if (!(flags & MSG_MORE)) {
+        // ENOBUFS/EAGAIN: the frames stay queued and go out with the next flush
+        if (send(ring->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != ENOBUFS && errno != EAGAIN) {
+            return -1;
+        }
+    }
+
+    return datasize;
+}
+
+static int
+rtn_tpacket_receive(rtn_tpacket *ring, void *data, usize datasize, struct rtn_pkt_stat *pstat, int flags)
+{
+    for (;;) {
+        struct tpacket_block_desc *bd = (struct tpacket_block_desc *)(ring->rx_ring + (usize)ring->rx_block * ring->rx_req.tp_block_size);
+
+        if (ring->rx_frame == NULL) {
+            if (!(rtn_tpacket_load_status(&bd->hdr.bh1.block_status) & TP_STATUS_USER)) {
+                if (flags & MSG_DONTWAIT) {
+                    errno = EAGAIN;
+                    return -1;
+                }
+
+                struct pollfd pfd = { .fd = ring->fd, .events = POLLIN | POLLERR };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)   return -1;
+                continue;
+            }
+
+            ring->rx_frame = (struct tpacket3_hdr *)((u8 *)bd + bd->hdr.bh1.offset_to_first_pkt);
+            ring->rx_left  = bd->hdr.bh1.num_pkts;
+        }
+
+        int len = -1;
+        if (ring->rx_left > 0) {
+            struct tpacket3_hdr *frame = ring->rx_frame;
+            const u8 *mac = (const u8 *)frame + frame->tp_mac;
+
+            // the VLAN tag is normally stripped (tp_vlan_tci), otherwise skip it
+            usize hlen = ETH_HLEN;
+            u16 proto;
+            memcpy(&proto, mac + 2 * ETH_ALEN, sizeof(proto));
+            if (proto == htons(ETH_P_8021Q))    hlen += RTN_VLAN_HLEN;
+
+            if (frame->tp_snaplen >= hlen) {
+                len = frame->tp_snaplen - hlen;
+                if ((usize)len > datasize)  len = datasize;
+                memcpy(data, mac + hlen, len);
+            }
+
+            if (pstat) {
+                i64 ts = (i64)frame->tp_sec * NSEC_PER_SEC + frame->tp_nsec;
+                if (frame->tp_status & TP_STATUS_TS_RAW_HARDWARE)   pstat->rx_tstamps.hw_ts = ts;
+                else                                                pstat->rx_tstamps.sw_ts = ts;
+            }
+
+            ring->rx_frame = (struct tpacket3_hdr *)((u8 *)frame + frame->tp_next_offset);
+            ring->rx_left -= 1;
+        }
+
+        // block done, give it back to the kernel
+        if (ring->rx_left == 0) {
+            rtn_tpacket_store_status(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL);
+            ring->rx_block = (ring->rx_block + 1) % ring->rx_req.tp_block_nr;
+            ring->rx_frame = NULL;
+        }
+
+        if (len >= 0)   return len;
+    }
+}
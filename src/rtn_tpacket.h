@@ -0,0 +1,58 @@
+#ifndef RTN_TPACKET_H
+#define RTN_TPACKET_H
+
+#include "rtn_base.h"
+#include "rtn_frame.h"
+
+#include <poll.h>
+
+struct rtn_pkt_stat;
+
+////////////////////////////////////////////////////////////////////////////////
+// # PACKET_MMAP Rings (TPACKET_V3)
+//
+// Memory-mapped RX and TX rings on top of a raw AF_PACKET socket.
+//
+// RX: the kernel fills blocks of frames and hands a whole block to user space
+// when it is full or when the retire timeout expires; frames are then walked
+// without any syscall. Small blocks and the minimum timeout (1 ms) keep the
+// hand-off delay low, the kernel RX timestamp of each frame is unaffected.
+//
+// TX: frames are written into the ring and marked SEND_REQUEST, a single
+// send() flushes everything that is queued.
+
+#define RTN_TPACKET_BLOCK_SIZE  (1 << 14)
+#define RTN_TPACKET_BLOCK_NR    64
+#define RTN_TPACKET_FRAME_SIZE  2048
+#define RTN_TPACKET_RETIRE_TOV  1       // ms
+
+typedef struct rtn_tpacket rtn_tpacket;
+struct rtn_tpacket
+{
+    int    fd;
+
+    u8    *map;
+    usize  map_len;
+
+    // RX ring
+    struct tpacket_req3  rx_req;
+    u8                  *rx_ring;
+    u32                  rx_block;      // block being walked
+    struct tpacket3_hdr *rx_frame;      // next frame of the block, NULL if the block is not open
+    u32                  rx_left;       // frames left in the block
+
+    // TX ring
+    struct tpacket_req3  tx_req;
+    u8                  *tx_ring;
+    u32                  tx_frame;      // next frame to fill
+};
+
+static rtn_tpacket *rtn_tpacket_new     (int fd);
+static void         rtn_tpacket_destroy (rtn_tpacket *ring);
+
+// Same semantics of rtn_xsk_send/rtn_xsk_receive: MSG_DONTWAIT does not block,
+// MSG_MORE queues the frame without flushing the TX ring.
+static int rtn_tpacket_send    (rtn_tpacket *ring, const rtn_frame_tmpl *tmpl, const void *data, usize datasize, int flags);
+static int rtn_tpacket_receive (rtn_tpacket *ring, void *data, usize datasize, struct rtn_pkt_stat *pstat, int flags);
+
+#endif // RTN_TPACKET_H
@@ -3,54 +3,77 @@
 
 #include "rtn_base.h"
 
+#include "rtn_control.h"
+#include "rtn_cycle.h"
 #include "rtn_options.h"
 #include "rtn_socket.h"
 #include "rtn_stats.h"
 #include "rtn_packet.h"
 
+static int do_tx_burst(options_t *opts, rtn_socket *sock, rtn_ring *stats);
+
+// The cycles and the page faults of the loop (`faults` taken before it).
+static void
+tx_report(options_t *opts, const rtn_cycle *cycle, os_faults faults)
+{
+    char name[32];
+    if (opts->num_streams > 0)  snprintf(name, sizeof(name), "TX p%d", opts->port);
+    else                        snprintf(name, sizeof(name), "TX");
+
+    rtn_cycle_report(cycle, name, stderr);
+    os_faults_print(os_faults_since(faults, RUSAGE_THREAD), name, stderr);
+}
+
 static int
-do_tx(options_t *opts, rtn_socket *sock)
+do_tx(options_t *opts, rtn_socket *sock, rtn_ring *stats)
 {        
+    if (opts->burst_size > 1)   return do_tx_burst(opts, sock, stats);
+
     i64 start_time  = os_time_get_rt_ns();
-    i64 wakeup_time = os_time_normalize_ts(start_time + 2 * NSEC_PER_SEC);
+    i64 wakeup_time = opts->start_time ? opts->start_time : os_time_normalize_ts(start_time + 2 * NSEC_PER_SEC);
 
     info("TX: Start time=%ld, Wakeup time=%ld, Total packets=%ld\n", start_time, wakeup_time, opts->num_packets);
 
+    // launch time mode: wake up `txtime_lead` early, the qdisc sends the
+    // packet at the wakeup time (CLOCK_TAI)
+    i64 lead       = opts->txtime_lead;
+    i64 tai_offset = os_time_get_tai_ns() - os_time_get_rt_ns();
+
+    rtn_cycle *cycle = os_vm_alloc(sizeof(rtn_cycle));
+    if (cycle == NULL) {
+        error("Failed to allocate the cycle\n");
+        exit(1);
+    }
+
+    rtn_cycle_init(cycle, &(rtn_cycle_config) { .clock = CLOCK_REALTIME, .period = opts->cycle_time, .lead = lead,
+                   .overrun = opts->overrun_policy, .wait = opts->wait_mode, .spin_margin = opts->spin_margin,
+                   .tsc = opts->clock_type == CLOCK_TYPE_TSC }, wakeup_time);
+
+    rtn_pkt_pool *pool = rtn_pkt_pool_new(1, opts->packet_size, &(payload_t) { .type = PAYLOAD_TYPE_DATA });
+    if (pool == NULL) {
+        error("Failed to allocate the packet buffer\n");
+        exit(1);
+    }
+
     // signal the stats thread to start
     os_sem_post(&opts->sem_stats_start);
 
-    char *packet = malloc(opts->packet_size);
+    u8 *packet         = rtn_pkt_pool_get(pool, 0);
+    payload_t *payload = rtn_pkt_pool_payload(pool, 0);
 
     int ret;
-    u64 pkt_count = 0;
-    bool stop     = false;
-    while (!stop) 
+    u64 pkt_count    = 0;
+    os_faults faults = os_faults_get(RUSAGE_THREAD);
+    while (pkt_count < opts->num_packets) 
     {
-        memset(packet, 0, opts->packet_size);
-
-        struct timespec sleep_ts = {
-            .tv_sec  = wakeup_time / NSEC_PER_SEC,
-            .tv_nsec = wakeup_time % NSEC_PER_SEC,
-        };
-        ret = clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &sleep_ts, NULL);
-        if (ret == -1) {
-            perror("clock_nanosleep");
-            exit(1);
-        }
-
-        i64 now = os_time_get_rt_ns();
+        i64 now;
+        wakeup_time = rtn_cycle_wait(cycle, &now);
 
-        // Create the packet
-        payload_t *payload = (payload_t *)packet;
-        payload->type      = PAYLOAD_TYPE_DATA;
+        // Patch the packet
         payload->timestamp = now;
         payload->seqno     = pkt_count;
 
-        // Check if this is the last packet
-        if (pkt_count == opts->num_packets - 1) {
-            payload->type = PAYLOAD_TYPE_END;
-            stop          = true;
-        }
+        sock->txtime = wakeup_time + tai_offset;
 
         ret = rtn_socket_send_message(sock, packet, opts->packet_size, 0);
         if (ret == -1) {
@@ -59,53 +82,320 @@ do_tx(options_t *opts, rtn_socket *sock)
         }
 
         // Update packet stats
-        rtn_pkt_stat *pkt_stat      = &g_pkt_stats.stats[pkt_count];
-        pkt_stat->id                = pkt_count;
-        pkt_stat->app_tstamps.tx_ts = now;
+        rtn_pkt_stat scratch;
+        rtn_pkt_stat *pkt_stat = stats_reserve(stats, &scratch);
+        *pkt_stat = (rtn_pkt_stat) {
+            .id                 = pkt_count,
+            .app_tstamps.tx_ts  = now,
+            .txtime.deadline    = lead > 0 ? wakeup_time : 0,
+        };
+        stats_commit(stats, pkt_stat, &scratch);
+
+        pkt_count += 1;
+    }
+
+    rtn_ring_close(stats);
+
+    info("TX: Sent %ld packets\n", pkt_count);
+    tx_report(opts, cycle, faults);
+    os_vm_free(cycle, sizeof(rtn_cycle));
+    rtn_pkt_pool_destroy(pool);
+
+    return pkt_count;
+}
 
-        // Update wakeup time for next packet
-        wakeup_time += opts->cycle_time;
-        pkt_count   += 1;
+// Burst mode: every cycle `burst_size` packets are handed to the kernel with
+// one sendmmsg. The kernel still assigns one OPT_ID per datagram, so the ids
+// used by the stats thread keep matching `pkt_count`.
+static int
+do_tx_burst(options_t *opts, rtn_socket *sock, rtn_ring *stats)
+{
+    i64 start_time  = os_time_get_rt_ns();
+    i64 wakeup_time = opts->start_time ? opts->start_time : os_time_normalize_ts(start_time + 2 * NSEC_PER_SEC);
+
+    info("TX: Start time=%ld, Wakeup time=%ld, Total packets=%ld, Burst=%d\n", 
+         start_time, wakeup_time, opts->num_packets, opts->burst_size);
+
+    i64 lead       = opts->txtime_lead;
+    i64 tai_offset = os_time_get_tai_ns() - os_time_get_rt_ns();
+
+    rtn_socket_batch *batch = rtn_socket_batch_new(opts->burst_size, opts->packet_size);
+    if (batch == NULL) {
+        error("Failed to allocate the burst buffers\n");
+        exit(1);
+    }
+
+    rtn_cycle *cycle = os_vm_alloc(sizeof(rtn_cycle));
+    if (cycle == NULL) {
+        error("Failed to allocate the cycle\n");
+        exit(1);
+    }
+
+    rtn_cycle_init(cycle, &(rtn_cycle_config) { .clock = CLOCK_REALTIME, .period = opts->cycle_time, .lead = lead,
+                   .overrun = opts->overrun_policy, .wait = opts->wait_mode, .spin_margin = opts->spin_margin,
+                   .tsc = opts->clock_type == CLOCK_TYPE_TSC }, wakeup_time);
+
+    // signal the stats thread to start
+    os_sem_post(&opts->sem_stats_start);
+
+    int ret;
+    u64 pkt_count    = 0;
+    os_faults faults = os_faults_get(RUSAGE_THREAD);
+    while (pkt_count < opts->num_packets) 
+    {
+        usize count = opts->num_packets - pkt_count;
+        if (count > batch->size)    count = batch->size;
+
+        i64 now;
+        wakeup_time = rtn_cycle_wait(cycle, &now);
+
+        for (usize i = 0; i < count; i++) {
+            payload_t *payload = (payload_t *)rtn_socket_batch_buf(batch, i);
+            payload->type      = PAYLOAD_TYPE_DATA;
+            payload->timestamp = now;
+            payload->seqno     = pkt_count + i;
+        }
+
+        sock->txtime = wakeup_time + tai_offset;
+        ret = rtn_socket_send_batch(sock, batch, count, opts->packet_size, 0);
+        if (ret != (int)count) {
+            perror("sendmmsg");
+            exit(1);
+        }
+
+        // Update packet stats, all the packets of the burst left the
+        // application with the same sendmmsg call.
+        for (usize i = 0; i < count; i++) {
+            rtn_pkt_stat scratch;
+            rtn_pkt_stat *pkt_stat = stats_reserve(stats, &scratch);
+            *pkt_stat = (rtn_pkt_stat) {
+                .id                 = pkt_count + i,
+                .app_tstamps.tx_ts  = now,
+                .txtime.deadline    = lead > 0 ? wakeup_time : 0,
+            };
+            stats_commit(stats, pkt_stat, &scratch);
+        }
+
+        pkt_count += count;
     }
 
+    rtn_ring_close(stats);
+
     info("TX: Sent %ld packets\n", pkt_count);
+    tx_report(opts, cycle, faults);
+    os_vm_free(cycle, sizeof(rtn_cycle));
+
+    rtn_socket_batch_destroy(batch);
+
+    return pkt_count;
+}
+
+static int do_rx_burst(options_t *opts, rtn_socket *sock, rtn_ring *stats);
+
+// There is no end packet in the stream, a lost one would hang the receiver.
+// The receiver wakes up every RTN_RX_IDLE without a packet and stops:
+// - with the control channel, once the sender is done (rtn_control.h),
+// - without it, after RTN_RX_IDLE_END (at least 10 cycles) without a packet
+//   since the last one, the last packets may have been lost.
+// The receivers of a reuseport group stop together: the first one that sees
+// the end tells the others (opts->rx_group_stop), the other flows may still
+// be running. The independent streams of --stream stop on their own.
+//
+// The kernel sockets block in the receive call with a timeout (SO_RCVTIMEO,
+// see open_socket), the others do not support it: they receive with
+// MSG_DONTWAIT and wait in rtn_socket_poll.
+#define RTN_RX_IDLE         (100 * NSEC_PER_MSEC)
+#define RTN_RX_IDLE_END     (1 * NSEC_PER_SEC)
+
+static inline bool
+rx_has_rcv_timeout(const rtn_socket *sock)
+{
+    return (sock->type == RTN_SOCK_TYPE_UDP || sock->type == RTN_SOCK_TYPE_RAW) && sock->uring == NULL;
+}
+
+// The receive call returned EAGAIN, returns true when the receiver was idle
+// for RTN_RX_IDLE.
+static inline bool
+rx_wait(rtn_socket *sock)
+{
+    return rx_has_rcv_timeout(sock) || rtn_socket_poll(sock, RTN_RX_IDLE) == 0;
+}
+
+// Idle receiver: returns 1 when the test is over, `last` is the stamp of the
+// last packet (os_time_stamp), 0 before the first one.
+static int
+rx_idle(options_t *opts, i64 last, bool tsc)
+{
+    if (opts->rx_queues > 0 && __atomic_load_n(opts->rx_group_stop, __ATOMIC_ACQUIRE))  return 1;
+
+    if (opts->control) {
+        if (!rtn_ctrl_sender_done(opts->control))   return 0;
+    } else {
+        i64 limit = 10 * (i64)opts->cycle_time;
+        if (limit < RTN_RX_IDLE_END)    limit = RTN_RX_IDLE_END;
+
+        i64 idle = os_time_get_rt_ns() - os_time_stamp_to_ns(tsc, last);
+        if (last == 0 || idle < limit)  return 0;
 
-    return pkt_count - 1; // The END is not counted.
+        info("RX: no packet for %ld ms, end of the test\n", idle / NSEC_PER_MSEC);
+    }
+
+    if (opts->rx_queues > 0)    __atomic_store_n(opts->rx_group_stop, true, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void
+rx_report(options_t *opts, os_faults faults)
+{
+    char name[32], stream[16];
+    options_stream_name(opts, stream, sizeof(stream));
+    if (opts->num_streams > 0)  snprintf(name, sizeof(name), "RX %s", stream);
+    else                        snprintf(name, sizeof(name), "RX");
+
+    os_faults_print(os_faults_since(faults, RUSAGE_THREAD), name, stderr);
 }
 
 static int
-do_rx(options_t *opts, rtn_socket *sock)
+do_rx(options_t *opts, rtn_socket *sock, rtn_ring *stats)
 {
+    if (opts->burst_size > 1)   return do_rx_burst(opts, sock, stats);
+
     info("RX: Listening for packets...\n");
 
+    bool tsc = opts->clock_type == CLOCK_TYPE_TSC;
+
+    // signal the stats thread to start
+    os_sem_post(&opts->sem_stats_start);
+
+    rtn_pkt_pool *pool = rtn_pkt_pool_new(1, opts->packet_size, NULL);
+    if (pool == NULL) {
+        error("Failed to allocate the packet buffer\n");
+        exit(1);
+    }
+
     int ret;
-    int stop        = 0;
-    char *packet    = malloc(opts->packet_size);
-    size_t num_pkts = 0;
+    int stop         = 0;
+    int flags        = rx_has_rcv_timeout(sock) ? 0 : MSG_DONTWAIT;
+    i64 last         = 0;
+    u8 *packet       = rtn_pkt_pool_get(pool, 0);
+    size_t num_pkts  = 0;
+    os_faults faults = os_faults_get(RUSAGE_THREAD);
     while (!stop) {
-        rtn_pkt_stat *stat = &g_pkt_stats.stats[num_pkts];
-        ret = rtn_socket_receive_message(sock, packet, opts->packet_size, stat, 0);
+        // the record is committed only for DATA packets, otherwise the slot
+        // is reused by the next packet
+        rtn_pkt_stat scratch;
+        rtn_pkt_stat *stat = stats_reserve(stats, &scratch);
+        memset(stat, 0, sizeof(*stat));
+
+        ret = rtn_socket_receive_message(sock, packet, opts->packet_size, stat, flags);
         if (ret == -1) {
-            if (errno == EAGAIN)    continue;
+            if (errno == EAGAIN) {
+                if (rx_wait(sock))  stop = rx_idle(opts, last, tsc);
+                continue;
+            }
 
             perror("recvmsg");
             exit(1);
         }
 
-        i64 now = os_time_get_rt_ns();
+        i64 now = os_time_stamp(tsc);     // raw cycles with --clock tsc, converted by the stats thread
 
         payload_t *payload = (payload_t *)packet;
         switch (payload->type) {
             case PAYLOAD_TYPE_IGNORE:   continue;
-            case PAYLOAD_TYPE_END:      stop = 1; break;
             case PAYLOAD_TYPE_DATA: {   
                 stat->id                 = payload->seqno;
+                stat->app_tstamps.tx_ts  = payload->timestamp;
                 stat->app_tstamps.rx_ts  = now;
                 num_pkts                += 1;
+                last                     = now;
+                stats_commit(stats, stat, &scratch);
             } break;
         }
     }
 
+    rtn_ring_close(stats);
+    rtn_pkt_pool_destroy(pool);
+    rx_report(opts, faults);
+
+    return num_pkts;
+}
+
+// Burst mode: drain up to `burst_size` datagrams per recvmmsg. The receive
+// timestamps are parsed in a per-burst array, the DATA records are then
+// pushed to the stats ring.
+static int
+do_rx_burst(options_t *opts, rtn_socket *sock, rtn_ring *stats_ring)
+{
+    info("RX: Listening for packets (burst=%d)...\n", opts->burst_size);
+
+    bool tsc = opts->clock_type == CLOCK_TYPE_TSC;
+
+    rtn_socket_batch *batch = rtn_socket_batch_new(opts->burst_size, opts->packet_size);
+    if (batch == NULL) {
+        error("Failed to allocate the burst buffers\n");
+        exit(1);
+    }
+
+    rtn_pkt_stat *stats = os_vm_alloc(opts->burst_size * sizeof(rtn_pkt_stat));
+    if (stats == NULL) {
+        error("Failed to allocate the burst stats\n");
+        exit(1);
+    }
+
+    // signal the stats thread to start
+    os_sem_post(&opts->sem_stats_start);
+
+    int ret;
+    int stop         = 0;
+    int flags        = rx_has_rcv_timeout(sock) ? 0 : MSG_DONTWAIT;
+    i64 last         = 0;
+    size_t num_pkts  = 0;
+    os_faults faults = os_faults_get(RUSAGE_THREAD);
+    while (!stop) {
+        memset(stats, 0, opts->burst_size * sizeof(rtn_pkt_stat));
+        ret = rtn_socket_receive_batch(sock, batch, opts->burst_size, stats, flags);
+        if (ret == -1) {
+            if (errno == EAGAIN) {
+                if (rx_wait(sock))  stop = rx_idle(opts, last, tsc);
+                continue;
+            }
+            if (errno == EINTR)     continue;
+
+            perror("recvmmsg");
+            exit(1);
+        }
+
+        i64 now = os_time_stamp(tsc);     // raw cycles with --clock tsc, converted by the stats thread
+
+        for (int i = 0; i < ret; i++) {
+            payload_t *payload = (payload_t *)rtn_socket_batch_buf(batch, i);
+            switch (payload->type) {
+                case PAYLOAD_TYPE_IGNORE:   continue;
+                case PAYLOAD_TYPE_DATA: {
+                    rtn_pkt_stat scratch;
+                    rtn_pkt_stat *stat = stats_reserve(stats_ring, &scratch);
+                    *stat = (rtn_pkt_stat) {
+                        .id                 = payload->seqno,
+                        .app_tstamps.tx_ts  = payload->timestamp,
+                        .app_tstamps.rx_ts  = now,
+                        .rx_tstamps         = stats[i].rx_tstamps,
+                        .flow               = stats[i].flow,
+                    };
+                    stats_commit(stats_ring, stat, &scratch);
+                    num_pkts += 1;
+                    last      = now;
+                } break;
+            }
+        }
+    }
+
+    rtn_ring_close(stats_ring);
+    rx_report(opts, faults);
+
+    os_vm_free(stats, opts->burst_size * sizeof(rtn_pkt_stat));
+    rtn_socket_batch_destroy(batch);
+
     return num_pkts;
 }
 
@@ -0,0 +1,436 @@
+#include "rtn_uring.h"
+
+#define RTN_URING_RECV_TAG  (1ull << 63)   // user_data of the multishot receive
+
+////////////////////////////////////////////////////////////////////////////////
+// # Rings
+static inline u32  rtn_uring_load_acquire  (u32 *ptr)          { return __atomic_load_n(ptr, __ATOMIC_ACQUIRE); }
+static inline void rtn_uring_store_release (u32 *ptr, u32 val) { __atomic_store_n(ptr, val, __ATOMIC_RELEASE); }
+
+static inline long
+rtn_sys_io_uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Publish the pending SQEs and, when needed, enter the kernel: to submit them
+// (no SQPOLL), to wake up the SQPOLL thread or to wait for `min_complete`
+// completions.
+static int
+rtn_uring_submit(rtn_uring *ur, u32 min_complete)
+{
+    u32 to_submit = ur->sq.pending;
+    u32 flags     = 0;
+
+    if (to_submit > 0) {
+        rtn_uring_store_release(ur->sq.tail, *ur->sq.tail + to_submit);
+        ur->sq.pending = 0;
+    }
+
+    if (ur->setup_flags & IORING_SETUP_SQPOLL) {
+        // the kernel thread reads the tail without a syscall, it has only to
+        // be woken up when it went idle
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(ur->sq.flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)  flags |= IORING_ENTER_SQ_WAKEUP;
+        to_submit = 0;
+    }
+
+    if (min_complete > 0)   flags |= IORING_ENTER_GETEVENTS;
+    if (to_submit == 0 && flags == 0)   return 0;
+
+    for (;;) {
+        ur->num_enter += 1;
+        long res = rtn_sys_io_uring_enter(ur->ring_fd, to_submit, min_complete, flags);
+        if (res >= 0)                           return 0;
+        if (errno == EINTR && min_complete)     return 0;   // let the caller check its condition again
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+static struct io_uring_sqe *
+rtn_uring_get_sqe(rtn_uring *ur)
+{
+    u32 entries = *ur->sq.mask + 1;
+
+    // the SQ is full only when the SQPOLL thread lags behind
+    for (;;) {
+        u32 tail = *ur->sq.tail + ur->sq.pending;
+        if (tail - rtn_uring_load_acquire(ur->sq.head) < entries) {
+            u32 idx = tail & *ur->sq.mask;
+            ur->sq.array[idx] = idx;
+            ur->sq.pending   += 1;
+
+            struct io_uring_sqe *sqe = &ur->sq.sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+
+        rtn_uring_submit(ur, 0);
+        sched_yield();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Provided Buffers
+static inline u8 *rtn_uring_recv_buf (rtn_uring *ur, u16 bid) { return ur->recv_bufs + (usize)bid * RTN_URING_BUF_SIZE; }
+
+static inline void
+rtn_uring_recycle_buf(rtn_uring *ur, u16 bid)
+{
+    u16 tail = ur->buf_ring->tail;
+    struct io_uring_buf *buf = &ur->buf_ring->bufs[tail & (RTN_URING_RECV_BUFS - 1)];
+    buf->addr = (u64)(uintptr_t)rtn_uring_recv_buf(ur, bid);
+    buf->len  = RTN_URING_BUF_SIZE;
+    buf->bid  = bid;
+    __atomic_store_n(&ur->buf_ring->tail, (u16)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static void
+rtn_uring_arm_recv(rtn_uring *ur)
+{
+    struct io_uring_sqe *sqe = rtn_uring_get_sqe(ur);
+    sqe->opcode    = IORING_OP_RECVMSG;
+    sqe->fd        = ur->sock_fd;
+    sqe->addr      = (u64)(uintptr_t)&ur->recv_msg;
+    sqe->len       = 1;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = RTN_URING_RECV_TAG;
+
+    ur->recv_armed = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Create and Destroy
+static rtn_uring *
+rtn_uring_new(int sock_fd, const rtn_uring_config *cfg)
+{
+    rtn_uring *ur = calloc(1, sizeof(rtn_uring));
+    if (ur == NULL) {
+        perror("calloc(uring)");
+        return NULL;
+    }
+
+    ur->ring_fd = -1;
+    ur->sock_fd = sock_fd;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * RTN_URING_ENTRIES;
+    if (cfg->sqpoll) {
+        params.flags         |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = RTN_URING_SQPOLL_IDLE;
+        if (cfg->sqpoll_cpu >= 0) {
+            params.flags         |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu  = cfg->sqpoll_cpu;
+        }
+    }
+
+    ur->ring_fd = syscall(__NR_io_uring_setup, RTN_URING_ENTRIES, &params);
+    if (ur->ring_fd < 0) {
+        perror("io_uring_setup");
+        goto exit_error;
+    }
+    ur->setup_flags = params.flags;
+
+    ur->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ur->cq_map_len = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_map_len > ur->sq_map_len)    ur->sq_map_len = ur->cq_map_len;
+    }
+
+    ur->sq_map = mmap(NULL, ur->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+    if (ur->sq_map == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQ_RING)");
+        ur->sq_map = NULL;
+        goto exit_error;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_map = ur->sq_map;
+    } else {
+        ur->cq_map = mmap(NULL, ur->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+        if (ur->cq_map == MAP_FAILED) {
+            perror("mmap(IORING_OFF_CQ_RING)");
+            ur->cq_map = NULL;
+            goto exit_error;
+        }
+    }
+
+    ur->sqes_map_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes_map     = mmap(NULL, ur->sqes_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+    if (ur->sqes_map == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQES)");
+        ur->sqes_map = NULL;
+        goto exit_error;
+    }
+
+    u8 *sq = ur->sq_map;
+    ur->sq.head  = (u32 *)(sq + params.sq_off.head);
+    ur->sq.tail  = (u32 *)(sq + params.sq_off.tail);
+    ur->sq.mask  = (u32 *)(sq + params.sq_off.ring_mask);
+    ur->sq.flags = (u32 *)(sq + params.sq_off.flags);
+    ur->sq.array = (u32 *)(sq + params.sq_off.array);
+    ur->sq.sqes  = ur->sqes_map;
+
+    u8 *cq = ur->cq_map;
+    ur->cq.head  = (u32 *)(cq + params.cq_off.head);
+    ur->cq.tail  = (u32 *)(cq + params.cq_off.tail);
+    ur->cq.mask  = (u32 *)(cq + params.cq_off.ring_mask);
+    ur->cq.cqes  = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Send slots
+    ur->slots      = calloc(RTN_URING_SEND_SLOTS, sizeof(rtn_uring_send_slot));
+    ur->slot_free  = calloc(RTN_URING_SEND_SLOTS, sizeof(u32));
+    ur->slot_bufs  = aligned_alloc(64, RTN_URING_SEND_SLOTS * RTN_URING_BUF_SIZE);
+    if (ur->slots == NULL || ur->slot_free == NULL || ur->slot_bufs == NULL) {
+        perror("alloc");
+        goto exit_error;
+    }
+
+    memset(ur->slot_bufs, 0, RTN_URING_SEND_SLOTS * RTN_URING_BUF_SIZE);
+    for (u32 i = 0; i < RTN_URING_SEND_SLOTS; i++) {
+        ur->slots[i].buf = ur->slot_bufs + (usize)i * RTN_URING_BUF_SIZE;
+        ur->slot_free[ur->slot_nfree++] = i;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Provided buffers for the multishot receive
+    usize buf_ring_len = RTN_URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    ur->buf_ring = mmap(NULL, buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ur->buf_ring == MAP_FAILED) {
+        perror("mmap(buf_ring)");
+        ur->buf_ring = NULL;
+        goto exit_error;
+    }
+
+    ur->recv_bufs = aligned_alloc(64, RTN_URING_RECV_BUFS * RTN_URING_BUF_SIZE);
+    if (ur->recv_bufs == NULL) {
+        perror("aligned_alloc");
+        goto exit_error;
+    }
+    memset(ur->recv_bufs, 0, RTN_URING_RECV_BUFS * RTN_URING_BUF_SIZE);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (u64)(uintptr_t)ur->buf_ring;
+    reg.ring_entries = RTN_URING_RECV_BUFS;
+    reg.bgid         = 0;
+    if (syscall(__NR_io_uring_register, ur->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+        goto exit_error;
+    }
+
+    ur->buf_ring->tail = 0;
+    for (u16 i = 0; i < RTN_URING_RECV_BUFS; i++)   rtn_uring_recycle_buf(ur, i);
+
+    // every received buffer starts with `io_uring_recvmsg_out`, followed by
+    // the control messages and the payload (no source address)
+    ur->recv_msg.msg_namelen    = 0;
+    ur->recv_msg.msg_controllen = RTN_URING_CONTROL_SIZE;
+
+    fprintf(stderr, "[debug] io_uring engine ready (%u entries%s)\n", params.sq_entries, cfg->sqpoll ? ", SQPOLL" : "");
+    return ur;
+
+exit_error:
+    rtn_uring_destroy(ur);
+    return NULL;
+}
+
+static void
+rtn_uring_destroy(rtn_uring *ur)
+{
+    if (ur->ring_fd >= 0)   close(ur->ring_fd);
+
+    if (ur->sqes_map)                           munmap(ur->sqes_map, ur->sqes_map_len);
+    if (ur->cq_map && ur->cq_map != ur->sq_map) munmap(ur->cq_map, ur->cq_map_len);
+    if (ur->sq_map)                             munmap(ur->sq_map, ur->sq_map_len);
+    if (ur->buf_ring)                           munmap(ur->buf_ring, RTN_URING_RECV_BUFS * sizeof(struct io_uring_buf));
+
+    free(ur->recv_bufs);
+    free(ur->slot_bufs);
+    free(ur->slot_free);
+    free(ur->slots);
+    free(ur);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Receive and Send
+static void
+rtn_uring_reap(rtn_uring *ur)
+{
+    u32 head = *ur->cq.head;
+    u32 tail = rtn_uring_load_acquire(ur->cq.tail);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ur->cq.cqes[head & *ur->cq.mask];
+
+        if (cqe->user_data & RTN_URING_RECV_TAG) {
+            if (!(cqe->flags & IORING_CQE_F_MORE))  ur->recv_armed = false;
+
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                // at most one entry per provided buffer, the queue cannot overflow
+                rtn_uring_recv *r = &ur->recv_queue[ur->recv_tail++ & (RTN_URING_RECV_BUFS - 1)];
+                r->res = cqe->res;
+                r->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                ur->num_recvs += 1;
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                // out of buffers is not an error, the receive is armed again
+                // as soon as a buffer is released
+                fprintf(stderr, "io_uring recvmsg: %s\n", strerror(-cqe->res));
+            }
+        } else {
+            u32 slot = (u32)cqe->user_data;
+            ur->slot_free[ur->slot_nfree++] = slot;
+            if (cqe->res < 0 && ur->send_error == 0)    ur->send_error = -cqe->res;
+        }
+    }
+
+    rtn_uring_store_release(ur->cq.head, head);
+}
+
+static int
+rtn_uring_send(rtn_uring *ur, const struct iovec *iov, int iovcnt, const struct sockaddr_storage *daddr, socklen_t daddr_len,
+               const void *control, usize controllen, int flags)
+{
+    if (ur->slot_nfree == 0)    rtn_uring_reap(ur);
+
+    while (ur->slot_nfree == 0) {
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (rtn_uring_submit(ur, 1) < 0)    return -1;
+        rtn_uring_reap(ur);
+    }
+
+    if (ur->send_error) {
+        errno          = ur->send_error;
+        ur->send_error = 0;
+        return -1;
+    }
+
+    // gather the iovecs in the slot buffer, the caller can reuse its buffers
+    // as soon as we return
+    u32 idx = ur->slot_free[--ur->slot_nfree];
+    rtn_uring_send_slot *slot = &ur->slots[idx];
+
+    usize len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (len + iov[i].iov_len > RTN_URING_BUF_SIZE) {
+            ur->slot_free[ur->slot_nfree++] = idx;
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        memcpy(slot->buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    if (daddr_len > sizeof(slot->name))     daddr_len = sizeof(slot->name);
+    if (daddr_len > 0)                      memcpy(&slot->name, daddr, daddr_len);
+
+    if (controllen > sizeof(slot->control)) controllen = sizeof(slot->control);
+    if (controllen > 0)                     memcpy(slot->control, control, controllen);
+
+    slot->iov[0].iov_base    = slot->buf;
+    slot->iov[0].iov_len     = len;
+    slot->msg.msg_name       = daddr_len > 0 ? &slot->name : NULL;
+    slot->msg.msg_namelen    = daddr_len;
+    slot->msg.msg_iov        = slot->iov;
+    slot->msg.msg_iovlen     = 1;
+    slot->msg.msg_control    = controllen > 0 ? slot->control : NULL;
+    slot->msg.msg_controllen = controllen;
+
+    struct io_uring_sqe *sqe = rtn_uring_get_sqe(ur);
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = ur->sock_fd;
+    sqe->addr      = (u64)(uintptr_t)&slot->msg;
+    sqe->len       = 1;
+    sqe->msg_flags = flags & ~(MSG_MORE | MSG_DONTWAIT);
+    sqe->user_data = idx;
+
+    ur->num_sends += 1;
+
+    if (!(flags & MSG_MORE) && rtn_uring_submit(ur, 0) < 0)     return -1;
+
+    return len;
+}
+
+static int
+rtn_uring_receive(rtn_uring *ur, rtn_uring_msg *msg, int flags)
+{
+    for (;;) {
+        rtn_uring_reap(ur);
+
+        if (ur->recv_head != ur->recv_tail) {
+            rtn_uring_recv *r = &ur->recv_queue[ur->recv_head++ & (RTN_URING_RECV_BUFS - 1)];
+
+            u8 *buf = rtn_uring_recv_buf(ur, r->bid);
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+            u8 *control = buf + sizeof(*out) + ur->recv_msg.msg_namelen;
+            u8 *payload = control + ur->recv_msg.msg_controllen;
+
+            memset(&msg->hdr, 0, sizeof(msg->hdr));
+            msg->hdr.msg_control    = control;
+            msg->hdr.msg_controllen = out->controllen;
+            msg->hdr.msg_flags      = out->flags;
+            msg->data               = payload;
+            msg->len                = (int)((buf + r->res) - payload);
+            msg->bid                = r->bid;
+            return msg->len;
+        }
+
+        if (!ur->recv_armed) {
+            rtn_uring_arm_recv(ur);
+            if (rtn_uring_submit(ur, 0) < 0)    return -1;
+        }
+
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (rtn_uring_submit(ur, 1) < 0)    return -1;
+    }
+}
+
+static void
+rtn_uring_release(rtn_uring *ur, rtn_uring_msg *msg)
+{
+    rtn_uring_recycle_buf(ur, msg->bid);
+
+    // the multishot receive stops when it runs out of buffers
+    if (!ur->recv_armed) {
+        rtn_uring_arm_recv(ur);
+        rtn_uring_submit(ur, 0);
+    }
+}
+
+static int
+rtn_uring_poll(rtn_uring *ur, int timeout_ms)
+{
+    rtn_uring_reap(ur);
+    if (ur->recv_head != ur->recv_tail)     return 1;
+
+    if (!ur->recv_armed) {
+        rtn_uring_arm_recv(ur);
+        if (rtn_uring_submit(ur, 0) < 0)    return -1;
+    }
+
+    // the ring fd is readable when the CQ is not empty, a send completion
+    // wakes us up as well: the caller checks again
+    struct pollfd pfd = { .fd = ur->ring_fd, .events = POLLIN };
+    int res = poll(&pfd, 1, timeout_ms);
+    if (res <= 0)   return res;
+
+    rtn_uring_reap(ur);
+    return ur->recv_head != ur->recv_tail;
+}
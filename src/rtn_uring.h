@@ -0,0 +1,157 @@
+#ifndef RTN_URING_H
+#define RTN_URING_H
+
+#include "rtn_base.h"
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/syscall.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// # io_uring Engine
+//
+// Asynchronous I/O engine of `rtn_socket`, built directly on the io_uring
+// syscalls (no liburing). The engine works on kernel sockets (UDP, raw):
+//
+// - sends are SENDMSG requests from a pool of preallocated slots, the payload
+//   is copied in the slot so the caller can reuse its buffer right away. A
+//   slot is recycled when its completion is reaped. The slots are not
+//   registered buffers (IORING_REGISTER_BUFFERS): SENDMSG does not use them,
+//   and the zero-copy sends that do need a notification per send before the
+//   slot can be reused, which costs more than the copy of a small packet.
+// - receives are a single multishot RECVMSG request that picks its buffers
+//   from a ring of provided buffers (IORING_REGISTER_PBUF_RING). Each
+//   completion carries the payload and the control messages (timestamps).
+//
+// Completions are reaped without blocking whenever the engine is used, the
+// receive completions are queued until the caller consumes them. With
+// SQPOLL a kernel thread polls the submission ring, so submitting a request
+// does not need a syscall at all.
+
+#define RTN_URING_ENTRIES       256
+#define RTN_URING_SEND_SLOTS    64
+#define RTN_URING_RECV_BUFS     256     // power of 2
+#define RTN_URING_BUF_SIZE      2048
+#define RTN_URING_CONTROL_SIZE  128
+#define RTN_URING_SQPOLL_IDLE   1000    // ms
+
+typedef struct rtn_uring_config rtn_uring_config;
+struct rtn_uring_config
+{
+    bool  sqpoll;
+    int   sqpoll_cpu;       // -1: let the kernel choose
+};
+
+typedef struct rtn_uring_sq rtn_uring_sq;
+struct rtn_uring_sq
+{
+    u32  *head;
+    u32  *tail;
+    u32  *mask;
+    u32  *flags;
+    u32  *array;
+    struct io_uring_sqe *sqes;
+    u32   pending;          // SQEs written but not submitted yet
+};
+
+typedef struct rtn_uring_cq rtn_uring_cq;
+struct rtn_uring_cq
+{
+    u32  *head;
+    u32  *tail;
+    u32  *mask;
+    struct io_uring_cqe *cqes;
+};
+
+// A receive completion waiting to be consumed
+typedef struct rtn_uring_recv rtn_uring_recv;
+struct rtn_uring_recv
+{
+    i32  res;
+    u16  bid;
+};
+
+typedef struct rtn_uring_send_slot rtn_uring_send_slot;
+struct rtn_uring_send_slot
+{
+    struct msghdr           msg;
+    struct iovec            iov[1];
+    struct sockaddr_storage name;
+    u8                      control[RTN_URING_CONTROL_SIZE];
+    u8                     *buf;
+};
+
+typedef struct rtn_uring rtn_uring;
+struct rtn_uring
+{
+    int    ring_fd;
+    int    sock_fd;
+    u32    setup_flags;
+
+    void  *sq_map;
+    usize  sq_map_len;
+    void  *cq_map;          // same as sq_map with IORING_FEAT_SINGLE_MMAP
+    usize  cq_map_len;
+    void  *sqes_map;
+    usize  sqes_map_len;
+
+    rtn_uring_sq sq;
+    rtn_uring_cq cq;
+
+    // send slots, free list of indexes
+    rtn_uring_send_slot *slots;
+    u8                  *slot_bufs;
+    u32                 *slot_free;
+    u32                  slot_nfree;
+    int                  send_error;    // first error reported by a send completion
+
+    // provided buffers and the multishot receive
+    struct io_uring_buf_ring *buf_ring;
+    u8                       *recv_bufs;
+    struct msghdr             recv_msg;
+    bool                      recv_armed;
+
+    // reaped receive completions
+    rtn_uring_recv  recv_queue[RTN_URING_RECV_BUFS];
+    u32             recv_head;
+    u32             recv_tail;
+
+    // stats
+    u64    num_enter;       // io_uring_enter calls
+    u64    num_sends;
+    u64    num_recvs;
+};
+
+// A received message, valid until `rtn_uring_release`
+typedef struct rtn_uring_msg rtn_uring_msg;
+struct rtn_uring_msg
+{
+    u8            *data;
+    int            len;
+    struct msghdr  hdr;     // msg_control/msg_controllen point to the received cmsgs
+    u16            bid;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// # Create and Destroy
+static rtn_uring *rtn_uring_new     (int sock_fd, const rtn_uring_config *cfg);
+static void       rtn_uring_destroy (rtn_uring *ur);
+
+////////////////////////////////////////////////////////////////////////////////
+// # Receive and Send
+//
+// Same semantics of send/recv: MSG_DONTWAIT returns -1 with EAGAIN when no
+// message has been received yet, MSG_MORE queues the request without
+// submitting it (the next send without MSG_MORE submits everything).
+static int  rtn_uring_send    (rtn_uring *ur, const struct iovec *iov, int iovcnt, const struct sockaddr_storage *daddr, socklen_t daddr_len,
+                               const void *control, usize controllen, int flags);
+static int  rtn_uring_receive (rtn_uring *ur, rtn_uring_msg *msg, int flags);
+static void rtn_uring_release (rtn_uring *ur, rtn_uring_msg *msg);
+
+// Reap all the available completions without blocking.
+static void rtn_uring_reap    (rtn_uring *ur);
+
+// Wait up to `timeout_ms` for a received message, returns 1 when one is ready.
+static int  rtn_uring_poll    (rtn_uring *ur, int timeout_ms);
+
+#endif // RTN_URING_H
@@ -0,0 +1,415 @@
+#include "rtn_xdp.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// # Rings
+static inline u32 rtn_xsk_load_acquire  (u32 *ptr)          { return __atomic_load_n(ptr, __ATOMIC_ACQUIRE); }
+static inline void rtn_xsk_store_release (u32 *ptr, u32 val) { __atomic_store_n(ptr, val, __ATOMIC_RELEASE); }
+
+// Number of entries the consumer can read from a RX/completion ring.
+static inline u32
+rtn_xsk_ring_cons_avail(rtn_xsk_ring *r)
+{
+    return rtn_xsk_load_acquire(r->producer) - *r->consumer;
+}
+
+// Number of free entries the producer can write in a TX/fill ring.
+static inline u32
+rtn_xsk_ring_prod_free(rtn_xsk_ring *r)
+{
+    return r->size - (*r->producer - rtn_xsk_load_acquire(r->consumer));
+}
+
+static inline bool rtn_xsk_ring_needs_wakeup(rtn_xsk_ring *r) { return *r->flags & XDP_RING_NEED_WAKEUP; }
+
+static int
+rtn_xsk_ring_map(int fd, rtn_xsk_ring *r, struct xdp_ring_offset *off, u32 size, usize elem_size, u64 pgoff)
+{
+    r->map_len = off->desc + size * elem_size;
+    r->map     = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        perror("mmap(xsk ring)");
+        r->map = NULL;
+        return -1;
+    }
+
+    r->producer = (u32 *)((u8 *)r->map + off->producer);
+    r->consumer = (u32 *)((u8 *)r->map + off->consumer);
+    r->flags    = (u32 *)((u8 *)r->map + off->flags);
+    r->ring     = (u8 *)r->map + off->desc;
+    r->size     = size;
+    r->mask     = size - 1;
+    return 0;
+}
+
+static void
+rtn_xsk_ring_unmap(rtn_xsk_ring *r)
+{
+    if (r->map)     munmap(r->map, r->map_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # XDP Program
+//
+// Hand assembled equivalent of:
+//
+//     if (eth->h_proto == ETH_P_IP && ip->ihl == 5 && ip->protocol == UDP &&
+//         udp->dest == port)
+//         return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+//     return XDP_PASS;
+//
+// so the tool does not depend on clang/libbpf to build an object file.
+#define BPF_INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+static inline long
+rtn_sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+rtn_xsk_load_program(rtn_xsk *xsk, u32 xdp_flags)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(u32);
+    attr.value_size  = sizeof(u32);
+    attr.max_entries = 64;
+    xsk->map_fd = rtn_sys_bpf(BPF_MAP_CREATE, &attr);
+    if (xsk->map_fd < 0) {
+        perror("bpf(BPF_MAP_CREATE)");
+        return -1;
+    }
+
+    i32 port = htons(xsk->port);
+    struct bpf_insn prog[] = {
+        /*  0 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        /*  1 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_W,   BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0),
+        /*  2 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_W,   BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0),
+        /*  3 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        /*  4 */ BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, RTN_FRAME_UDP_HLEN),
+        /*  5 */ BPF_INSN(BPF_JMP | BPF_JGT | BPF_X,   BPF_REG_4, BPF_REG_3, 14, 0),
+        /*  6 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_H,   BPF_REG_5, BPF_REG_2, offsetof(struct ethhdr, h_proto), 0),
+        /*  7 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K,   BPF_REG_5, 0, 12, htons(ETH_P_IP)),
+        /*  8 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_B,   BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct iphdr, protocol), 0),
+        /*  9 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K,   BPF_REG_5, 0, 10, IPPROTO_UDP),
+        /* 10 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_B,   BPF_REG_5, BPF_REG_2, ETH_HLEN, 0),
+        /* 11 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K,   BPF_REG_5, 0, 8, 0x45),
+        /* 12 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_H,   BPF_REG_5, BPF_REG_2, ETH_HLEN + sizeof(struct iphdr) + offsetof(struct udphdr_rtn, dest), 0),
+        /* 13 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K,   BPF_REG_5, 0, 6, port),
+        /* 14 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_W,   BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0),
+        /* 15 */ BPF_INSN(BPF_LD | BPF_DW | BPF_IMM,   BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsk->map_fd),
+        /* 16 */ BPF_INSN(0, 0, 0, 0, 0),
+        /* 17 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+        /* 18 */ BPF_INSN(BPF_JMP | BPF_CALL,          0, 0, 0, BPF_FUNC_redirect_map),
+        /* 19 */ BPF_INSN(BPF_JMP | BPF_EXIT,          0, 0, 0, 0),
+        /* 20 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        /* 21 */ BPF_INSN(BPF_JMP | BPF_EXIT,          0, 0, 0, 0),
+    };
+
+    char log[4096] = {0};
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type            = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns                = (u64)(usize)prog;
+    attr.insn_cnt             = array_size(prog);
+    attr.license              = (u64)(usize)"GPL";
+    attr.log_buf              = (u64)(usize)log;
+    attr.log_size             = sizeof(log);
+    attr.log_level            = 1;
+    xsk->prog_fd = rtn_sys_bpf(BPF_PROG_LOAD, &attr);
+    if (xsk->prog_fd < 0) {
+        perror("bpf(BPF_PROG_LOAD)");
+        error("XDP verifier log:\n%s\n", log);
+        return -1;
+    }
+
+    u32 key = xsk->queue_id;
+    u32 val = xsk->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xsk->map_fd;
+    attr.key    = (u64)(usize)&key;
+    attr.value  = (u64)(usize)&val;
+    if (rtn_sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        perror("bpf(BPF_MAP_UPDATE_ELEM)");
+        return -1;
+    }
+
+    // the program stays attached as long as the link fd is open
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = xsk->prog_fd;
+    attr.link_create.target_ifindex = xsk->ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    attr.link_create.flags          = xdp_flags;
+    xsk->link_fd = rtn_sys_bpf(BPF_LINK_CREATE, &attr);
+    if (xsk->link_fd < 0) {
+        perror("bpf(BPF_LINK_CREATE)");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Create and Destroy
+static rtn_xsk *
+rtn_xsk_new(const char *ifname, int port, const rtn_xdp_config *cfg)
+{
+    rtn_xsk *xsk = calloc(1, sizeof(rtn_xsk));
+    if (xsk == NULL) {
+        perror("calloc(xsk)");
+        return NULL;
+    }
+
+    xsk->fd       = -1;
+    xsk->map_fd   = -1;
+    xsk->prog_fd  = -1;
+    xsk->link_fd  = -1;
+    xsk->port     = port;
+    xsk->queue_id = cfg->queue_id;
+    xsk->ifname   = ifname;
+    xsk->ifindex  = if_nametoindex(ifname);
+    if (xsk->ifindex == 0) {
+        perror("if_nametoindex");
+        goto exit_error;
+    }
+
+    if (cfg->dst_mac) {
+        if (rtn_mac_from_str(cfg->dst_mac, xsk->dst_mac) < 0) {
+            error("Invalid destination MAC address: %s\n", cfg->dst_mac);
+            goto exit_error;
+        }
+        xsk->has_dst_mac = true;
+    }
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0) {
+        perror("socket(AF_XDP)");
+        goto exit_error;
+    }
+
+    // ## UMEM
+    xsk->umem_len = RTN_XSK_NUM_FRAMES * RTN_XSK_FRAME_SIZE;
+    xsk->umem     = mmap(NULL, xsk->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED) {
+        perror("mmap(umem)");
+        xsk->umem = NULL;
+        goto exit_error;
+    }
+
+    struct xdp_umem_reg mr = {
+        .addr       = (u64)(usize)xsk->umem,
+        .len        = xsk->umem_len,
+        .chunk_size = RTN_XSK_FRAME_SIZE,
+        .headroom   = 0,
+    };
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) {
+        perror("setsockopt(XDP_UMEM_REG)");
+        goto exit_error;
+    }
+
+    // ## Rings
+    int ring_size = RTN_XSK_RING_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING,       &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING,              &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING,              &ring_size, sizeof(ring_size)) < 0) {
+        perror("setsockopt(XDP rings)");
+        goto exit_error;
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+        perror("getsockopt(XDP_MMAP_OFFSETS)");
+        goto exit_error;
+    }
+
+    if (rtn_xsk_ring_map(xsk->fd, &xsk->fill, &off.fr, RTN_XSK_RING_SIZE, sizeof(u64),            XDP_UMEM_PGOFF_FILL_RING)       < 0 ||
+        rtn_xsk_ring_map(xsk->fd, &xsk->comp, &off.cr, RTN_XSK_RING_SIZE, sizeof(u64),            XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        rtn_xsk_ring_map(xsk->fd, &xsk->rx,   &off.rx, RTN_XSK_RING_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)              < 0 ||
+        rtn_xsk_ring_map(xsk->fd, &xsk->tx,   &off.tx, RTN_XSK_RING_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)              < 0) {
+        goto exit_error;
+    }
+
+    // first half of the UMEM for RX, handed to the kernel right away
+    u64 *fill = xsk->fill.ring;
+    for (u32 i = 0; i < RTN_XSK_NUM_FRAMES / 2; i++)   fill[i & xsk->fill.mask] = (u64)i * RTN_XSK_FRAME_SIZE;
+    rtn_xsk_store_release(xsk->fill.producer, RTN_XSK_NUM_FRAMES / 2);
+
+    // second half for TX
+    xsk->tx_free = malloc(RTN_XSK_NUM_FRAMES / 2 * sizeof(u64));
+    if (xsk->tx_free == NULL) {
+        perror("malloc(tx_free)");
+        goto exit_error;
+    }
+
+    for (u32 i = RTN_XSK_NUM_FRAMES / 2; i < RTN_XSK_NUM_FRAMES; i++) {
+        xsk->tx_free[xsk->tx_nfree++] = (u64)i * RTN_XSK_FRAME_SIZE;
+    }
+
+    // ## Bind
+    u32 xdp_flags  = cfg->mode == RTN_XDP_MODE_GENERIC ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+    u16 bind_flags = (cfg->mode == RTN_XDP_MODE_ZEROCOPY ? XDP_ZEROCOPY : XDP_COPY) | XDP_USE_NEED_WAKEUP;
+
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family   = AF_XDP,
+        .sxdp_ifindex  = xsk->ifindex,
+        .sxdp_queue_id = xsk->queue_id,
+        .sxdp_flags    = bind_flags,
+    };
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        perror("bind(AF_XDP)");
+        goto exit_error;
+    }
+
+    if (rtn_xsk_load_program(xsk, xdp_flags) < 0)  goto exit_error;
+
+    info("XDP socket ready on %s queue %d (%s mode)\n", ifname, xsk->queue_id, s_rtn_xdp_mode_str[cfg->mode]);
+    return xsk;
+
+exit_error:
+    rtn_xsk_destroy(xsk);
+    return NULL;
+}
+
+static void
+rtn_xsk_destroy(rtn_xsk *xsk)
+{
+    if (xsk->link_fd >= 0)  close(xsk->link_fd);
+    if (xsk->prog_fd >= 0)  close(xsk->prog_fd);
+    if (xsk->map_fd  >= 0)  close(xsk->map_fd);
+
+    rtn_xsk_ring_unmap(&xsk->fill);
+    rtn_xsk_ring_unmap(&xsk->comp);
+    rtn_xsk_ring_unmap(&xsk->rx);
+    rtn_xsk_ring_unmap(&xsk->tx);
+
+    if (xsk->fd >= 0)       close(xsk->fd);
+    if (xsk->umem)          munmap(xsk->umem, xsk->umem_len);
+
+    free(xsk->tx_free);
+    free(xsk);
+}
+
+static int
+rtn_xsk_set_dest(rtn_xsk *xsk, const struct sockaddr_in *daddr)
+{
+    u8 smac[ETH_ALEN];
+    struct in_addr saddr;
+
+    int fd  = socket(AF_INET, SOCK_DGRAM, 0);
+    int res = rtn_if_get_hwaddr(fd, xsk->ifname, smac);
+    if (res == 0)   res = rtn_if_get_ipv4(fd, xsk->ifname, &saddr);
+    close(fd);
+    if (res < 0)    return -1;
+
+    if (!xsk->has_dst_mac) {
+        if (rtn_neigh_resolve(xsk->ifname, daddr->sin_addr, xsk->dst_mac) < 0) {
+            error("Cannot resolve the MAC address of %s, pass it explicitly\n", inet_ntoa(daddr->sin_addr));
+            return -1;
+        }
+        xsk->has_dst_mac = true;
+    }
+
+    rtn_frame_tmpl_init_udp(&xsk->tmpl, smac, xsk->dst_mac, saddr, daddr->sin_addr, xsk->port, ntohs(daddr->sin_port));
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Receive and Send
+static inline void
+rtn_xsk_kick_tx(rtn_xsk *xsk)
+{
+    if (!rtn_xsk_ring_needs_wakeup(&xsk->tx))  return;
+
+    // EAGAIN/EBUSY/ENOBUFS only mean that the kernel is still busy with the
+    // previous frames, they will be picked up by the next kick
+    sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static inline void
+rtn_xsk_reclaim_tx(rtn_xsk *xsk)
+{
+    u32 n = rtn_xsk_ring_cons_avail(&xsk->comp);
+    if (n == 0)     return;
+
+    u32  cons = *xsk->comp.consumer;
+    u64 *ring = xsk->comp.ring;
+    for (u32 i = 0; i < n; i++)     xsk->tx_free[xsk->tx_nfree++] = ring[(cons + i) & xsk->comp.mask];
+
+    rtn_xsk_store_release(xsk->comp.consumer, cons + n);
+}
+
+static int
+rtn_xsk_send(rtn_xsk *xsk, const void *data, usize datasize, int flags)
+{
+    if (datasize + xsk->tmpl.hdr_len > RTN_XSK_FRAME_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    rtn_xsk_reclaim_tx(xsk);
+    while (xsk->tx_nfree == 0 || rtn_xsk_ring_prod_free(&xsk->tx) == 0) {
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        rtn_xsk_kick_tx(xsk);
+        rtn_xsk_reclaim_tx(xsk);
+    }
+
+    u64 addr = xsk->tx_free[--xsk->tx_nfree];
+    usize len = rtn_frame_build(&xsk->tmpl, xsk->umem + addr, data, datasize);
+
+    u32 prod = *xsk->tx.producer;
+    struct xdp_desc *desc = &((struct xdp_desc *)xsk->tx.ring)[prod & xsk->tx.mask];
+    desc->addr    = addr;
+    desc->len     = len;
+    desc->options = 0;
+    rtn_xsk_store_release(xsk->tx.producer, prod + 1);
+
+    if (!(flags & MSG_MORE))    rtn_xsk_kick_tx(xsk);
+
+    return datasize;
+}
+
+static int
+rtn_xsk_receive(rtn_xsk *xsk, void *data, usize datasize, int flags)
+{
+    for (;;) {
+        if (rtn_xsk_ring_cons_avail(&xsk->rx) == 0) {
+            if (rtn_xsk_ring_needs_wakeup(&xsk->fill))  recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+            if (flags & MSG_DONTWAIT) {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            continue;   // busy-poll the RX ring
+        }
+
+        u32 cons = *xsk->rx.consumer;
+        struct xdp_desc *desc = &((struct xdp_desc *)xsk->rx.ring)[cons & xsk->rx.mask];
+        u64 addr = desc->addr;
+
+        const u8 *payload = NULL;
+        isize len = rtn_frame_parse_udp(xsk->umem + addr, desc->len, xsk->port, &payload);
+        if (len >= 0) {
+            if ((usize)len > datasize)  len = datasize;
+            memcpy(data, payload, len);
+        }
+
+        rtn_xsk_store_release(xsk->rx.consumer, cons + 1);
+
+        // give the frame back to the kernel, the fill ring has room for all
+        // the RX frames so this never blocks
+        u32 prod = *xsk->fill.producer;
+        ((u64 *)xsk->fill.ring)[prod & xsk->fill.mask] = addr & ~((u64)RTN_XSK_FRAME_SIZE - 1);
+        rtn_xsk_store_release(xsk->fill.producer, prod + 1);
+
+        if (len >= 0)   return len;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef RTN_XDP_H
+#define RTN_XDP_H
+
+#include "rtn_base.h"
+#include "rtn_frame.h"
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <sys/syscall.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// # AF_XDP Socket
+//
+// Kernel-bypass backend of `rtn_socket`. A small XDP program redirects the UDP
+// datagrams addressed to our port into the XSK, everything else (ARP, ICMP,
+// ...) goes on to the kernel stack. Frames are exchanged through a UMEM split
+// in two halves: the first one feeds the fill/RX rings, the second one the
+// TX/completion rings.
+
+#define RTN_XSK_NUM_FRAMES  4096
+#define RTN_XSK_FRAME_SIZE  2048
+#define RTN_XSK_RING_SIZE   2048
+
+typedef enum
+{
+    RTN_XDP_MODE_GENERIC,   // XDP_FLAGS_SKB_MODE + XDP_COPY, works on any device (veth)
+    RTN_XDP_MODE_NATIVE,    // XDP_FLAGS_DRV_MODE + XDP_COPY
+    RTN_XDP_MODE_ZEROCOPY,  // XDP_FLAGS_DRV_MODE + XDP_ZEROCOPY
+} rtn_xdp_mode;
+
+static const char *s_rtn_xdp_mode_str[] = {
+    [RTN_XDP_MODE_GENERIC]  = "generic",
+    [RTN_XDP_MODE_NATIVE]   = "native",
+    [RTN_XDP_MODE_ZEROCOPY] = "zerocopy",
+};
+
+typedef struct rtn_xdp_config rtn_xdp_config;
+struct rtn_xdp_config
+{
+    int           queue_id;
+    rtn_xdp_mode  mode;
+    const char   *dst_mac;      // NULL: resolve it from the neighbour table
+};
+
+typedef struct rtn_xsk_ring rtn_xsk_ring;
+struct rtn_xsk_ring
+{
+    u32   *producer;
+    u32   *consumer;
+    u32   *flags;
+    void  *ring;
+    u32    mask;
+    u32    size;
+    void  *map;
+    usize  map_len;
+};
+
+typedef struct rtn_xsk rtn_xsk;
+struct rtn_xsk
+{
+    int    fd;
+    int    ifindex;
+    int    queue_id;
+    u16    port;
+    const char *ifname;
+
+    u8    *umem;
+    usize  umem_len;
+
+    rtn_xsk_ring fill;
+    rtn_xsk_ring comp;
+    rtn_xsk_ring rx;
+    rtn_xsk_ring tx;
+
+    // free TX frames (UMEM addresses), refilled from the completion ring
+    u64   *tx_free;
+    u32    tx_nfree;
+
+    // XDP program
+    int    map_fd;
+    int    prog_fd;
+    int    link_fd;
+
+    rtn_frame_tmpl tmpl;
+    u8     dst_mac[ETH_ALEN];
+    bool   has_dst_mac;
+};
+
+static inline int
+rtn_xdp_mode_from_str(const char *str)
+{
+    for (usize i = 0; i < array_size(s_rtn_xdp_mode_str); i++) {
+        if (cstr_eq(str, s_rtn_xdp_mode_str[i]))  return i;
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// # Create and Destroy
+static rtn_xsk *rtn_xsk_new     (const char *ifname, int port, const rtn_xdp_config *cfg);
+static void     rtn_xsk_destroy (rtn_xsk *xsk);
+
+static int      rtn_xsk_set_dest (rtn_xsk *xsk, const struct sockaddr_in *daddr);
+
+////////////////////////////////////////////////////////////////////////////////
+// # Receive and Send
+//
+// Same semantics of send/recv: MSG_DONTWAIT returns -1 with EAGAIN when the RX
+// ring is empty (otherwise the call busy-polls), MSG_MORE queues the frame in
+// the TX ring without waking up the kernel.
+static int rtn_xsk_send    (rtn_xsk *xsk, const void *data, usize datasize, int flags);
+static int rtn_xsk_receive (rtn_xsk *xsk, void *data, usize datasize, int flags);
+
+#endif // RTN_XDP_H